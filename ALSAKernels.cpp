@@ -0,0 +1,1155 @@
+/* ALSAKernels.cpp
+ **
+ ** Copyright (c) 2012, Code Aurora Forum. All rights reserved.
+ **
+ ** Licensed under the Apache License, Version 2.0 (the "License");
+ ** you may not use this file except in compliance with the License.
+ ** You may obtain a copy of the License at
+ **
+ **     http://www.apache.org/licenses/LICENSE-2.0
+ **
+ ** Unless required by applicable law or agreed to in writing, software
+ ** distributed under the License is distributed on an "AS IS" BASIS,
+ ** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ ** See the License for the specific language governing permissions and
+ ** limitations under the License.
+ */
+
+//
+// Sample processing kernels used by the HAL. Each kernel has a NEON and an
+// SSE2 body for the vectorizable part and a plain C loop for the tail and
+// for other targets. They all work on interleaved samples, count is in
+// samples, not frames.
+//
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__ARM_NEON__)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#endif
+#endif
+
+#include "AudioHardwareALSA.h"
+
+namespace android_audio_legacy
+{
+
+// ----------------------------------------------------------------------------
+
+static inline int16_t clamp16(int32_t sample)
+{
+    if ((sample >> 15) ^ (sample >> 31))
+        sample = 0x7FFF ^ (sample >> 31);
+    return sample;
+}
+
+//
+// dst = sat(dst + src * gain). gain is Q15, ALSA_GAIN_UNITY_Q15 and above
+// skip the multiply.
+//
+void mix_s16(int16_t *dst, const int16_t *src, size_t count, uint32_t gain)
+{
+    size_t i = 0;
+
+    if (gain >= ALSA_GAIN_UNITY_Q15) {
+#if defined(__ARM_NEON__)
+        for (; i + 8 <= count; i += 8) {
+            vst1q_s16(dst + i, vqaddq_s16(vld1q_s16(dst + i), vld1q_s16(src + i)));
+        }
+#elif defined(__SSE2__)
+        for (; i + 8 <= count; i += 8) {
+            __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+            __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+            _mm_storeu_si128((__m128i *)(dst + i), _mm_adds_epi16(d, s));
+        }
+#endif
+        for (; i < count; i++) {
+            dst[i] = clamp16((int32_t)dst[i] + src[i]);
+        }
+        return;
+    }
+
+#if defined(__ARM_NEON__)
+    int16x8_t g = vdupq_n_s16((int16_t)gain);
+    for (; i + 8 <= count; i += 8) {
+        int16x8_t s = vqrdmulhq_s16(vld1q_s16(src + i), g);
+        vst1q_s16(dst + i, vqaddq_s16(vld1q_s16(dst + i), s));
+    }
+#elif defined(__SSE2__)
+    __m128i g = _mm_set1_epi16((int16_t)gain);
+#if !defined(__SSSE3__)
+    __m128i round = _mm_set1_epi32(1 << 14);
+#endif
+    for (; i + 8 <= count; i += 8) {
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+#if defined(__SSSE3__)
+        s = _mm_mulhrs_epi16(s, g);
+#else
+        // Rebuild the 32 bit products from their halves, then round to Q15
+        __m128i pl = _mm_mullo_epi16(s, g);
+        __m128i ph = _mm_mulhi_epi16(s, g);
+        __m128i lo = _mm_add_epi32(_mm_unpacklo_epi16(pl, ph), round);
+        __m128i hi = _mm_add_epi32(_mm_unpackhi_epi16(pl, ph), round);
+        s = _mm_packs_epi32(_mm_srai_epi32(lo, 15), _mm_srai_epi32(hi, 15));
+#endif
+        __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_adds_epi16(d, s));
+    }
+#endif
+    for (; i < count; i++) {
+        int32_t s = ((int32_t)src[i] * (int32_t)gain + (1 << 14)) >> 15;
+        dst[i] = clamp16((int32_t)dst[i] + s);
+    }
+}
+
+//
+// acc += src * gain, with src scaled to [-1.0, 1.0)
+//
+void mix_s16_to_float(float *acc, const int16_t *src, size_t count, float gain)
+{
+    const float scale = gain * (1.0f / 32768.0f);
+    size_t i = 0;
+
+#if defined(__ARM_NEON__)
+    float32x4_t k = vdupq_n_f32(scale);
+    for (; i + 8 <= count; i += 8) {
+        int16x8_t s = vld1q_s16(src + i);
+        float32x4_t lo = vcvtq_f32_s32(vmovl_s16(vget_low_s16(s)));
+        float32x4_t hi = vcvtq_f32_s32(vmovl_s16(vget_high_s16(s)));
+        vst1q_f32(acc + i, vmlaq_f32(vld1q_f32(acc + i), lo, k));
+        vst1q_f32(acc + i + 4, vmlaq_f32(vld1q_f32(acc + i + 4), hi, k));
+    }
+#elif defined(__SSE2__)
+    __m128 k = _mm_set1_ps(scale);
+    for (; i + 8 <= count; i += 8) {
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+        // Sign extend to 32 bits by unpacking into the high half
+        __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(s, s), 16);
+        __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(s, s), 16);
+        _mm_storeu_ps(acc + i, _mm_add_ps(_mm_loadu_ps(acc + i),
+                      _mm_mul_ps(_mm_cvtepi32_ps(lo), k)));
+        _mm_storeu_ps(acc + i + 4, _mm_add_ps(_mm_loadu_ps(acc + i + 4),
+                      _mm_mul_ps(_mm_cvtepi32_ps(hi), k)));
+    }
+#endif
+    for (; i < count; i++) {
+        acc[i] += src[i] * scale;
+    }
+}
+
+//
+// dst = sat(src * 32768), rounded half away from zero. The vector bodies
+// add the same +-0.5 as the C loop and then truncate, so every target and
+// every split into vector and tail gives the same samples.
+//
+
+#if defined(__ARM_NEON__)
+static inline float32x4_t roundBias(float32x4_t v)
+{
+    float32x4_t half = vdupq_n_f32(0.5f);
+    return vaddq_f32(v, vbslq_f32(vcgtq_f32(v, vdupq_n_f32(0.0f)), half, vnegq_f32(half)));
+}
+#elif defined(__SSE2__)
+static inline __m128 roundBias(__m128 v)
+{
+    __m128 half = _mm_set1_ps(0.5f);
+    __m128 positive = _mm_cmpgt_ps(v, _mm_setzero_ps());
+    return _mm_add_ps(v, _mm_or_ps(_mm_and_ps(positive, half),
+                                   _mm_andnot_ps(positive, _mm_set1_ps(-0.5f))));
+}
+#endif
+
+void float_to_s16(int16_t *dst, const float *src, size_t count)
+{
+    size_t i = 0;
+
+#if defined(__ARM_NEON__)
+    float32x4_t k = vdupq_n_f32(32768.0f);
+    for (; i + 8 <= count; i += 8) {
+        // vcvtq truncates and saturates, vqmovn saturates to 16 bits
+        int32x4_t lo = vcvtq_s32_f32(roundBias(vmulq_f32(vld1q_f32(src + i), k)));
+        int32x4_t hi = vcvtq_s32_f32(roundBias(vmulq_f32(vld1q_f32(src + i + 4), k)));
+        vst1q_s16(dst + i, vcombine_s16(vqmovn_s32(lo), vqmovn_s32(hi)));
+    }
+#elif defined(__SSE2__)
+    __m128 k = _mm_set1_ps(32768.0f);
+    __m128 max = _mm_set1_ps(32767.0f);
+    __m128 min = _mm_set1_ps(-32768.0f);
+    for (; i + 8 <= count; i += 8) {
+        // Clamp first, cvttps returns 0x80000000 for out of range values
+        __m128 lo = _mm_min_ps(_mm_max_ps(roundBias(_mm_mul_ps(_mm_loadu_ps(src + i), k)),
+                                          min), max);
+        __m128 hi = _mm_min_ps(_mm_max_ps(roundBias(_mm_mul_ps(_mm_loadu_ps(src + i + 4), k)),
+                                          min), max);
+        _mm_storeu_si128((__m128i *)(dst + i),
+                         _mm_packs_epi32(_mm_cvttps_epi32(lo), _mm_cvttps_epi32(hi)));
+    }
+#endif
+    for (; i < count; i++) {
+        float f = src[i] * 32768.0f;
+        if (f >= 32767.0f)
+            dst[i] = 32767;
+        else if (f <= -32768.0f)
+            dst[i] = -32768;
+        else
+            dst[i] = (int16_t)(f > 0 ? f + 0.5f : f - 0.5f);
+    }
+}
+
+//
+// sum(x[i] * h[i]) with 32 bit accumulation, count must be a multiple of 8.
+// The caller keeps sum(|h|) within Q15 range so the sum cannot overflow.
+//
+int32_t dot_s16(const int16_t *x, const int16_t *h, size_t count)
+{
+    size_t i = 0;
+    int32_t sum = 0;
+
+#if defined(__ARM_NEON__)
+    int32x4_t acc = vdupq_n_s32(0);
+    for (; i + 8 <= count; i += 8) {
+        int16x8_t a = vld1q_s16(x + i);
+        int16x8_t b = vld1q_s16(h + i);
+        acc = vmlal_s16(acc, vget_low_s16(a), vget_low_s16(b));
+        acc = vmlal_s16(acc, vget_high_s16(a), vget_high_s16(b));
+    }
+    int32x2_t pair = vadd_s32(vget_low_s32(acc), vget_high_s32(acc));
+    sum = vget_lane_s32(vpadd_s32(pair, pair), 0);
+#elif defined(__SSE2__)
+    __m128i acc = _mm_setzero_si128();
+    for (; i + 8 <= count; i += 8) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(x + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(h + i));
+        acc = _mm_add_epi32(acc, _mm_madd_epi16(a, b));
+    }
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+    acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2, 3, 0, 1)));
+    sum = _mm_cvtsi128_si32(acc);
+#endif
+    for (; i < count; i++) {
+        sum += (int32_t)x[i] * h[i];
+    }
+    return sum;
+}
+
+//
+// PCM format conversion. Every format goes through Q31 (S32_LE), which holds
+// any of the others without loss, in chunks small enough for the stack.
+//
+
+#define CONVERT_CHUNK_SAMPLES   256
+
+size_t pcm_format_bytes(snd_pcm_format_t format)
+{
+    switch(format) {
+        case SNDRV_PCM_FORMAT_S8:
+            return 1;
+        case SNDRV_PCM_FORMAT_S24_3LE:
+            return 3;
+        case SNDRV_PCM_FORMAT_S24_LE:
+        case SNDRV_PCM_FORMAT_S32_LE:
+        case SNDRV_PCM_FORMAT_FLOAT_LE:
+            return 4;
+        default:
+        case SNDRV_PCM_FORMAT_S16_LE:
+            return 2;
+    }
+}
+
+static void s16_to_q31(int32_t *dst, const int16_t *src, size_t count)
+{
+    size_t i = 0;
+
+#if defined(__ARM_NEON__)
+    for (; i + 8 <= count; i += 8) {
+        int16x8_t s = vld1q_s16(src + i);
+        vst1q_s32(dst + i, vshll_n_s16(vget_low_s16(s), 16));
+        vst1q_s32(dst + i + 4, vshll_n_s16(vget_high_s16(s), 16));
+    }
+#elif defined(__SSE2__)
+    __m128i zero = _mm_setzero_si128();
+    for (; i + 8 <= count; i += 8) {
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_unpacklo_epi16(zero, s));
+        _mm_storeu_si128((__m128i *)(dst + i + 4), _mm_unpackhi_epi16(zero, s));
+    }
+#endif
+    for (; i < count; i++) {
+        dst[i] = (int32_t)src[i] << 16;
+    }
+}
+
+// Rounded to nearest, saturated
+static void q31_to_s16(int16_t *dst, const int32_t *src, size_t count)
+{
+    size_t i = 0;
+
+#if defined(__ARM_NEON__)
+    for (; i + 8 <= count; i += 8) {
+        int16x4_t lo = vqrshrn_n_s32(vld1q_s32(src + i), 16);
+        int16x4_t hi = vqrshrn_n_s32(vld1q_s32(src + i + 4), 16);
+        vst1q_s16(dst + i, vcombine_s16(lo, hi));
+    }
+#elif defined(__SSE2__)
+    __m128i one = _mm_set1_epi32(1);
+    for (; i + 8 <= count; i += 8) {
+        // Shift in two steps so adding the rounding bit cannot overflow
+        __m128i lo = _mm_srai_epi32(_mm_loadu_si128((const __m128i *)(src + i)), 15);
+        __m128i hi = _mm_srai_epi32(_mm_loadu_si128((const __m128i *)(src + i + 4)), 15);
+        lo = _mm_srai_epi32(_mm_add_epi32(lo, one), 1);
+        hi = _mm_srai_epi32(_mm_add_epi32(hi, one), 1);
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_packs_epi32(lo, hi));
+    }
+#endif
+    for (; i < count; i++) {
+        dst[i] = clamp16(((src[i] >> 15) + 1) >> 1);
+    }
+}
+
+static void s24_to_q31(int32_t *dst, const int32_t *src, size_t count)
+{
+    size_t i = 0;
+
+#if defined(__ARM_NEON__)
+    for (; i + 4 <= count; i += 4) {
+        vst1q_s32(dst + i, vshlq_n_s32(vld1q_s32(src + i), 8));
+    }
+#elif defined(__SSE2__)
+    for (; i + 4 <= count; i += 4) {
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_slli_epi32(s, 8));
+    }
+#endif
+    for (; i < count; i++) {
+        dst[i] = (int32_t)((uint32_t)src[i] << 8);
+    }
+}
+
+//
+// Truncated, only 32 bit and float sources carry more than 24 bits. The
+// result is sign extended so the upper byte is valid either way.
+//
+static void q31_to_s24(int32_t *dst, const int32_t *src, size_t count)
+{
+    size_t i = 0;
+
+#if defined(__ARM_NEON__)
+    for (; i + 4 <= count; i += 4) {
+        vst1q_s32(dst + i, vshrq_n_s32(vld1q_s32(src + i), 8));
+    }
+#elif defined(__SSE2__)
+    for (; i + 4 <= count; i += 4) {
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_srai_epi32(s, 8));
+    }
+#endif
+    for (; i < count; i++) {
+        dst[i] = src[i] >> 8;
+    }
+}
+
+static void s24_3_to_q31(int32_t *dst, const uint8_t *src, size_t count)
+{
+    size_t i = 0;
+
+#if defined(__ARM_NEON__)
+    uint8x16x4_t q;
+    q.val[0] = vdupq_n_u8(0);
+    for (; i + 16 <= count; i += 16) {
+        uint8x16x3_t s = vld3q_u8(src + i * 3);
+        q.val[1] = s.val[0];
+        q.val[2] = s.val[1];
+        q.val[3] = s.val[2];
+        vst4q_u8((uint8_t *)(dst + i), q);
+    }
+#elif defined(__SSSE3__)
+    // Each 4 byte lane takes 3 source bytes above a zero low byte. The
+    // load reads 4 bytes past the 4 samples, so stop 2 samples early.
+    const __m128i shuffle = _mm_setr_epi8(-1, 0, 1, 2, -1, 3, 4, 5,
+                                          -1, 6, 7, 8, -1, 9, 10, 11);
+    for (; i + 6 <= count; i += 4) {
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + i * 3));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_shuffle_epi8(s, shuffle));
+    }
+#endif
+    for (; i < count; i++) {
+        const uint8_t *p = src + i * 3;
+        dst[i] = (int32_t)(((uint32_t)p[0] << 8) | ((uint32_t)p[1] << 16) |
+                           ((uint32_t)p[2] << 24));
+    }
+}
+
+static void q31_to_s24_3(uint8_t *dst, const int32_t *src, size_t count)
+{
+    size_t i = 0;
+
+#if defined(__ARM_NEON__)
+    for (; i + 16 <= count; i += 16) {
+        uint8x16x4_t s = vld4q_u8((const uint8_t *)(src + i));
+        uint8x16x3_t d;
+        d.val[0] = s.val[1];
+        d.val[1] = s.val[2];
+        d.val[2] = s.val[3];
+        vst3q_u8(dst + i * 3, d);
+    }
+#elif defined(__SSSE3__)
+    // The store writes 4 bytes past the 4 samples, the next pass or the
+    // tail overwrites them, so stop 2 samples early
+    const __m128i shuffle = _mm_setr_epi8(1, 2, 3, 5, 6, 7, 9, 10,
+                                          11, 13, 14, 15, -1, -1, -1, -1);
+    for (; i + 6 <= count; i += 4) {
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+        _mm_storeu_si128((__m128i *)(dst + i * 3), _mm_shuffle_epi8(s, shuffle));
+    }
+#endif
+    for (; i < count; i++) {
+        uint8_t *p = dst + i * 3;
+        p[0] = (uint8_t)(src[i] >> 8);
+        p[1] = (uint8_t)(src[i] >> 16);
+        p[2] = (uint8_t)(src[i] >> 24);
+    }
+}
+
+// Saturated to [-1.0, 1.0), rounded like float_to_s16()
+static void float_to_q31(int32_t *dst, const float *src, size_t count)
+{
+    size_t i = 0;
+
+#if defined(__ARM_NEON__)
+    float32x4_t k = vdupq_n_f32(2147483648.0f);
+    for (; i + 4 <= count; i += 4) {
+        // vcvtq truncates and saturates
+        vst1q_s32(dst + i, vcvtq_s32_f32(roundBias(vmulq_f32(vld1q_f32(src + i), k))));
+    }
+#elif defined(__SSE2__)
+    __m128 k = _mm_set1_ps(2147483648.0f);
+    for (; i + 4 <= count; i += 4) {
+        __m128 f = roundBias(_mm_mul_ps(_mm_loadu_ps(src + i), k));
+        // cvttps returns 0x80000000 out of range, which is right for the
+        // negative side and flips to 0x7FFFFFFF for the positive one
+        __m128i over = _mm_castps_si128(_mm_cmpge_ps(f, k));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(_mm_cvttps_epi32(f), over));
+    }
+#endif
+    for (; i < count; i++) {
+        float f = src[i] * 2147483648.0f;
+        if (f >= 2147483648.0f)
+            dst[i] = 0x7FFFFFFF;
+        else if (f <= -2147483648.0f)
+            dst[i] = (int32_t)0x80000000;
+        else
+            dst[i] = (int32_t)(f > 0 ? f + 0.5f : f - 0.5f);
+    }
+}
+
+static void q31_to_float(float *dst, const int32_t *src, size_t count)
+{
+    size_t i = 0;
+
+#if defined(__ARM_NEON__)
+    for (; i + 4 <= count; i += 4) {
+        vst1q_f32(dst + i, vcvtq_n_f32_s32(vld1q_s32(src + i), 31));
+    }
+#elif defined(__SSE2__)
+    __m128 k = _mm_set1_ps(1.0f / 2147483648.0f);
+    for (; i + 4 <= count; i += 4) {
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+        _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_cvtepi32_ps(s), k));
+    }
+#endif
+    for (; i < count; i++) {
+        dst[i] = src[i] * (1.0f / 2147483648.0f);
+    }
+}
+
+static void to_q31(int32_t *dst, const void *src, snd_pcm_format_t format, size_t count)
+{
+    switch(format) {
+        case SNDRV_PCM_FORMAT_S8:
+            for (size_t i = 0; i < count; i++)
+                dst[i] = (int32_t)((const int8_t *)src)[i] << 24;
+            break;
+        case SNDRV_PCM_FORMAT_S16_LE:
+            s16_to_q31(dst, (const int16_t *)src, count);
+            break;
+        case SNDRV_PCM_FORMAT_S24_LE:
+            s24_to_q31(dst, (const int32_t *)src, count);
+            break;
+        case SNDRV_PCM_FORMAT_S24_3LE:
+            s24_3_to_q31(dst, (const uint8_t *)src, count);
+            break;
+        case SNDRV_PCM_FORMAT_FLOAT_LE:
+            float_to_q31(dst, (const float *)src, count);
+            break;
+        default:
+            memcpy(dst, src, count * sizeof(int32_t));
+            break;
+    }
+}
+
+static void from_q31(void *dst, const int32_t *src, snd_pcm_format_t format, size_t count)
+{
+    switch(format) {
+        case SNDRV_PCM_FORMAT_S8:
+            for (size_t i = 0; i < count; i++) {
+                int32_t s = ((src[i] >> 23) + 1) >> 1;
+                ((int8_t *)dst)[i] = s > 127 ? 127 : s;
+            }
+            break;
+        case SNDRV_PCM_FORMAT_S16_LE:
+            q31_to_s16((int16_t *)dst, src, count);
+            break;
+        case SNDRV_PCM_FORMAT_S24_LE:
+            q31_to_s24((int32_t *)dst, src, count);
+            break;
+        case SNDRV_PCM_FORMAT_S24_3LE:
+            q31_to_s24_3((uint8_t *)dst, src, count);
+            break;
+        case SNDRV_PCM_FORMAT_FLOAT_LE:
+            q31_to_float((float *)dst, src, count);
+            break;
+        default:
+            memcpy(dst, src, count * sizeof(int32_t));
+            break;
+    }
+}
+
+void convert_pcm(void *dst, snd_pcm_format_t dstFormat,
+                 const void *src, snd_pcm_format_t srcFormat, size_t count)
+{
+    size_t srcBytes = pcm_format_bytes(srcFormat);
+    size_t dstBytes = pcm_format_bytes(dstFormat);
+    const uint8_t *s = (const uint8_t *)src;
+    uint8_t *d = (uint8_t *)dst;
+    int32_t tmp[CONVERT_CHUNK_SAMPLES];
+
+    if (srcFormat == dstFormat) {
+        memcpy(dst, src, count * srcBytes);
+        return;
+    }
+
+    while (count) {
+        size_t n = count < CONVERT_CHUNK_SAMPLES ? count : CONVERT_CHUNK_SAMPLES;
+        const int32_t *q;
+
+        // Skip the intermediate copy when either side already is Q31
+        if (srcFormat == SNDRV_PCM_FORMAT_S32_LE) {
+            q = (const int32_t *)s;
+        } else {
+            int32_t *t = (dstFormat == SNDRV_PCM_FORMAT_S32_LE) ? (int32_t *)d : tmp;
+            to_q31(t, s, srcFormat, n);
+            q = t;
+        }
+        if (dstFormat != SNDRV_PCM_FORMAT_S32_LE) {
+            from_q31(d, q, dstFormat, n);
+        }
+
+        s += n * srcBytes;
+        d += n * dstBytes;
+        count -= n;
+    }
+}
+
+//
+// Channel reordering. map[o] is the input channel copied to output channel
+// o, or negative for silence. dst and src must not overlap.
+//
+void remap_s16(int16_t *dst, uint32_t outChannels, const int16_t *src,
+               uint32_t inChannels, const int8_t *map, size_t frames)
+{
+    size_t i = 0;
+
+#if defined(__ARM_NEON__) || defined(__SSSE3__)
+    // One frame of up to 8 channels fits a register. Each pass loads and
+    // stores a full register, the bytes past the frame are rewritten by
+    // the next pass, so stop while a whole register still fits.
+    uint8_t index[16];
+    memset(index, 0xFF, sizeof(index));
+    for (uint32_t o = 0; o < outChannels; o++) {
+        if (map[o] >= 0) {
+            index[2 * o] = 2 * map[o];
+            index[2 * o + 1] = 2 * map[o] + 1;
+        }
+    }
+#if defined(__ARM_NEON__)
+    uint8x8_t lo = vld1_u8(index);
+    uint8x8_t hi = vld1_u8(index + 8);
+    for (; (i * inChannels + 8 <= frames * inChannels) &&
+           (i * outChannels + 8 <= frames * outChannels); i++) {
+        uint8x16_t v = vreinterpretq_u8_s16(vld1q_s16(src + i * inChannels));
+        uint8x8x2_t table = { { vget_low_u8(v), vget_high_u8(v) } };
+        // vtbl returns 0 for the out of range 0xFF indices
+        uint8x16_t r = vcombine_u8(vtbl2_u8(table, lo), vtbl2_u8(table, hi));
+        vst1q_s16(dst + i * outChannels, vreinterpretq_s16_u8(r));
+    }
+#else
+    // pshufb zeroes lanes whose index has the top bit set
+    __m128i shuffle = _mm_loadu_si128((const __m128i *)index);
+    for (; (i * inChannels + 8 <= frames * inChannels) &&
+           (i * outChannels + 8 <= frames * outChannels); i++) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i * inChannels));
+        _mm_storeu_si128((__m128i *)(dst + i * outChannels), _mm_shuffle_epi8(v, shuffle));
+    }
+#endif
+#endif
+    for (; i < frames; i++) {
+        const int16_t *in = src + i * inChannels;
+        int16_t *out = dst + i * outChannels;
+        for (uint32_t o = 0; o < outChannels; o++) {
+            out[o] = map[o] >= 0 ? in[map[o]] : 0;
+        }
+    }
+}
+
+//
+// Channel mixing, out[o] = sat(sum(in[c] * matrix[o * 8 + c])). Rows hold
+// 8 Q14 coefficients, zero past inChannels, and their absolute sum must
+// stay below 4.0 so the 32 bit sums cannot overflow. dst and src must not
+// overlap.
+//
+void remix_s16(int16_t *dst, uint32_t outChannels, const int16_t *src,
+               uint32_t inChannels, const int16_t *matrix, size_t frames)
+{
+    size_t i = 0;
+
+    // Same full register loads as remap_s16(), the zero coefficients
+    // cancel whatever follows the frame
+#if defined(__ARM_NEON__)
+    for (; i * inChannels + 8 <= frames * inChannels; i++) {
+        int16x8_t v = vld1q_s16(src + i * inChannels);
+        for (uint32_t o = 0; o < outChannels; o++) {
+            int16x8_t m = vld1q_s16(matrix + o * 8);
+            int32x4_t acc = vmull_s16(vget_low_s16(v), vget_low_s16(m));
+            acc = vmlal_s16(acc, vget_high_s16(v), vget_high_s16(m));
+            int32x2_t pair = vadd_s32(vget_low_s32(acc), vget_high_s32(acc));
+            pair = vpadd_s32(pair, pair);
+            // Rounding, saturating narrow from Q14
+            dst[i * outChannels + o] =
+                vget_lane_s16(vqrshrn_n_s32(vcombine_s32(pair, pair), 14), 0);
+        }
+    }
+#elif defined(__SSE2__)
+    for (; i * inChannels + 8 <= frames * inChannels; i++) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + i * inChannels));
+        for (uint32_t o = 0; o < outChannels; o++) {
+            __m128i m = _mm_loadu_si128((const __m128i *)(matrix + o * 8));
+            __m128i acc = _mm_madd_epi16(v, m);
+            acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+            acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2, 3, 0, 1)));
+            dst[i * outChannels + o] = clamp16((_mm_cvtsi128_si32(acc) + (1 << 13)) >> 14);
+        }
+    }
+#endif
+    for (; i < frames; i++) {
+        const int16_t *in = src + i * inChannels;
+        for (uint32_t o = 0; o < outChannels; o++) {
+            const int16_t *m = matrix + o * 8;
+            int32_t acc = 0;
+            for (uint32_t c = 0; c < inChannels; c++) {
+                acc += (int32_t)in[c] * m[c];
+            }
+            dst[i * outChannels + o] = clamp16((acc + (1 << 13)) >> 14);
+        }
+    }
+}
+
+//
+// Multi-mic capture. Each channel goes to its own plane, plane c starting
+// at dst + c * frames. 2 and 4 channels take the vector loads which split
+// the channels as they go, SSE2 gets there by unzipping 16 bit lanes
+// twice. dst and src must not overlap.
+//
+
+#if !defined(__ARM_NEON__) && defined(__SSE2__)
+static inline void unzip_epi16(__m128i a, __m128i b, __m128i *even, __m128i *odd)
+{
+    // Sign extended halves are in range, the saturating pack only narrows
+    *even = _mm_packs_epi32(_mm_srai_epi32(_mm_slli_epi32(a, 16), 16),
+                            _mm_srai_epi32(_mm_slli_epi32(b, 16), 16));
+    *odd = _mm_packs_epi32(_mm_srai_epi32(a, 16), _mm_srai_epi32(b, 16));
+}
+#endif
+
+void deinterleave_s16(int16_t *dst, const int16_t *src, uint32_t channels, size_t frames)
+{
+    size_t i = 0;
+
+#if defined(__ARM_NEON__)
+    if (channels == 2) {
+        for (; i + 8 <= frames; i += 8) {
+            int16x8x2_t v = vld2q_s16(src + 2 * i);
+            vst1q_s16(dst + i, v.val[0]);
+            vst1q_s16(dst + frames + i, v.val[1]);
+        }
+    } else if (channels == 4) {
+        for (; i + 8 <= frames; i += 8) {
+            int16x8x4_t v = vld4q_s16(src + 4 * i);
+            vst1q_s16(dst + i, v.val[0]);
+            vst1q_s16(dst + frames + i, v.val[1]);
+            vst1q_s16(dst + 2 * frames + i, v.val[2]);
+            vst1q_s16(dst + 3 * frames + i, v.val[3]);
+        }
+    }
+#elif defined(__SSE2__)
+    if (channels == 2) {
+        for (; i + 8 <= frames; i += 8) {
+            __m128i c0, c1;
+            unzip_epi16(_mm_loadu_si128((const __m128i *)(src + 2 * i)),
+                        _mm_loadu_si128((const __m128i *)(src + 2 * i + 8)), &c0, &c1);
+            _mm_storeu_si128((__m128i *)(dst + i), c0);
+            _mm_storeu_si128((__m128i *)(dst + frames + i), c1);
+        }
+    } else if (channels == 4) {
+        for (; i + 8 <= frames; i += 8) {
+            const int16_t *in = src + 4 * i;
+            __m128i e01, o01, e23, o23, c0, c1, c2, c3;
+            // Pairs of frames hold channels 0 and 2 in the even lanes and
+            // 1 and 3 in the odd ones
+            unzip_epi16(_mm_loadu_si128((const __m128i *)in),
+                        _mm_loadu_si128((const __m128i *)(in + 8)), &e01, &o01);
+            unzip_epi16(_mm_loadu_si128((const __m128i *)(in + 16)),
+                        _mm_loadu_si128((const __m128i *)(in + 24)), &e23, &o23);
+            unzip_epi16(e01, e23, &c0, &c2);
+            unzip_epi16(o01, o23, &c1, &c3);
+            _mm_storeu_si128((__m128i *)(dst + i), c0);
+            _mm_storeu_si128((__m128i *)(dst + frames + i), c1);
+            _mm_storeu_si128((__m128i *)(dst + 2 * frames + i), c2);
+            _mm_storeu_si128((__m128i *)(dst + 3 * frames + i), c3);
+        }
+    }
+#endif
+    for (; i < frames; i++) {
+        const int16_t *in = src + i * channels;
+        for (uint32_t c = 0; c < channels; c++) {
+            dst[c * frames + i] = in[c];
+        }
+    }
+}
+
+//
+// Mono mix of every channel, the mean rounded down. Cheaper than a
+// remix_s16() row for the 2 and 4 mic cases, which need no multiply.
+// dst and src must not overlap.
+//
+void downmix_s16(int16_t *dst, const int16_t *src, uint32_t channels, size_t frames)
+{
+    size_t i = 0;
+
+#if defined(__ARM_NEON__)
+    if (channels == 2) {
+        for (; i + 8 <= frames; i += 8) {
+            int16x8x2_t v = vld2q_s16(src + 2 * i);
+            vst1q_s16(dst + i, vhaddq_s16(v.val[0], v.val[1]));
+        }
+    } else if (channels == 4) {
+        for (; i + 8 <= frames; i += 8) {
+            int16x8x4_t v = vld4q_s16(src + 4 * i);
+            int32x4_t lo = vaddq_s32(vaddl_s16(vget_low_s16(v.val[0]), vget_low_s16(v.val[1])),
+                                     vaddl_s16(vget_low_s16(v.val[2]), vget_low_s16(v.val[3])));
+            int32x4_t hi = vaddq_s32(vaddl_s16(vget_high_s16(v.val[0]), vget_high_s16(v.val[1])),
+                                     vaddl_s16(vget_high_s16(v.val[2]), vget_high_s16(v.val[3])));
+            vst1q_s16(dst + i, vcombine_s16(vshrn_n_s32(lo, 2), vshrn_n_s32(hi, 2)));
+        }
+    }
+#elif defined(__SSE2__)
+    __m128i ones = _mm_set1_epi16(1);
+    if (channels == 2) {
+        for (; i + 8 <= frames; i += 8) {
+            __m128i a = _mm_madd_epi16(_mm_loadu_si128((const __m128i *)(src + 2 * i)), ones);
+            __m128i b = _mm_madd_epi16(_mm_loadu_si128((const __m128i *)(src + 2 * i + 8)), ones);
+            _mm_storeu_si128((__m128i *)(dst + i),
+                             _mm_packs_epi32(_mm_srai_epi32(a, 1), _mm_srai_epi32(b, 1)));
+        }
+    } else if (channels == 4) {
+        for (; i + 8 <= frames; i += 8) {
+            __m128 s[4];
+            __m128i sum[2];
+            for (int k = 0; k < 4; k++) {
+                s[k] = _mm_castsi128_ps(_mm_madd_epi16(
+                        _mm_loadu_si128((const __m128i *)(src + 4 * i + 8 * k)), ones));
+            }
+            // Each frame is an even and an odd pair sum of the madd
+            for (int k = 0; k < 2; k++) {
+                __m128i even = _mm_castps_si128(_mm_shuffle_ps(s[2 * k], s[2 * k + 1],
+                                                               _MM_SHUFFLE(2, 0, 2, 0)));
+                __m128i odd = _mm_castps_si128(_mm_shuffle_ps(s[2 * k], s[2 * k + 1],
+                                                              _MM_SHUFFLE(3, 1, 3, 1)));
+                sum[k] = _mm_srai_epi32(_mm_add_epi32(even, odd), 2);
+            }
+            _mm_storeu_si128((__m128i *)(dst + i), _mm_packs_epi32(sum[0], sum[1]));
+        }
+    }
+#endif
+    for (; i < frames; i++) {
+        const int16_t *in = src + i * channels;
+        int32_t sum = 0;
+        for (uint32_t c = 0; c < channels; c++) {
+            sum += in[c];
+        }
+        if (channels == 2)
+            dst[i] = sum >> 1;
+        else if (channels == 4)
+            dst[i] = sum >> 2;
+        else
+            dst[i] = sum / (int32_t)channels;
+    }
+}
+
+//
+// Stream volume. left and right apply to the two channels of a stereo
+// stream, any other layout takes left for every channel. dst may be src.
+//
+
+static inline int16_t gainQ15(float gain)
+{
+    int32_t q = (int32_t)(gain * 32768.0f + 0.5f);
+    return q > 0x7FFF ? 0x7FFF : (q < 0 ? 0 : q);
+}
+
+void volume_s16(int16_t *dst, const int16_t *src, size_t frames, uint32_t channels,
+                float left, float right)
+{
+    size_t count = frames * channels;
+    int16_t gl = gainQ15(left);
+    int16_t gr = channels == 2 ? gainQ15(right) : gl;
+    size_t i = 0;
+
+    // gl and gr alternate, so every vector starts on a left sample
+#if defined(__ARM_NEON__)
+    int16x8_t g = vcombine_s16(vreinterpret_s16_u32(vdup_n_u32((uint16_t)gl | ((uint32_t)gr << 16))),
+                               vreinterpret_s16_u32(vdup_n_u32((uint16_t)gl | ((uint32_t)gr << 16))));
+    for (; i + 8 <= count; i += 8) {
+        vst1q_s16(dst + i, vqrdmulhq_s16(vld1q_s16(src + i), g));
+    }
+#elif defined(__SSE2__)
+    __m128i g = _mm_setr_epi16(gl, gr, gl, gr, gl, gr, gl, gr);
+#if !defined(__SSSE3__)
+    __m128i round = _mm_set1_epi32(1 << 14);
+#endif
+    for (; i + 8 <= count; i += 8) {
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+#if defined(__SSSE3__)
+        s = _mm_mulhrs_epi16(s, g);
+#else
+        __m128i pl = _mm_mullo_epi16(s, g);
+        __m128i ph = _mm_mulhi_epi16(s, g);
+        __m128i lo = _mm_add_epi32(_mm_unpacklo_epi16(pl, ph), round);
+        __m128i hi = _mm_add_epi32(_mm_unpackhi_epi16(pl, ph), round);
+        s = _mm_packs_epi32(_mm_srai_epi32(lo, 15), _mm_srai_epi32(hi, 15));
+#endif
+        _mm_storeu_si128((__m128i *)(dst + i), s);
+    }
+#endif
+    for (; i < count; i++) {
+        int32_t g = (i & 1) ? gr : gl;
+        dst[i] = ((int32_t)src[i] * g + (1 << 14)) >> 15;
+    }
+}
+
+void volume_float(float *dst, const float *src, size_t frames, uint32_t channels,
+                  float left, float right)
+{
+    size_t count = frames * channels;
+    float gr = channels == 2 ? right : left;
+    size_t i = 0;
+
+#if defined(__ARM_NEON__)
+    float32x4_t g = { left, gr, left, gr };
+    for (; i + 4 <= count; i += 4) {
+        vst1q_f32(dst + i, vmulq_f32(vld1q_f32(src + i), g));
+    }
+#elif defined(__SSE2__)
+    __m128 g = _mm_setr_ps(left, gr, left, gr);
+    for (; i + 4 <= count; i += 4) {
+        _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_loadu_ps(src + i), g));
+    }
+#endif
+    for (; i < count; i++) {
+        dst[i] = src[i] * ((i & 1) ? gr : left);
+    }
+}
+
+//
+// Linear ramps, frame n is scaled by gain + n * step, so a ramp splits
+// across calls without discontinuities. Mono and stereo are vectorized,
+// wider layouts only ramp briefly and use the plain loop.
+//
+void volume_ramp_float(float *dst, const float *src, size_t frames, uint32_t channels,
+                       float left, float right, float stepLeft, float stepRight)
+{
+    size_t f = 0;
+
+    if (channels != 2) {
+        right = left;
+        stepRight = stepLeft;
+    }
+
+#if defined(__ARM_NEON__) || defined(__SSE2__)
+    if (channels <= 2) {
+        // Four samples per vector: four mono frames or two stereo frames
+        uint32_t perVector = 4 / channels;
+        float g[4], d[4];
+        for (uint32_t k = 0; k < 4; k++) {
+            uint32_t n = k / channels;
+            g[k] = ((k % channels) ? right : left) + n * ((k % channels) ? stepRight : stepLeft);
+            d[k] = perVector * ((k % channels) ? stepRight : stepLeft);
+        }
+#if defined(__ARM_NEON__)
+        float32x4_t gv = vld1q_f32(g), dv = vld1q_f32(d);
+        for (; f + perVector <= frames; f += perVector) {
+            vst1q_f32(dst + f * channels, vmulq_f32(vld1q_f32(src + f * channels), gv));
+            gv = vaddq_f32(gv, dv);
+        }
+#else
+        __m128 gv = _mm_loadu_ps(g), dv = _mm_loadu_ps(d);
+        for (; f + perVector <= frames; f += perVector) {
+            _mm_storeu_ps(dst + f * channels, _mm_mul_ps(_mm_loadu_ps(src + f * channels), gv));
+            gv = _mm_add_ps(gv, dv);
+        }
+#endif
+    }
+#endif
+    for (; f < frames; f++) {
+        float gl = left + f * stepLeft;
+        float gr = right + f * stepRight;
+        for (uint32_t c = 0; c < channels; c++) {
+            dst[f * channels + c] = src[f * channels + c] * ((c == 1 && channels == 2) ? gr : gl);
+        }
+    }
+}
+
+void volume_ramp_s16(int16_t *dst, const int16_t *src, size_t frames, uint32_t channels,
+                     float left, float right, float stepLeft, float stepRight)
+{
+    size_t f = 0;
+
+    if (channels != 2) {
+        right = left;
+        stepRight = stepLeft;
+    }
+
+#if defined(__ARM_NEON__) || defined(__SSE2__)
+    if (channels <= 2) {
+        // Eight samples per pass, scaled in float and rounded back
+        uint32_t perPass = 8 / channels;
+        float g[8], d[4];
+        for (uint32_t k = 0; k < 8; k++) {
+            uint32_t n = k / channels;
+            g[k] = ((k % channels) ? right : left) + n * ((k % channels) ? stepRight : stepLeft);
+        }
+        for (uint32_t k = 0; k < 4; k++) {
+            d[k] = perPass * ((k % channels) ? stepRight : stepLeft);
+        }
+#if defined(__ARM_NEON__)
+        float32x4_t glo = vld1q_f32(g), ghi = vld1q_f32(g + 4), dv = vld1q_f32(d);
+        for (; f + perPass <= frames; f += perPass) {
+            int16x8_t s = vld1q_s16(src + f * channels);
+            float32x4_t lo = vmulq_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(s))), glo);
+            float32x4_t hi = vmulq_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(s))), ghi);
+            // vcvtq truncates, round half away from zero first
+            lo = roundBias(lo);
+            hi = roundBias(hi);
+            vst1q_s16(dst + f * channels, vcombine_s16(vqmovn_s32(vcvtq_s32_f32(lo)),
+                                                       vqmovn_s32(vcvtq_s32_f32(hi))));
+            glo = vaddq_f32(glo, dv);
+            ghi = vaddq_f32(ghi, dv);
+        }
+#else
+        __m128 glo = _mm_loadu_ps(g), ghi = _mm_loadu_ps(g + 4), dv = _mm_loadu_ps(d);
+        for (; f + perPass <= frames; f += perPass) {
+            __m128i s = _mm_loadu_si128((const __m128i *)(src + f * channels));
+            __m128 lo = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(s, s), 16));
+            __m128 hi = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(s, s), 16));
+            lo = roundBias(_mm_mul_ps(lo, glo));
+            hi = roundBias(_mm_mul_ps(hi, ghi));
+            _mm_storeu_si128((__m128i *)(dst + f * channels),
+                             _mm_packs_epi32(_mm_cvttps_epi32(lo), _mm_cvttps_epi32(hi)));
+            glo = _mm_add_ps(glo, dv);
+            ghi = _mm_add_ps(ghi, dv);
+        }
+#endif
+    }
+#endif
+    for (; f < frames; f++) {
+        float gl = left + f * stepLeft;
+        float gr = right + f * stepRight;
+        for (uint32_t c = 0; c < channels; c++) {
+            float v = src[f * channels + c] * ((c == 1 && channels == 2) ? gr : gl);
+            dst[f * channels + c] = clamp16((int32_t)(v > 0 ? v + 0.5f : v - 0.5f));
+        }
+    }
+}
+
+//
+// Level of a block for the capture AGC and noise suppressor. Squares are
+// at most 2^30, the NEON lanes widen pairwise into 64 bit and SSE2 adds
+// the madd pairs as unsigned, so the sum is exact for any count. The
+// magnitude saturates, -32768 counts as 32767.
+//
+uint64_t energy_s16(const int16_t *src, size_t count, int32_t *peak)
+{
+    size_t i = 0;
+    uint64_t sum = 0;
+    int32_t max = 0;
+
+#if defined(__ARM_NEON__)
+    int64x2_t acc = vdupq_n_s64(0);
+    int16x8_t pk = vdupq_n_s16(0);
+    for (; i + 8 <= count; i += 8) {
+        int16x8_t s = vld1q_s16(src + i);
+        pk = vmaxq_s16(pk, vqabsq_s16(s));
+        acc = vpadalq_s32(acc, vmull_s16(vget_low_s16(s), vget_low_s16(s)));
+        acc = vpadalq_s32(acc, vmull_s16(vget_high_s16(s), vget_high_s16(s)));
+    }
+    sum = vgetq_lane_s64(acc, 0) + vgetq_lane_s64(acc, 1);
+    int16x4_t m = vmax_s16(vget_low_s16(pk), vget_high_s16(pk));
+    m = vpmax_s16(m, m);
+    m = vpmax_s16(m, m);
+    max = vget_lane_s16(m, 0);
+#elif defined(__SSE2__)
+    __m128i zero = _mm_setzero_si128();
+    __m128i acc = zero, pk = zero;
+    for (; i + 8 <= count; i += 8) {
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i sq = _mm_madd_epi16(s, s);
+        pk = _mm_max_epi16(pk, _mm_max_epi16(s, _mm_subs_epi16(zero, s)));
+        acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(sq, zero));
+        acc = _mm_add_epi64(acc, _mm_unpackhi_epi32(sq, zero));
+    }
+    uint64_t lanes[2];
+    int16_t peaks[8];
+    _mm_storeu_si128((__m128i *)lanes, acc);
+    _mm_storeu_si128((__m128i *)peaks, pk);
+    sum = lanes[0] + lanes[1];
+    for (int k = 0; k < 8; k++) {
+        if (peaks[k] > max)
+            max = peaks[k];
+    }
+#endif
+    for (; i < count; i++) {
+        int32_t v = src[i];
+        sum += v * v;
+        if (v < 0)
+            v = v == -32768 ? 32767 : -v;
+        if (v > max)
+            max = v;
+    }
+    *peak = max;
+    return sum;
+}
+
+//
+// y[n] = x[n] - x[n-1] + pole * y[n-1] per channel. Each output depends
+// on the previous one, so the vector bodies run the channels of a frame
+// side by side instead, stereo and 4 channel captures in one vector with
+// the unused lanes idle. Rounding is half away from zero like the C loop.
+//
+void highpass_s16(int16_t *buf, size_t frames, uint32_t channels, float pole, float *state)
+{
+#if defined(__ARM_NEON__) || defined(__SSE2__)
+    if (channels == 2 || channels == 4) {
+        float x1s[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+        float y1s[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+        int16_t *p = buf;
+
+        for (uint32_t c = 0; c < channels; c++) {
+            x1s[c] = state[2 * c];
+            y1s[c] = state[2 * c + 1];
+        }
+#if defined(__ARM_NEON__)
+        float32x4_t x1 = vld1q_f32(x1s);
+        float32x4_t y1 = vld1q_f32(y1s);
+        const float32x4_t vpole = vdupq_n_f32(pole);
+        const uint32x4_t half = vreinterpretq_u32_f32(vdupq_n_f32(0.5f));
+        const uint32x4_t sign = vdupq_n_u32(0x80000000);
+        int16x4_t in = vdup_n_s16(0);
+
+        for (size_t f = 0; f < frames; f++, p += channels) {
+            if (channels == 4) {
+                in = vld1_s16(p);
+            } else {
+                in = vld1_lane_s16(p, in, 0);
+                in = vld1_lane_s16(p + 1, in, 1);
+            }
+            float32x4_t x = vcvtq_f32_s32(vmovl_s16(in));
+            float32x4_t y = vmlaq_f32(vsubq_f32(x, x1), y1, vpole);
+            uint32x4_t bias = vorrq_u32(vandq_u32(vreinterpretq_u32_f32(y), sign), half);
+            int16x4_t out = vqmovn_s32(vcvtq_s32_f32(vaddq_f32(y, vreinterpretq_f32_u32(bias))));
+            x1 = x;
+            y1 = y;
+            if (channels == 4) {
+                vst1_s16(p, out);
+            } else {
+                vst1_lane_s16(p, out, 0);
+                vst1_lane_s16(p + 1, out, 1);
+            }
+        }
+        vst1q_f32(x1s, x1);
+        vst1q_f32(y1s, y1);
+#else
+        __m128 x1 = _mm_loadu_ps(x1s);
+        __m128 y1 = _mm_loadu_ps(y1s);
+        const __m128 vpole = _mm_set1_ps(pole);
+        const __m128 half = _mm_set1_ps(0.5f);
+        const __m128 sign = _mm_castsi128_ps(_mm_set1_epi32(0x80000000));
+
+        for (size_t f = 0; f < frames; f++, p += channels) {
+            __m128i in;
+            if (channels == 4) {
+                int64_t v;
+                memcpy(&v, p, sizeof(v));
+                in = _mm_loadl_epi64((const __m128i *)&v);
+            } else {
+                int32_t v;
+                memcpy(&v, p, sizeof(v));
+                in = _mm_cvtsi32_si128(v);
+            }
+            __m128 x = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(in, in), 16));
+            __m128 y = _mm_add_ps(_mm_sub_ps(x, x1), _mm_mul_ps(y1, vpole));
+            __m128 bias = _mm_or_ps(_mm_and_ps(y, sign), half);
+            __m128i out = _mm_cvttps_epi32(_mm_add_ps(y, bias));
+            out = _mm_packs_epi32(out, out);
+            x1 = x;
+            y1 = y;
+            if (channels == 4) {
+                int64_t v;
+                _mm_storel_epi64((__m128i *)&v, out);
+                memcpy(p, &v, sizeof(v));
+            } else {
+                int32_t v = _mm_cvtsi128_si32(out);
+                memcpy(p, &v, sizeof(v));
+            }
+        }
+        _mm_storeu_ps(x1s, x1);
+        _mm_storeu_ps(y1s, y1);
+#endif
+        for (uint32_t c = 0; c < channels; c++) {
+            state[2 * c] = x1s[c];
+            state[2 * c + 1] = y1s[c];
+        }
+        return;
+    }
+#endif
+    for (uint32_t c = 0; c < channels; c++) {
+        float x1 = state[2 * c];
+        float y1 = state[2 * c + 1];
+        int16_t *p = buf + c;
+
+        for (size_t f = 0; f < frames; f++, p += channels) {
+            float x = *p;
+            float y = x - x1 + pole * y1;
+            x1 = x;
+            y1 = y;
+            *p = clamp16((int32_t)(y > 0 ? y + 0.5f : y - 0.5f));
+        }
+        state[2 * c] = x1;
+        state[2 * c + 1] = y1;
+    }
+}
+
+}       // namespace android_audio_legacy
@@ -0,0 +1,372 @@
+/* ALSAPreProcessor.cpp
+ **
+ ** Copyright (c) 2012, Code Aurora Forum. All rights reserved.
+ **
+ ** Licensed under the Apache License, Version 2.0 (the "License");
+ ** you may not use this file except in compliance with the License.
+ ** You may obtain a copy of the License at
+ **
+ **     http://www.apache.org/licenses/LICENSE-2.0
+ **
+ ** Unless required by applicable law or agreed to in writing, software
+ ** distributed under the License is distributed on an "AS IS" BASIS,
+ ** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ ** See the License for the specific language governing permissions and
+ ** limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+
+#define LOG_TAG "ALSAPreProcessor"
+//#define LOG_NDEBUG 0
+#define LOG_NDDEBUG 0
+#include <utils/Log.h>
+
+#include <cutils/properties.h>
+#include <audio_effects/effect_agc.h>
+#include <audio_effects/effect_ns.h>
+
+#include "AudioHardwareALSA.h"
+
+// NS and AGC gains are worked out per block and ramped across it
+#define PREPROC_BLOCK_MS            10
+#define PREPROC_HIGHPASS_HZ         80.0f
+
+// The noise floor follows the quietest blocks at once and creeps up by
+// NS_NOISE_RISE_DB per second otherwise. Blocks near the floor are taken
+// down by up to NS_FLOOR_DB, the gain opens at once and closes with
+// NS_RELEASE_MS.
+#define NS_NOISE_RISE_DB            3.0f
+#define NS_OVERSUBTRACT             2.0f
+#define NS_FLOOR_DB                 -12.0f
+#define NS_RELEASE_MS               50.0f
+
+// The AGC brings speech to AGC_TARGET_DBFS, cutting at once and boosting
+// by at most AGC_RELEASE_DB per second, and leaves the gain alone below
+// AGC_SILENCE_DBFS so pauses don't pump up the background
+#define AGC_TARGET_DBFS             -20.0f
+#define AGC_MAX_GAIN_DB             24.0f
+#define AGC_MIN_GAIN_DB             -12.0f
+#define AGC_RELEASE_DB              6.0f
+#define AGC_SILENCE_DBFS            -60.0f
+
+namespace android_audio_legacy
+{
+
+// ----------------------------------------------------------------------------
+
+static inline float dbToGain(float db)
+{
+    return powf(10.0f, db / 20.0f);
+}
+
+static inline float dbToPower(float db)
+{
+    return powf(10.0f, db / 10.0f);
+}
+
+static inline float powerToDb(float power)
+{
+    return power > 0.0f ? 10.0f * log10f(power) : -120.0f;
+}
+
+ALSAPreProcessor::ALSAPreProcessor() :
+    mStages(0),
+    mRate(0),
+    mChannels(0),
+    mPole(0.0f),
+    mNoise(0.0f),
+    mNoiseGain(1.0f),
+    mAgcGain(1.0f),
+    mGain(1.0f),
+    mHighpassTime(0),
+    mGainTime(0),
+    mFrames(0)
+{
+    memset(mEffects, 0, sizeof(mEffects));
+    memset(mHighpassState, 0, sizeof(mHighpassState));
+}
+
+ALSAPreProcessor::~ALSAPreProcessor()
+{
+}
+
+// A comma separated list of hpf, ns and agc
+uint32_t ALSAPreProcessor::parseStages(const char *list)
+{
+    uint32_t stages = 0;
+    char buffer[PROPERTY_VALUE_MAX];
+    char *token, *save;
+
+    strlcpy(buffer, list, sizeof(buffer));
+    for (token = strtok_r(buffer, ", ", &save); token; token = strtok_r(NULL, ", ", &save)) {
+        if (!strcmp(token, "hpf")) {
+            stages |= ALSA_PREPROC_HPF;
+        } else if (!strcmp(token, "ns")) {
+            stages |= ALSA_PREPROC_NS;
+        } else if (!strcmp(token, "agc")) {
+            stages |= ALSA_PREPROC_AGC;
+        } else {
+            LOGW("parseStages: unknown stage %s", token);
+        }
+    }
+    return stages;
+}
+
+void ALSAPreProcessor::setStages(uint32_t stages)
+{
+    Mutex::Autolock autoLock(mLock);
+
+    mStages = stages;
+}
+
+status_t ALSAPreProcessor::addEffect(effect_handle_t effect, bool native)
+{
+    Mutex::Autolock autoLock(mLock);
+    effect_descriptor_t desc;
+    Effect *slot = NULL;
+    uint32_t stage = 0;
+
+    if (!effect || (*effect)->get_descriptor(effect, &desc) != 0) {
+        return BAD_VALUE;
+    }
+
+    for (int i = 0; i < ALSA_PREPROC_MAX_EFFECTS; i++) {
+        if (mEffects[i].handle == effect) {
+            return NO_ERROR;
+        }
+        if (!slot && !mEffects[i].handle) {
+            slot = &mEffects[i];
+        }
+    }
+    if (!slot) {
+        LOGE("addEffect: all %d effect slots in use", ALSA_PREPROC_MAX_EFFECTS);
+        return NO_MEMORY;
+    }
+
+    if (native) {
+        if (!memcmp(&desc.type, FX_IID_AGC, sizeof(effect_uuid_t))) {
+            stage = ALSA_PREPROC_AGC;
+            mAgcGain = 1.0f;
+        } else if (!memcmp(&desc.type, FX_IID_NS, sizeof(effect_uuid_t))) {
+            stage = ALSA_PREPROC_NS;
+            mNoise = 0.0f;
+            mNoiseGain = 1.0f;
+        }
+    }
+
+    memset(slot, 0, sizeof(*slot));
+    slot->handle = effect;
+    slot->stage = stage;
+    strlcpy(slot->name, desc.name, sizeof(slot->name));
+    LOGD("addEffect: %s%s", slot->name, stage ? ", built in" : "");
+    return NO_ERROR;
+}
+
+status_t ALSAPreProcessor::removeEffect(effect_handle_t effect)
+{
+    Mutex::Autolock autoLock(mLock);
+
+    for (int i = 0; i < ALSA_PREPROC_MAX_EFFECTS; i++) {
+        if (mEffects[i].handle == effect) {
+            LOGD("removeEffect: %s", mEffects[i].name);
+            mEffects[i].handle = NULL;
+            return NO_ERROR;
+        }
+    }
+    return BAD_VALUE;
+}
+
+void ALSAPreProcessor::configure(uint32_t rate, uint32_t channels)
+{
+    mRate = rate;
+    mChannels = channels > ALSA_MAX_CHANNELS ? ALSA_MAX_CHANNELS : channels;
+    mPole = expf(-2.0f * (float)M_PI * PREPROC_HIGHPASS_HZ / rate);
+    memset(mHighpassState, 0, sizeof(mHighpassState));
+}
+
+//
+// Power subtraction over the whole band: what a block holds above the
+// tracked floor is kept, blocks that are mostly floor are turned down.
+//
+float ALSAPreProcessor::noiseGain(float power, size_t frames)
+{
+    float seconds = (float)frames / mRate;
+    float target;
+
+    if ((mNoise <= 0.0f) || (power < mNoise)) {
+        mNoise = power;
+    } else {
+        mNoise *= dbToPower(NS_NOISE_RISE_DB * seconds);
+    }
+
+    target = power > 0.0f ? 1.0f - NS_OVERSUBTRACT * mNoise / power : 0.0f;
+    target = target > 0.0f ? sqrtf(target) : 0.0f;
+    if (target < dbToGain(NS_FLOOR_DB))
+        target = dbToGain(NS_FLOOR_DB);
+
+    if (target > mNoiseGain) {
+        mNoiseGain = target;
+    } else {
+        mNoiseGain += (target - mNoiseGain) * (1.0f - expf(-seconds * 1000.0f / NS_RELEASE_MS));
+    }
+    return mNoiseGain;
+}
+
+float ALSAPreProcessor::agcGain(float power, int32_t peak, size_t frames)
+{
+    float seconds = (float)frames / mRate;
+
+    if (power > dbToPower(AGC_SILENCE_DBFS)) {
+        float target = dbToGain(AGC_TARGET_DBFS - powerToDb(power));
+
+        if (target > dbToGain(AGC_MAX_GAIN_DB))
+            target = dbToGain(AGC_MAX_GAIN_DB);
+        else if (target < dbToGain(AGC_MIN_GAIN_DB))
+            target = dbToGain(AGC_MIN_GAIN_DB);
+
+        if (target < mAgcGain) {
+            mAgcGain = target;
+        } else {
+            mAgcGain *= dbToGain(AGC_RELEASE_DB * seconds);
+            if (mAgcGain > target)
+                mAgcGain = target;
+        }
+    }
+
+    // Never push the block's peak into clipping
+    if (peak && (mAgcGain * peak > 32767.0f))
+        return 32767.0f / peak;
+    return mAgcGain;
+}
+
+void ALSAPreProcessor::process(int16_t *buffer, size_t frames, uint32_t rate,
+                               uint32_t channels)
+{
+    Mutex::Autolock autoLock(mLock);
+    uint32_t stages = mStages;
+    bool chain = false;
+    nsecs_t start;
+
+    for (int i = 0; i < ALSA_PREPROC_MAX_EFFECTS; i++) {
+        if (mEffects[i].handle) {
+            stages |= mEffects[i].stage;
+            chain |= !mEffects[i].stage;
+        }
+    }
+    if (!stages && !chain)
+        return;
+
+    if ((rate != mRate) || (channels != mChannels)) {
+        if (!rate || !channels || (channels > ALSA_MAX_CHANNELS))
+            return;
+        configure(rate, channels);
+    }
+    mFrames += frames;
+
+    if (stages & ALSA_PREPROC_HPF) {
+        start = systemTime();
+        highpass_s16(buffer, frames, channels, mPole, mHighpassState);
+        mHighpassTime += systemTime() - start;
+    }
+
+    if (stages & (ALSA_PREPROC_NS | ALSA_PREPROC_AGC)) {
+        size_t block = rate * PREPROC_BLOCK_MS / 1000;
+
+        start = systemTime();
+        for (size_t f = 0; f < frames; f += block) {
+            size_t n = frames - f < block ? frames - f : block;
+            int16_t *p = buffer + f * channels;
+            int32_t peak;
+            float power = (float)energy_s16(p, n * channels, &peak) /
+                          ((float)n * channels * 32768.0f * 32768.0f);
+            float gain = 1.0f;
+
+            if (stages & ALSA_PREPROC_NS) {
+                gain = noiseGain(power, n);
+            }
+            if (stages & ALSA_PREPROC_AGC) {
+                // The AGC levels what the suppressor lets through
+                gain *= agcGain(power * gain * gain, (int32_t)(peak * gain), n);
+            }
+
+            if ((gain != 1.0f) || (mGain != 1.0f)) {
+                float step = (gain - mGain) / n;
+                volume_ramp_s16(p, p, n, channels, mGain, mGain, step, step);
+            }
+            mGain = gain;
+        }
+        mGainTime += systemTime() - start;
+    }
+
+    for (int i = 0; chain && i < ALSA_PREPROC_MAX_EFFECTS; i++) {
+        Effect *e = &mEffects[i];
+        audio_buffer_t buf;
+
+        if (!e->handle || e->stage)
+            continue;
+        buf.frameCount = frames;
+        buf.s16 = buffer;
+        start = systemTime();
+        (*e->handle)->process(e->handle, &buf, &buf);
+        e->time += systemTime() - start;
+        e->frames += frames;
+    }
+}
+
+// The filters and the noise floor start over after standby, the AGC keeps
+// its gain so the level doesn't have to settle again after every pause
+void ALSAPreProcessor::reset()
+{
+    Mutex::Autolock autoLock(mLock);
+
+    memset(mHighpassState, 0, sizeof(mHighpassState));
+    mNoise = 0.0f;
+    mNoiseGain = 1.0f;
+}
+
+void ALSAPreProcessor::dump(int fd)
+{
+    Mutex::Autolock autoLock(mLock);
+    char buffer[256];
+    uint32_t stages = mStages;
+    // Percent of one core, time spent over the audio processed
+    double audioNs = mRate ? (double)mFrames * 1000000000.0 / mRate : 0.0;
+
+    for (int i = 0; i < ALSA_PREPROC_MAX_EFFECTS; i++) {
+        if (mEffects[i].handle)
+            stages |= mEffects[i].stage;
+    }
+
+    snprintf(buffer, sizeof(buffer),
+             "  pre-processing:%s%s%s, %u Hz %u ch, noise %.1f dBFS, gain ns %.2f agc %.2f\n",
+             (stages & ALSA_PREPROC_HPF) ? " hpf" : "",
+             (stages & ALSA_PREPROC_NS) ? " ns" : "",
+             (stages & ALSA_PREPROC_AGC) ? " agc" : "",
+             mRate, mChannels, powerToDb(mNoise), mNoiseGain, mAgcGain);
+    ::write(fd, buffer, strlen(buffer));
+    if (audioNs > 0.0) {
+        snprintf(buffer, sizeof(buffer), "    highpass %.3f%% cpu, ns/agc %.3f%% cpu\n",
+                 mHighpassTime * 100.0 / audioNs, mGainTime * 100.0 / audioNs);
+        ::write(fd, buffer, strlen(buffer));
+    }
+    for (int i = 0; i < ALSA_PREPROC_MAX_EFFECTS; i++) {
+        Effect *e = &mEffects[i];
+        if (!e->handle)
+            continue;
+        if (e->stage) {
+            snprintf(buffer, sizeof(buffer), "    effect %s: built in\n", e->name);
+        } else {
+            snprintf(buffer, sizeof(buffer), "    effect %s: %.3f%% cpu\n", e->name,
+                     (e->frames && mRate) ?
+                     e->time * 100.0 / ((double)e->frames * 1000000000.0 / mRate) : 0.0);
+        }
+        ::write(fd, buffer, strlen(buffer));
+    }
+}
+
+}       // namespace android_audio_legacy
@@ -0,0 +1,203 @@
+/* ALSAProfileTable.cpp
+ **
+ ** Copyright (c) 2012, Code Aurora Forum. All rights reserved.
+ **
+ ** Licensed under the Apache License, Version 2.0 (the "License");
+ ** you may not use this file except in compliance with the License.
+ ** You may obtain a copy of the License at
+ **
+ **     http://www.apache.org/licenses/LICENSE-2.0
+ **
+ ** Unless required by applicable law or agreed to in writing, software
+ ** distributed under the License is distributed on an "AS IS" BASIS,
+ ** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ ** See the License for the specific language governing permissions and
+ ** limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+
+#define LOG_TAG "ALSAProfileTable"
+//#define LOG_NDEBUG 0
+#define LOG_NDDEBUG 0
+#include <utils/Log.h>
+
+#include "AudioHardwareALSA.h"
+
+namespace android_audio_legacy
+{
+
+// ----------------------------------------------------------------------------
+
+static const char *profileNames[ALSA_PROFILE_COUNT] = {
+    "hifi",
+    "hifi_fast",
+    "hifi_deep_buffer",
+    "lpa",
+    "voice_call",
+    "voip",
+    "record",
+    "fm",
+    "preroll",
+};
+
+// Used for anything the config file leaves out
+static const alsa_profile_t defaultProfiles[ALSA_PROFILE_COUNT] = {
+    //  rate   ch  period count latency  avail start  stop   mmap
+    { 48000,   2,   2048,   0,   96000,    0,    0, false, false },    // hifi
+    { 48000,   2,    960,   2,   10000,  100,  100, true,  false },    // 5 ms, a wakeup per period
+    { 48000,   2,  38400,   4,  800000,  100,  100, false, false },    // 200 ms, CPU sleeps in between
+    { 48000,   2,   2048,   0,   85333,    0,    0, false, false },    // lpa
+    {  8000,   1,   2048,   0,   85333,    0,    0, false, false },    // voice_call
+    {  8000,   1,    320,   0,    6400,    0,    0, false, false },    // voip, 20 ms
+    {  8000,   1,    320,   0,   96000,    0,    0, false, false },    // record
+    { 48000,   2,   1024,   0,   85333,    0,    0, false, false },    // fm
+    { 16000,   1,   1280,   0,   80000,    0,    0, false, false },    // preroll, 40 ms periods
+};
+
+ALSAProfileTable::ALSAProfileTable()
+{
+    memcpy(mProfiles, defaultProfiles, sizeof(mProfiles));
+}
+
+static char *trim(char *str)
+{
+    char *end;
+
+    while (isspace(*str))
+        str++;
+    end = str + strlen(str);
+    while ((end > str) && isspace(end[-1]))
+        end--;
+    *end = '\0';
+    return str;
+}
+
+// The config file is a list of sections named after the profiles, with
+// one "key = value" per line and '#' comments:
+//
+//     [hifi_fast]
+//     period_bytes = 1920
+//     period_count = 2
+//
+// Keys a section leaves out keep their built-in value.
+status_t ALSAProfileTable::load(const char *path)
+{
+    FILE *fp;
+    char line[256];
+    int lineNumber = 0;
+    alsa_profile_t *profile = NULL;
+
+    if ((fp = fopen(path, "r")) == NULL) {
+        LOGV("load: no %s, using the built-in profiles", path);
+        return NAME_NOT_FOUND;
+    }
+
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        char *str, *key, *value, *end;
+        unsigned long number;
+
+        lineNumber++;
+        if ((str = strchr(line, '#')) != NULL)
+            *str = '\0';
+        str = trim(line);
+        if (*str == '\0')
+            continue;
+
+        if (*str == '[') {
+            if ((end = strchr(str, ']')) != NULL)
+                *end = '\0';
+            str = trim(str + 1);
+            profile = NULL;
+            for (int i = 0; i < ALSA_PROFILE_COUNT; i++) {
+                if (!strcmp(str, profileNames[i])) {
+                    profile = &mProfiles[i];
+                    break;
+                }
+            }
+            if (!profile)
+                LOGW("load: %s:%d unknown profile %s", path, lineNumber, str);
+            continue;
+        }
+
+        if ((value = strchr(str, '=')) == NULL) {
+            LOGW("load: %s:%d expected key = value", path, lineNumber);
+            continue;
+        }
+        *value++ = '\0';
+        key = trim(str);
+        value = trim(value);
+        if (!profile)
+            continue;
+
+        number = strtoul(value, &end, 0);
+        if ((end == value) || (*end != '\0')) {
+            LOGW("load: %s:%d bad value %s for %s", path, lineNumber, value, key);
+            continue;
+        }
+
+        if (!strcmp(key, "sample_rate") && number) {
+            profile->sampleRate = number;
+        } else if (!strcmp(key, "channels") && number && (number <= ALSA_MAX_CHANNELS)) {
+            profile->channels = number;
+        } else if (!strcmp(key, "period_bytes") && number) {
+            profile->periodBytes = number;
+        } else if (!strcmp(key, "period_count")) {
+            profile->periodCount = number;
+        } else if (!strcmp(key, "latency_us")) {
+            profile->latency = number;
+        } else if (!strcmp(key, "avail_min")) {
+            profile->availMin = number;
+        } else if (!strcmp(key, "start_threshold")) {
+            profile->startThreshold = number;
+        } else if (!strcmp(key, "stop_on_xrun")) {
+            profile->stopOnXrun = (number != 0);
+        } else if (!strcmp(key, "mmap")) {
+            profile->mmap = (number != 0);
+        } else {
+            LOGW("load: %s:%d bad key %s = %s", path, lineNumber, key, value);
+        }
+    }
+    fclose(fp);
+
+    LOGD("load: profiles from %s", path);
+    return NO_ERROR;
+}
+
+const alsa_profile_t *ALSAProfileTable::get(int profile) const
+{
+    if ((profile < 0) || (profile >= ALSA_PROFILE_COUNT))
+        profile = ALSA_PROFILE_DEFAULT;
+    return &mProfiles[profile];
+}
+
+const char *ALSAProfileTable::name(int profile)
+{
+    if ((profile < 0) || (profile >= ALSA_PROFILE_COUNT))
+        return "unknown";
+    return profileNames[profile];
+}
+
+void ALSAProfileTable::dump(int fd) const
+{
+    char buffer[256];
+
+    snprintf(buffer, sizeof(buffer), "  use case profiles:\n");
+    ::write(fd, buffer, strlen(buffer));
+    for (int i = 0; i < ALSA_PROFILE_COUNT; i++) {
+        const alsa_profile_t *p = &mProfiles[i];
+        snprintf(buffer, sizeof(buffer),
+                 "    %-16s %u Hz %u ch period %u bytes x %u latency %u us"
+                 " avail_min %u%% start %u%%%s%s\n",
+                 profileNames[i], p->sampleRate, p->channels, p->periodBytes,
+                 p->periodCount, p->latency, p->availMin, p->startThreshold,
+                 p->stopOnXrun ? " stop on xrun" : "", p->mmap ? " mmap" : "");
+        ::write(fd, buffer, strlen(buffer));
+    }
+}
+
+}       // namespace android_audio_legacy
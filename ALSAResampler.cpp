@@ -0,0 +1,262 @@
+/* ALSAResampler.cpp
+ **
+ ** Copyright (c) 2012, Code Aurora Forum. All rights reserved.
+ **
+ ** Licensed under the Apache License, Version 2.0 (the "License");
+ ** you may not use this file except in compliance with the License.
+ ** You may obtain a copy of the License at
+ **
+ **     http://www.apache.org/licenses/LICENSE-2.0
+ **
+ ** Unless required by applicable law or agreed to in writing, software
+ ** distributed under the License is distributed on an "AS IS" BASIS,
+ ** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ ** See the License for the specific language governing permissions and
+ ** limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define LOG_TAG "ALSAResampler"
+//#define LOG_NDEBUG 0
+#define LOG_NDDEBUG 0
+#include <utils/Log.h>
+
+#include "AudioHardwareALSA.h"
+
+// Input frames deinterleaved per pass, on top of the filter history
+#define RESAMPLER_CHUNK_FRAMES  512
+
+namespace android_audio_legacy
+{
+
+// ----------------------------------------------------------------------------
+
+static const struct {
+    size_t  taps;
+    double  beta;           // Kaiser window shape
+    double  rolloff;        // passband edge relative to the lower Nyquist
+} sPresets[] = {
+    { 0,  0.0, 0.0 },       // ALSA_RESAMPLER_OFF
+    { 8,  5.0, 0.85 },      // ALSA_RESAMPLER_LOW
+    { 16, 7.0, 0.90 },      // ALSA_RESAMPLER_MEDIUM
+    { 32, 9.0, 0.94 },      // ALSA_RESAMPLER_HIGH
+};
+
+static uint32_t gcd(uint32_t a, uint32_t b)
+{
+    while (b) {
+        uint32_t t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+// Zeroth order modified Bessel function of the first kind
+static double besselI0(double x)
+{
+    double sum = 1.0, term = 1.0;
+
+    for (int k = 1; k < 32; k++) {
+        term *= (x / (2 * k)) * (x / (2 * k));
+        sum += term;
+        if (term < sum * 1e-12)
+            break;
+    }
+    return sum;
+}
+
+static inline int16_t clamp16(int32_t sample)
+{
+    if ((sample >> 15) ^ (sample >> 31))
+        sample = 0x7FFF ^ (sample >> 31);
+    return sample;
+}
+
+bool ALSAResampler::isSupported(uint32_t inRate, uint32_t outRate)
+{
+    uint32_t g;
+
+    if (!inRate || !outRate || inRate > 48000 || outRate > 48000)
+        return false;
+
+    g = gcd(inRate, outRate);
+    return (outRate / g <= ALSA_RESAMPLER_MAX_PHASES) &&
+           (inRate / g <= ALSA_RESAMPLER_MAX_PHASES);
+}
+
+//
+// The prototype is a Kaiser windowed sinc at L times the input rate, cut
+// off below the lower of the two Nyquist frequencies. It is split into L
+// phases of mTaps coefficients, each normalized to unity DC gain so the
+// phases do not modulate the signal level.
+//
+ALSAResampler::ALSAResampler(uint32_t inRate, uint32_t outRate,
+                             uint32_t channels, int quality) :
+    mChannels(channels),
+    mL(1),
+    mM(1),
+    mTaps(0),
+    mCoefs(NULL),
+    mBuffer(NULL),
+    mCapacity(0),
+    mFrames(0),
+    mIndex(0),
+    mPhase(0)
+{
+    uint32_t g;
+    size_t length;
+    double center, cutoff;
+    double *proto;
+
+    if (!isSupported(inRate, outRate) || !channels ||
+        quality <= ALSA_RESAMPLER_OFF || quality > ALSA_RESAMPLER_HIGH) {
+        LOGE("Unsupported conversion %u -> %u Hz", inRate, outRate);
+        return;
+    }
+
+    g = gcd(inRate, outRate);
+    mL = outRate / g;
+    mM = inRate / g;
+    mTaps = sPresets[quality].taps;
+
+    length = mL * mTaps;
+    center = (length - 1) / 2.0;
+    cutoff = sPresets[quality].rolloff * (mL < mM ? (double)mL / mM : 1.0) / (2.0 * mL);
+
+    proto = (double *) malloc(length * sizeof(double));
+    mCoefs = (int16_t *) malloc(length * sizeof(int16_t));
+    mCapacity = mTaps + RESAMPLER_CHUNK_FRAMES;
+    mBuffer = (int16_t *) malloc(mCapacity * mChannels * sizeof(int16_t));
+    if (!proto || !mCoefs || !mBuffer) {
+        LOGE("Failed to allocate resampler for %u -> %u Hz", inRate, outRate);
+        free(proto);
+        free(mCoefs);
+        mCoefs = NULL;
+        return;
+    }
+
+    for (size_t k = 0; k < length; k++) {
+        double t = k - center;
+        double x = 2.0 * cutoff * t;
+        double r = 2.0 * t / (length - 1);
+        double sinc = (x == 0.0) ? 1.0 : sin(M_PI * x) / (M_PI * x);
+        double w = besselI0(sPresets[quality].beta * sqrt(fmax(0.0, 1.0 - r * r))) /
+                   besselI0(sPresets[quality].beta);
+        proto[k] = 2.0 * cutoff * mL * sinc * w;
+    }
+
+    // Phase p uses proto[p + L * j], stored reversed so it lines up with
+    // the history, whose newest frame is last.
+    for (uint32_t p = 0; p < mL; p++) {
+        double sum = 0.0;
+        for (size_t j = 0; j < mTaps; j++)
+            sum += proto[p + mL * j];
+        for (size_t j = 0; j < mTaps; j++) {
+            double c = proto[p + mL * j] / sum * 32768.0;
+            mCoefs[p * mTaps + (mTaps - 1 - j)] =
+                (int16_t)(c > 32767.0 ? 32767 : (c < -32768.0 ? -32768 : floor(c + 0.5)));
+        }
+    }
+    free(proto);
+
+    reset();
+    LOGD("%u -> %u Hz, L %u M %u, %d taps per phase", inRate, outRate, mL, mM, mTaps);
+}
+
+ALSAResampler::~ALSAResampler()
+{
+    free(mCoefs);
+    free(mBuffer);
+}
+
+// Start over from silence, with the history primed for the first output
+void ALSAResampler::reset()
+{
+    if (!mBuffer)
+        return;
+
+    memset(mBuffer, 0, mCapacity * mChannels * sizeof(int16_t));
+    mFrames = mTaps - 1;
+    mIndex = 0;
+    mPhase = 0;
+}
+
+size_t ALSAResampler::inputFramesFor(size_t outFrames) const
+{
+    uint64_t required;
+
+    if (!outFrames)
+        return 0;
+
+    required = mIndex + (mPhase + (uint64_t)(outFrames - 1) * mM) / mL + mTaps;
+    return required > mFrames ? (size_t)(required - mFrames) : 0;
+}
+
+size_t ALSAResampler::outputFramesFor(size_t inFrames) const
+{
+    return (size_t)(((uint64_t)(mFrames + inFrames) * mL) / mM) + 1;
+}
+
+size_t ALSAResampler::resample(const int16_t *in, size_t *inFrames,
+                               int16_t *out, size_t outFrames)
+{
+    size_t consumed = 0, produced = 0;
+
+    if (!mCoefs) {
+        *inFrames = 0;
+        return 0;
+    }
+
+    for (;;) {
+        while (produced < outFrames && mIndex + mTaps <= mFrames) {
+            const int16_t *coefs = mCoefs + mPhase * mTaps;
+            for (uint32_t c = 0; c < mChannels; c++) {
+                int32_t acc = dot_s16(mBuffer + c * mCapacity + mIndex, coefs, mTaps);
+                out[produced * mChannels + c] = clamp16((acc + (1 << 14)) >> 15);
+            }
+            produced++;
+            mPhase += mM;
+            mIndex += mPhase / mL;
+            mPhase %= mL;
+        }
+
+        if (produced == outFrames || consumed == *inFrames)
+            break;
+
+        // Drop the frames no later output needs. When decimating the next
+        // output can start past what is buffered, mIndex then counts the
+        // input frames still to be skipped.
+        if (mIndex >= mFrames) {
+            mIndex -= mFrames;
+            mFrames = 0;
+        } else if (mIndex) {
+            for (uint32_t c = 0; c < mChannels; c++) {
+                int16_t *row = mBuffer + c * mCapacity;
+                memmove(row, row + mIndex, (mFrames - mIndex) * sizeof(int16_t));
+            }
+            mFrames -= mIndex;
+            mIndex = 0;
+        }
+
+        size_t n = mCapacity - mFrames;
+        if (n > *inFrames - consumed)
+            n = *inFrames - consumed;
+        const int16_t *src = in + consumed * mChannels;
+        for (uint32_t c = 0; c < mChannels; c++) {
+            int16_t *row = mBuffer + c * mCapacity + mFrames;
+            for (size_t i = 0; i < n; i++)
+                row[i] = src[i * mChannels + c];
+        }
+        mFrames += n;
+        consumed += n;
+    }
+
+    *inFrames = consumed;
+    return produced;
+}
+
+}       // namespace android_audio_legacy
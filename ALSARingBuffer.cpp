@@ -0,0 +1,124 @@
+/* ALSARingBuffer.cpp
+ **
+ ** Copyright (c) 2012, Code Aurora Forum. All rights reserved.
+ **
+ ** Licensed under the Apache License, Version 2.0 (the "License");
+ ** you may not use this file except in compliance with the License.
+ ** You may obtain a copy of the License at
+ **
+ **     http://www.apache.org/licenses/LICENSE-2.0
+ **
+ ** Unless required by applicable law or agreed to in writing, software
+ ** distributed under the License is distributed on an "AS IS" BASIS,
+ ** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ ** See the License for the specific language governing permissions and
+ ** limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#define LOG_TAG "ALSARingBuffer"
+//#define LOG_NDEBUG 0
+#define LOG_NDDEBUG 0
+#include <utils/Log.h>
+#include <cutils/atomic.h>
+
+#include "AudioHardwareALSA.h"
+
+namespace android_audio_legacy
+{
+
+// ----------------------------------------------------------------------------
+
+ALSARingBuffer::ALSARingBuffer(size_t size) :
+    mBuffer(NULL),
+    mSize(1),
+    mReadPos(0),
+    mWritePos(0)
+{
+    // Positions are free running and wrap at 2^32, which keeps the
+    // masking below valid as long as the size is a power of two.
+    while (mSize < size)
+        mSize <<= 1;
+
+    mBuffer = (char *) malloc(mSize);
+    if (!mBuffer) {
+        LOGE("Failed to allocate %d byte ring", mSize);
+        mSize = 0;
+    }
+}
+
+ALSARingBuffer::~ALSARingBuffer()
+{
+    free(mBuffer);
+}
+
+size_t ALSARingBuffer::availableToRead() const
+{
+    uint32_t wr = android_atomic_acquire_load(&mWritePos);
+    uint32_t rd = android_atomic_acquire_load(&mReadPos);
+
+    return wr - rd;
+}
+
+size_t ALSARingBuffer::availableToWrite() const
+{
+    return mSize - availableToRead();
+}
+
+size_t ALSARingBuffer::write(const void *buffer, size_t bytes)
+{
+    uint32_t wr = mWritePos;
+    uint32_t rd = android_atomic_acquire_load(&mReadPos);
+    size_t avail = mSize - (wr - rd);
+    size_t offset, chunk;
+
+    if (bytes > avail)
+        bytes = avail;
+    if (!bytes)
+        return 0;
+
+    offset = wr & (mSize - 1);
+    chunk = mSize - offset;
+    if (chunk > bytes)
+        chunk = bytes;
+    memcpy(mBuffer + offset, buffer, chunk);
+    if (chunk < bytes)
+        memcpy(mBuffer, (const char *)buffer + chunk, bytes - chunk);
+
+    android_atomic_release_store(wr + bytes, &mWritePos);
+    return bytes;
+}
+
+size_t ALSARingBuffer::read(void *buffer, size_t bytes)
+{
+    uint32_t rd = mReadPos;
+    uint32_t wr = android_atomic_acquire_load(&mWritePos);
+    size_t avail = wr - rd;
+    size_t offset, chunk;
+
+    if (bytes > avail)
+        bytes = avail;
+    if (!bytes)
+        return 0;
+
+    offset = rd & (mSize - 1);
+    chunk = mSize - offset;
+    if (chunk > bytes)
+        chunk = bytes;
+    memcpy(buffer, mBuffer + offset, chunk);
+    if (chunk < bytes)
+        memcpy((char *)buffer + chunk, mBuffer, bytes - chunk);
+
+    android_atomic_release_store(rd + bytes, &mReadPos);
+    return bytes;
+}
+
+void ALSARingBuffer::reset()
+{
+    android_atomic_release_store(0, &mReadPos);
+    android_atomic_release_store(0, &mWritePos);
+}
+
+}       // namespace android_audio_legacy
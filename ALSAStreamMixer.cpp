@@ -0,0 +1,403 @@
+/* ALSAStreamMixer.cpp
+ **
+ ** Copyright (c) 2012, Code Aurora Forum. All rights reserved.
+ **
+ ** Licensed under the Apache License, Version 2.0 (the "License");
+ ** you may not use this file except in compliance with the License.
+ ** You may obtain a copy of the License at
+ **
+ **     http://www.apache.org/licenses/LICENSE-2.0
+ **
+ ** Unless required by applicable law or agreed to in writing, software
+ ** distributed under the License is distributed on an "AS IS" BASIS,
+ ** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ ** See the License for the specific language governing permissions and
+ ** limitations under the License.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+
+#define LOG_TAG "ALSAStreamMixer"
+//#define LOG_NDEBUG 0
+#define LOG_NDDEBUG 0
+#include <utils/Log.h>
+#include <utils/String8.h>
+
+#include "AudioHardwareALSA.h"
+
+// Periods of client data buffered per track
+#define MIXER_RING_PERIODS      4
+#define MIXER_THREAD_PRIORITY   2
+#define MIXER_WAIT_TIMEOUT_NS   100000000LL
+
+namespace android_audio_legacy
+{
+
+// ----------------------------------------------------------------------------
+
+ALSAStreamMixer::ALSAStreamMixer(AudioStreamOutALSA *sink, alsa_handle_t *handle) :
+    mSink(sink),
+    mHandle(handle),
+    mPeriodBytes(sink->bufferSize()),
+    mFrameSize(sink->clientFrameSize()),
+    mMixBuffer(NULL),
+    mTrackBuffer(NULL),
+    mAccumulator(NULL),
+    mFramesMixed(0),
+    mRunning(false),
+    mExit(false)
+{
+    size_t samples = mPeriodBytes / sizeof(int16_t);
+
+    memset(mTracks, 0, sizeof(mTracks));
+
+    mMixBuffer = (int16_t *) malloc(mPeriodBytes);
+    mTrackBuffer = (int16_t *) malloc(mPeriodBytes);
+    mAccumulator = (float *) malloc(samples * sizeof(float));
+    if (!mMixBuffer || !mTrackBuffer || !mAccumulator) {
+        LOGE("Failed to allocate mix buffers for %d byte periods", mPeriodBytes);
+        return;
+    }
+
+    if (pthread_create(&mThread, NULL, threadWrapper, this)) {
+        LOGE("Failed to create mixer thread");
+        return;
+    }
+    mRunning = true;
+    LOGD("mixer started, period %d bytes", mPeriodBytes);
+}
+
+//
+// The sink is only taken over once the mixer is running, if it failed to
+// start the caller keeps using the sink as a plain output.
+//
+ALSAStreamMixer::~ALSAStreamMixer()
+{
+    if (mRunning) {
+        mLock.lock();
+        mExit = true;
+        mCond.broadcast();
+        mLock.unlock();
+        pthread_join(mThread, NULL);
+        delete mSink;
+    }
+
+    for (int i = 0; i < ALSA_MIXER_MAX_TRACKS; i++) {
+        delete mTracks[i].ring;
+    }
+    free(mMixBuffer);
+    free(mTrackBuffer);
+    free(mAccumulator);
+}
+
+int ALSAStreamMixer::addTrack()
+{
+    Mutex::Autolock autoLock(mLock);
+
+    for (int i = 0; i < ALSA_MIXER_MAX_TRACKS; i++) {
+        Track *t = &mTracks[i];
+        if (t->used)
+            continue;
+
+        if (!t->ring) {
+            t->ring = new ALSARingBuffer(mPeriodBytes * MIXER_RING_PERIODS);
+            if (!t->ring->initCheck()) {
+                delete t->ring;
+                t->ring = NULL;
+                return -1;
+            }
+        }
+        t->ring->reset();
+        t->used = true;
+        t->active = false;
+        t->gain = 1.0f;
+        t->framesMixed = 0;
+        t->underruns = 0;
+        LOGD("addTrack: track %d", i);
+        return i;
+    }
+
+    LOGE("addTrack: all %d tracks in use", ALSA_MIXER_MAX_TRACKS);
+    return -1;
+}
+
+void ALSAStreamMixer::removeTrack(int track)
+{
+    Mutex::Autolock autoLock(mLock);
+
+    LOGD("removeTrack: track %d", track);
+    mTracks[track].used = false;
+    mTracks[track].active = false;
+    mCond.broadcast();
+}
+
+size_t ALSAStreamMixer::trackCount()
+{
+    Mutex::Autolock autoLock(mLock);
+    size_t count = 0;
+
+    for (int i = 0; i < ALSA_MIXER_MAX_TRACKS; i++) {
+        if (mTracks[i].used)
+            count++;
+    }
+    return count;
+}
+
+//
+// Called from the client's write(). Blocks while the track ring is full,
+// which paces the client at the rate the mixer drains it.
+//
+ssize_t ALSAStreamMixer::write(int track, const void *buffer, size_t bytes)
+{
+    Mutex::Autolock autoLock(mLock);
+    Track *t = &mTracks[track];
+    size_t written = 0;
+
+    if (!t->active) {
+        t->active = true;
+        mCond.broadcast();
+    }
+
+    while (written < bytes && !mExit) {
+        size_t n = t->ring->write((const char *)buffer + written, bytes - written);
+        if (n) {
+            written += n;
+            mCond.broadcast();
+        } else {
+            mCond.waitRelative(mLock, MIXER_WAIT_TIMEOUT_NS);
+        }
+    }
+
+    return written;
+}
+
+// The track stops contributing, whatever it had queued is dropped
+void ALSAStreamMixer::standby(int track)
+{
+    Mutex::Autolock autoLock(mLock);
+
+    mTracks[track].active = false;
+    mTracks[track].ring->reset();
+    mCond.broadcast();
+}
+
+void ALSAStreamMixer::setGain(int track, float gain)
+{
+    Mutex::Autolock autoLock(mLock);
+
+    if (gain < 0.0f)
+        gain = 0.0f;
+    else if (gain > 1.0f)
+        gain = 1.0f;
+    mTracks[track].gain = gain;
+}
+
+// The sink reroutes with its own mDevices when it leaves standby
+void ALSAStreamMixer::setDevices(uint32_t devices)
+{
+    if (devices) {
+        mSink->mDevices = devices;
+    }
+}
+
+//
+// A track's position is what the mixer took from it, less what is still
+// queued between the mixer and the DAC.
+//
+status_t ALSAStreamMixer::getPresentationPosition(int track, uint64_t *frames,
+                                                  struct timespec *timestamp)
+{
+    uint64_t presented;
+    status_t err = mSink->getPresentationPosition(&presented, timestamp);
+
+    if (err != NO_ERROR)
+        return err;
+
+    Mutex::Autolock autoLock(mLock);
+    uint64_t queued = mFramesMixed > presented ? mFramesMixed - presented : 0;
+    uint64_t mixed = mTracks[track].framesMixed;
+
+    *frames = mixed > queued ? mixed - queued : 0;
+    return NO_ERROR;
+}
+
+uint32_t ALSAStreamMixer::latency() const
+{
+    if (!mFrameSize || !mHandle->sampleRate)
+        return 0;
+    return (uint32_t)((uint64_t)mPeriodBytes * MIXER_RING_PERIODS / mFrameSize *
+                      1000000 / mHandle->sampleRate);
+}
+
+void ALSAStreamMixer::dump(int fd)
+{
+    Mutex::Autolock autoLock(mLock);
+    char buffer[256];
+
+    snprintf(buffer, sizeof(buffer), "  software mixer: period %d bytes, %llu frames mixed\n",
+             mPeriodBytes, (unsigned long long)mFramesMixed);
+    ::write(fd, buffer, strlen(buffer));
+    for (int i = 0; i < ALSA_MIXER_MAX_TRACKS; i++) {
+        Track *t = &mTracks[i];
+        if (!t->used)
+            continue;
+        snprintf(buffer, sizeof(buffer),
+                 "    track %d: %s gain %.3f queued %d frames mixed %llu underruns %u\n",
+                 i, t->active ? "active" : "idle", t->gain,
+                 t->ring->availableToRead(), (unsigned long long)t->framesMixed,
+                 t->underruns);
+        ::write(fd, buffer, strlen(buffer));
+    }
+}
+
+void *ALSAStreamMixer::threadWrapper(void *me)
+{
+    static_cast<ALSAStreamMixer *>(me)->threadLoop();
+    return NULL;
+}
+
+//
+// Whether every active track has a full period queued, *any tells if
+// there is an active track at all. Called with mLock held.
+//
+bool ALSAStreamMixer::tracksReady(bool *any)
+{
+    bool ready = true;
+
+    *any = false;
+    for (int i = 0; i < ALSA_MIXER_MAX_TRACKS; i++) {
+        Track *t = &mTracks[i];
+        if (!t->used || !t->active)
+            continue;
+        *any = true;
+        if (t->ring->availableToRead() < mPeriodBytes)
+            ready = false;
+    }
+    return ready;
+}
+
+//
+// Mix one period from every active track into mMixBuffer. threadLoop()
+// only gets here once every track has a period queued or the period is
+// due, so a track still short has underrun and is padded with silence.
+// Called with mLock held, returns the number of tracks mixed.
+//
+size_t ALSAStreamMixer::mixPeriod()
+{
+    size_t samples = mPeriodBytes / sizeof(int16_t);
+    size_t active = 0;
+
+    for (int i = 0; i < ALSA_MIXER_MAX_TRACKS; i++) {
+        if (mTracks[i].used && mTracks[i].active)
+            active++;
+    }
+    if (!active)
+        return 0;
+
+    // With up to two sources a saturating add is exact, beyond that the
+    // intermediate sums could clip, so accumulate in float and clamp once.
+    memset(mMixBuffer, 0, mPeriodBytes);
+    if (active > 2)
+        memset(mAccumulator, 0, samples * sizeof(float));
+
+    for (int i = 0; i < ALSA_MIXER_MAX_TRACKS; i++) {
+        Track *t = &mTracks[i];
+        if (!t->used || !t->active)
+            continue;
+
+        size_t n = t->ring->read(mTrackBuffer, mPeriodBytes);
+        if (n < mPeriodBytes) {
+            memset((char *)mTrackBuffer + n, 0, mPeriodBytes - n);
+            t->underruns++;
+        }
+        t->framesMixed += n / mFrameSize;
+
+        if (active > 2) {
+            mix_s16_to_float(mAccumulator, mTrackBuffer, samples, t->gain);
+        } else {
+            mix_s16(mMixBuffer, mTrackBuffer, samples,
+                    (uint32_t)(t->gain * ALSA_GAIN_UNITY_Q15));
+        }
+    }
+
+    if (active > 2)
+        float_to_s16(mMixBuffer, mAccumulator, samples);
+
+    mCond.broadcast();
+    return active;
+}
+
+void ALSAStreamMixer::threadLoop()
+{
+    struct sched_param param;
+    nsecs_t periodNs = 0;
+    bool sinkActive = false;
+
+    param.sched_priority = MIXER_THREAD_PRIORITY;
+    if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &param)) {
+        LOGW("mixer thread: SCHED_FIFO not permitted, using urgent audio priority");
+        androidSetThreadPriority(0, ANDROID_PRIORITY_URGENT_AUDIO);
+    }
+
+    if (mFrameSize && mHandle->sampleRate) {
+        periodNs = seconds(mPeriodBytes / mFrameSize) / mHandle->sampleRate;
+    }
+
+    mLock.lock();
+    while (!mExit) {
+        bool any;
+        bool ready = tracksReady(&any);
+
+        if (!any) {
+            if (sinkActive) {
+                // Nothing left to play, let the sink close the PCM
+                mLock.unlock();
+                mSink->standby();
+                mLock.lock();
+                sinkActive = false;
+                continue;
+            }
+            mCond.wait(mLock);
+            continue;
+        }
+
+        // Give late tracks up to one period before mixing what is there.
+        // Every write() wakes us, keep waiting until the deadline unless
+        // that completed the last track.
+        if (!ready && periodNs) {
+            nsecs_t deadline = systemTime() + periodNs;
+            nsecs_t left = periodNs;
+
+            while (!mExit && (left > 0)) {
+                mCond.waitRelative(mLock, left);
+                if (tracksReady(&any) || !any)
+                    break;
+                left = deadline - systemTime();
+            }
+            if (mExit || !any)
+                continue;
+        }
+
+        if (!mixPeriod())
+            continue;
+        mFramesMixed += mPeriodBytes / mFrameSize;
+
+        mLock.unlock();
+        mSink->write(mMixBuffer, mPeriodBytes);
+        sinkActive = true;
+        mLock.lock();
+    }
+    mLock.unlock();
+
+    if (sinkActive) {
+        mSink->standby();
+    }
+}
+
+}       // namespace android_audio_legacy
@@ -36,6 +36,17 @@
 
 #include "AudioHardwareALSA.h"
 
+// Retries per period before a failing device is given up on, and the
+// bounds of the backoff applied between attempts
+#define RECOVERY_MAX_RETRIES     3
+#define RECOVERY_BACKOFF_MIN_MS  5
+#define RECOVERY_BACKOFF_MAX_MS  500
+
+// Remix coefficients, see setupRemix()
+#define Q14_UNITY       16384
+#define Q14_MINUS_3DB   11585
+#define Q14_HALF        8192
+
 namespace android_audio_legacy
 {
 
@@ -44,7 +55,45 @@ namespace android_audio_legacy
 ALSAStreamOps::ALSAStreamOps(AudioHardwareALSA *parent, alsa_handle_t *handle) :
     mParent(parent),
     mHandle(handle),
-    mPowerLock(false)
+    mPowerLock(false),
+    mSharedHandle(false),
+    mMultiMic(false),
+    mMicSelected(false),
+    mPcmFormat(handle->format),
+    mPcmChannels(handle->channels),
+    mStaging(NULL),
+    mStagingSize(0),
+    mStagingBytes(0),
+    mStagingOffset(0),
+    mResampler(NULL),
+    mClientRate(0),
+    mResampleBuffer(NULL),
+    mResampleBufferSize(0),
+    mClientFormat(handle->format),
+    mConvertBuffer(NULL),
+    mConvertBufferSize(0),
+    mClientChannels(handle->channels),
+    mClientChannelMask(0),
+    mRemix(false),
+    mRemixIsMap(false),
+    mRemixIsDownmix(false),
+    mRemixBuffer(NULL),
+    mRemixBufferSize(0),
+    mVolumeBuffer(NULL),
+    mVolumeBufferSize(0),
+    mPlanar(false),
+    mPlanarBuffer(NULL),
+    mPlanarBufferSize(0),
+    mXrunCount(0),
+    mPrepareCount(0),
+    mReopenCount(0),
+    mErrorCount(0),
+    mRecoveryAttempts(0),
+    mRecoveryBlocked(false),
+    mRecoveryBackoffMs(RECOVERY_BACKOFF_MIN_MS),
+    mRecoveryRetryTime(0),
+    mEmulationStart(0),
+    mEmulatedFrames(0)
 {
 }
 
@@ -52,6 +101,26 @@ ALSAStreamOps::~ALSAStreamOps()
 {
     Mutex::Autolock autoLock(mParent->mLock);
 
+    free(mStaging);
+    mStaging = NULL;
+    delete mResampler;
+    mResampler = NULL;
+    free(mResampleBuffer);
+    mResampleBuffer = NULL;
+    free(mConvertBuffer);
+    mConvertBuffer = NULL;
+    free(mRemixBuffer);
+    mRemixBuffer = NULL;
+    free(mVolumeBuffer);
+    mVolumeBuffer = NULL;
+    free(mPlanarBuffer);
+    mPlanarBuffer = NULL;
+
+    // The software mixer or the capture splitter owns the handle and
+    // closes it with its sink or source
+    if (mSharedHandle)
+        return;
+
     if((!strcmp(mHandle->useCase, SND_USE_CASE_VERB_IP_VOICECALL)) ||
        (!strcmp(mHandle->useCase, SND_USE_CASE_MOD_PLAY_VOIP))) {
         if((mParent->mVoipStreamCount)) {
@@ -94,44 +163,6 @@ status_t ALSAStreamOps::set(int      *format,
                             uint32_t device)
 {
     mDevices = device;
-    if (channels && *channels != 0) {
-        if (mHandle->channels != popCount(*channels))
-            return BAD_VALUE;
-    } else if (channels) {
-        *channels = 0;
-        if (mHandle->devices & AudioSystem::DEVICE_OUT_ALL) {
-            switch(mHandle->channels) {
-                case 4:
-                    *channels |= AudioSystem::CHANNEL_OUT_BACK_LEFT;
-                    *channels |= AudioSystem::CHANNEL_OUT_BACK_RIGHT;
-                    // Fall through...
-                default:
-                case 2:
-                    *channels |= AudioSystem::CHANNEL_OUT_FRONT_RIGHT;
-                    // Fall through...
-                case 1:
-                    *channels |= AudioSystem::CHANNEL_OUT_FRONT_LEFT;
-                    break;
-            }
-        } else {
-            switch(mHandle->channels) {
-                default:
-                case 2:
-                    *channels |= AudioSystem::CHANNEL_IN_RIGHT;
-                    // Fall through...
-                case 1:
-                    *channels |= AudioSystem::CHANNEL_IN_LEFT;
-                    break;
-            }
-        }
-    }
-
-    if (rate && *rate > 0) {
-        if (mHandle->sampleRate != *rate)
-            return BAD_VALUE;
-    } else if (rate) {
-        *rate = mHandle->sampleRate;
-    }
 
     snd_pcm_format_t iformat = mHandle->format;
 
@@ -148,25 +179,110 @@ status_t ALSAStreamOps::set(int      *format,
                 iformat = SNDRV_PCM_FORMAT_S8;
                 break;
 
+            case AUDIO_FORMAT_PCM_8_24_BIT:
+                iformat = SNDRV_PCM_FORMAT_S24_LE;
+                break;
+
+            case AUDIO_FORMAT_PCM_32_BIT:
+                iformat = SNDRV_PCM_FORMAT_S32_LE;
+                break;
+
+            case ALSA_FORMAT_PCM_FLOAT:
+                iformat = SNDRV_PCM_FORMAT_FLOAT_LE;
+                break;
+
             default:
                 LOGE("Unknown PCM format %i. Forcing default", *format);
                 break;
         }
 
-        if (mHandle->format != iformat)
+        // 8 bit is only passed through, everything else is converted to
+        // and from the PCM format
+        if ((mHandle->format != iformat) &&
+            ((iformat == SNDRV_PCM_FORMAT_S8) ||
+             (mHandle->format == SNDRV_PCM_FORMAT_S8)))
             return BAD_VALUE;
 
-        switch(iformat) {
+        mClientFormat = iformat;
+        *format = this->format();
+    }
+
+    if (mHandle->devices & AudioSystem::DEVICE_OUT_ALL) {
+        // Outputs take any layout up to 7.1 and mix it to the PCM's
+        if (channels && *channels != 0) {
+            if (setupRemix(*channels) != NO_ERROR)
+                return BAD_VALUE;
+        } else {
+            mClientChannelMask = 0;
+            if (setupRemix(this->channels()) != NO_ERROR)
+                return BAD_VALUE;
+            if (channels)
+                *channels = mClientChannelMask;
+        }
+    } else if (channels && *channels != 0) {
+        if (mMultiMic) {
+            // As many of the mics as the mask has channels
+            if (setupMics(popCount(*channels), NULL) != NO_ERROR)
+                return BAD_VALUE;
+            mClientChannelMask = *channels;
+        } else if (mHandle->channels != popCount(*channels)) {
+            // Clients of the capture splitter can take mono or stereo from
+            // whatever the shared PCM runs at
+            if (!mSharedHandle || (popCount(*channels) > 2) || (mHandle->channels > 2) ||
+                (mClientFormat != SNDRV_PCM_FORMAT_S16_LE))
+                return BAD_VALUE;
+            foldCapture(popCount(*channels));
+            mClientChannelMask = *channels;
+        }
+    } else if (channels) {
+        *channels = 0;
+        switch(mHandle->channels) {
+            case 4:
+                *channels |= AudioSystem::CHANNEL_IN_FRONT;
+                *channels |= AudioSystem::CHANNEL_IN_BACK;
+                // Fall through...
             default:
-            case SNDRV_PCM_FORMAT_S16_LE:
-                *format = AudioSystem::PCM_16_BIT;
-                break;
-            case SNDRV_PCM_FORMAT_S8:
-                *format = AudioSystem::PCM_8_BIT;
+            case 2:
+                *channels |= AudioSystem::CHANNEL_IN_RIGHT;
+                // Fall through...
+            case 1:
+                *channels |= AudioSystem::CHANNEL_IN_LEFT;
                 break;
         }
     }
 
+    if (rate && *rate > 0) {
+        delete mResampler;
+        mResampler = NULL;
+
+        if (mHandle->sampleRate != *rate) {
+            // Convert in the HAL if enabled, otherwise the caller has to
+            // reopen at the PCM rate
+            bool output = mHandle->devices & AudioSystem::DEVICE_OUT_ALL;
+            uint32_t inRate = output ? *rate : mHandle->sampleRate;
+            uint32_t outRate = output ? mHandle->sampleRate : *rate;
+
+            if ((mParent->mResamplerQuality == ALSA_RESAMPLER_OFF) ||
+                (mClientFormat != SNDRV_PCM_FORMAT_S16_LE) ||
+                !ALSAResampler::isSupported(inRate, outRate))
+                return BAD_VALUE;
+
+            delete mResampler;
+            mResampler = new ALSAResampler(inRate, outRate, mClientChannels,
+                                           mParent->mResamplerQuality);
+            if (mResampler->initCheck() != NO_ERROR) {
+                delete mResampler;
+                mResampler = NULL;
+                return BAD_VALUE;
+            }
+            mClientRate = *rate;
+        }
+    } else if (rate) {
+        *rate = mHandle->sampleRate;
+    }
+
+    mPcmFormat = mHandle->format;
+    mPcmChannels = mHandle->channels;
     return NO_ERROR;
 }
 
@@ -217,7 +333,7 @@ String8 ALSAStreamOps::getParameters(const String8& keys)
 
 uint32_t ALSAStreamOps::sampleRate() const
 {
-    return mHandle->sampleRate;
+    return mResampler ? mClientRate : mHandle->sampleRate;
 }
 
 //
@@ -225,27 +341,41 @@ uint32_t ALSAStreamOps::sampleRate() const
 //
 size_t ALSAStreamOps::bufferSize() const
 {
-    LOGV("bufferSize() returns %d", mHandle->bufferSize);
-    return mHandle->bufferSize;
+    size_t frames = mHandle->bufferSize / frameSize();
+
+    if (mResampler) {
+        // Same duration as a PCM period, at the client rate
+        frames = (uint64_t)frames * mClientRate / mHandle->sampleRate;
+    }
+    LOGV("bufferSize() returns %d", frames * clientFrameSize());
+    return frames * clientFrameSize();
 }
 
 int ALSAStreamOps::format() const
 {
-    int pcmFormatBitWidth;
     int audioSystemFormat;
 
-    snd_pcm_format_t ALSAFormat = mHandle->format;
-
-    pcmFormatBitWidth = 16; // snd_pcm_format_physical_width(ALSAFormat); TODO: change runtime detection
-    switch(pcmFormatBitWidth) {
-        case 8:
+    switch(mClientFormat) {
+        case SNDRV_PCM_FORMAT_S8:
             audioSystemFormat = AudioSystem::PCM_8_BIT;
             break;
 
-        default:
-            LOG_FATAL("Unknown AudioSystem bit width %i!", pcmFormatBitWidth);
+        case SNDRV_PCM_FORMAT_S24_LE:
+            audioSystemFormat = AUDIO_FORMAT_PCM_8_24_BIT;
+            break;
+
+        case SNDRV_PCM_FORMAT_S32_LE:
+            audioSystemFormat = AUDIO_FORMAT_PCM_32_BIT;
+            break;
 
-        case 16:
+        case SNDRV_PCM_FORMAT_FLOAT_LE:
+            audioSystemFormat = ALSA_FORMAT_PCM_FLOAT;
+            break;
+
+        default:
+            LOGE("Unknown ALSA format %d, reporting 16 bit", mClientFormat);
+            // Fall through...
+        case SNDRV_PCM_FORMAT_S16_LE:
             audioSystemFormat = AudioSystem::PCM_16_BIT;
             break;
     }
@@ -258,8 +388,19 @@ uint32_t ALSAStreamOps::channels() const
     unsigned int count = mHandle->channels;
     uint32_t channels = 0;
 
-    if (mDevices & AudioSystem::DEVICE_OUT_ALL)
+    if (mDevices & AudioSystem::DEVICE_OUT_ALL) {
+        if (mClientChannelMask)
+            return mClientChannelMask;
+
         switch(count) {
+            case 8:
+                channels |= AudioSystem::CHANNEL_OUT_SIDE_LEFT;
+                channels |= AudioSystem::CHANNEL_OUT_SIDE_RIGHT;
+                // Fall through...
+            case 6:
+                channels |= AudioSystem::CHANNEL_OUT_FRONT_CENTER;
+                channels |= AudioSystem::CHANNEL_OUT_LOW_FREQUENCY;
+                // Fall through...
             case 4:
                 channels |= AudioSystem::CHANNEL_OUT_BACK_LEFT;
                 channels |= AudioSystem::CHANNEL_OUT_BACK_RIGHT;
@@ -272,8 +413,16 @@ uint32_t ALSAStreamOps::channels() const
                 channels |= AudioSystem::CHANNEL_OUT_FRONT_LEFT;
                 break;
         }
-    else
+    } else {
+        if (mClientChannelMask)
+            return mClientChannelMask;
+
         switch(count) {
+            case 4:
+                // Only a capture of all the mics has more than two
+                channels |= AudioSystem::CHANNEL_IN_FRONT;
+                channels |= AudioSystem::CHANNEL_IN_BACK;
+                // Fall through...
             default:
             case 2:
                 channels |= AudioSystem::CHANNEL_IN_RIGHT;
@@ -282,10 +431,572 @@ uint32_t ALSAStreamOps::channels() const
                 channels |= AudioSystem::CHANNEL_IN_LEFT;
                 break;
         }
+    }
 
     return channels;
 }
 
+//
+// (Re)allocate the partial period buffer. Pending bytes are kept as long
+// as they still fit, which is the case unless the period shrank.
+//
+status_t ALSAStreamOps::resizeStaging(size_t size)
+{
+    char *staging;
+
+    if (size <= mStagingSize) {
+        return NO_ERROR;
+    }
+
+    staging = (char *) realloc(mStaging, size);
+    if (!staging) {
+        LOGE("Failed to allocate %d byte staging buffer", size);
+        return NO_MEMORY;
+    }
+    mStaging = staging;
+    mStagingSize = size;
+    return NO_ERROR;
+}
+
+// Grow-only reallocation shared by the conversion buffers
+static status_t growBuffer(void **buffer, size_t *capacity, size_t size, const char *what)
+{
+    void *grown;
+
+    if (size <= *capacity) {
+        return NO_ERROR;
+    }
+
+    grown = realloc(*buffer, size);
+    if (!grown) {
+        LOGE("Failed to allocate %d byte %s buffer", size, what);
+        return NO_MEMORY;
+    }
+    *buffer = grown;
+    *capacity = size;
+    return NO_ERROR;
+}
+
+status_t ALSAStreamOps::resizeConvertBuffer(size_t size)
+{
+    return growBuffer(&mConvertBuffer, &mConvertBufferSize, size, "conversion");
+}
+
+status_t ALSAStreamOps::resizeResampleBuffer(size_t size)
+{
+    return growBuffer((void **)&mResampleBuffer, &mResampleBufferSize, size, "resample");
+}
+
+status_t ALSAStreamOps::resizeRemixBuffer(size_t size)
+{
+    return growBuffer((void **)&mRemixBuffer, &mRemixBufferSize, size, "remix");
+}
+
+status_t ALSAStreamOps::resizeVolumeBuffer(size_t size)
+{
+    return growBuffer(&mVolumeBuffer, &mVolumeBufferSize, size, "volume");
+}
+
+status_t ALSAStreamOps::resizePlanarBuffer(size_t size)
+{
+    return growBuffer((void **)&mPlanarBuffer, &mPlanarBufferSize, size, "planar");
+}
+
+//
+// Return the number of bytes in one frame of the PCM stream
+//
+size_t ALSAStreamOps::frameSize() const
+{
+    return mHandle->channels * pcm_format_bytes(mHandle->format);
+}
+
+//
+// Return the number of bytes in one frame as the client sees it
+//
+size_t ALSAStreamOps::clientFrameSize() const
+{
+    return mClientChannels * pcm_format_bytes(mClientFormat);
+}
+
+//
+// Channel order of the PCM. Beyond stereo the DSP takes the LFE ahead of
+// the center channel, unlike the AudioSystem masks.
+//
+static const uint32_t sPcmLayouts[ALSA_MAX_CHANNELS + 1][ALSA_MAX_CHANNELS] = {
+    { 0 },
+    { AudioSystem::CHANNEL_OUT_FRONT_LEFT },
+    { AudioSystem::CHANNEL_OUT_FRONT_LEFT, AudioSystem::CHANNEL_OUT_FRONT_RIGHT },
+    { 0 },
+    { AudioSystem::CHANNEL_OUT_FRONT_LEFT, AudioSystem::CHANNEL_OUT_FRONT_RIGHT,
+      AudioSystem::CHANNEL_OUT_BACK_LEFT, AudioSystem::CHANNEL_OUT_BACK_RIGHT },
+    { 0 },
+    { AudioSystem::CHANNEL_OUT_FRONT_LEFT, AudioSystem::CHANNEL_OUT_FRONT_RIGHT,
+      AudioSystem::CHANNEL_OUT_LOW_FREQUENCY, AudioSystem::CHANNEL_OUT_FRONT_CENTER,
+      AudioSystem::CHANNEL_OUT_BACK_LEFT, AudioSystem::CHANNEL_OUT_BACK_RIGHT },
+    { 0 },
+    { AudioSystem::CHANNEL_OUT_FRONT_LEFT, AudioSystem::CHANNEL_OUT_FRONT_RIGHT,
+      AudioSystem::CHANNEL_OUT_LOW_FREQUENCY, AudioSystem::CHANNEL_OUT_FRONT_CENTER,
+      AudioSystem::CHANNEL_OUT_BACK_LEFT, AudioSystem::CHANNEL_OUT_BACK_RIGHT,
+      AudioSystem::CHANNEL_OUT_SIDE_LEFT, AudioSystem::CHANNEL_OUT_SIDE_RIGHT },
+};
+
+static bool hasChannel(const uint32_t *layout, uint32_t count, uint32_t channel)
+{
+    for (uint32_t i = 0; i < count; i++) {
+        if (layout[i] == channel)
+            return true;
+    }
+    return false;
+}
+
+//
+// Q14 gain from input channel in to output channel out when the output has
+// no in channel of its own: the center goes to both fronts at -3 dB, rear
+// and side pairs fold into each other or the fronts, the LFE is dropped.
+//
+static int16_t foldGain(uint32_t in, uint32_t out, const uint32_t *layout, uint32_t count)
+{
+    const uint32_t FL = AudioSystem::CHANNEL_OUT_FRONT_LEFT;
+    const uint32_t FR = AudioSystem::CHANNEL_OUT_FRONT_RIGHT;
+    const uint32_t BL = AudioSystem::CHANNEL_OUT_BACK_LEFT;
+    const uint32_t BR = AudioSystem::CHANNEL_OUT_BACK_RIGHT;
+    const uint32_t SL = AudioSystem::CHANNEL_OUT_SIDE_LEFT;
+    const uint32_t SR = AudioSystem::CHANNEL_OUT_SIDE_RIGHT;
+
+    switch(in) {
+        case AudioSystem::CHANNEL_OUT_FRONT_CENTER:
+            return (out == FL || out == FR) ? Q14_MINUS_3DB : 0;
+        case AudioSystem::CHANNEL_OUT_FRONT_LEFT_OF_CENTER:
+            return out == FL ? Q14_MINUS_3DB : 0;
+        case AudioSystem::CHANNEL_OUT_FRONT_RIGHT_OF_CENTER:
+            return out == FR ? Q14_MINUS_3DB : 0;
+        case AudioSystem::CHANNEL_OUT_BACK_LEFT:
+            if (hasChannel(layout, count, SL))
+                return out == SL ? Q14_UNITY : 0;
+            return out == FL ? Q14_MINUS_3DB : 0;
+        case AudioSystem::CHANNEL_OUT_BACK_RIGHT:
+            if (hasChannel(layout, count, SR))
+                return out == SR ? Q14_UNITY : 0;
+            return out == FR ? Q14_MINUS_3DB : 0;
+        case AudioSystem::CHANNEL_OUT_BACK_CENTER:
+            if (hasChannel(layout, count, BL))
+                return (out == BL || out == BR) ? Q14_MINUS_3DB : 0;
+            return (out == FL || out == FR) ? Q14_HALF : 0;
+        case AudioSystem::CHANNEL_OUT_SIDE_LEFT:
+            if (hasChannel(layout, count, BL))
+                return out == BL ? Q14_MINUS_3DB : 0;
+            return out == FL ? Q14_MINUS_3DB : 0;
+        case AudioSystem::CHANNEL_OUT_SIDE_RIGHT:
+            if (hasChannel(layout, count, BR))
+                return out == BR ? Q14_MINUS_3DB : 0;
+            return out == FR ? Q14_MINUS_3DB : 0;
+        default:
+            return 0;
+    }
+}
+
+//
+// Work out how the client's channel mask maps onto the PCM. Layouts that
+// only differ in order are reordered with remap_s16(), anything else is
+// mixed with remix_s16(), mono is spread to or summed from both fronts.
+// Remixing works on 16 bit samples only.
+//
+status_t ALSAStreamOps::setupRemix(uint32_t mask)
+{
+    const uint32_t supported = AudioSystem::CHANNEL_OUT_5POINT1 |
+                               AudioSystem::CHANNEL_OUT_FRONT_LEFT_OF_CENTER |
+                               AudioSystem::CHANNEL_OUT_FRONT_RIGHT_OF_CENTER |
+                               AudioSystem::CHANNEL_OUT_BACK_CENTER |
+                               AudioSystem::CHANNEL_OUT_SIDE_LEFT |
+                               AudioSystem::CHANNEL_OUT_SIDE_RIGHT;
+    const uint32_t centerPair = AudioSystem::CHANNEL_OUT_FRONT_LEFT_OF_CENTER |
+                                AudioSystem::CHANNEL_OUT_FRONT_RIGHT_OF_CENTER;
+    const uint32_t sidePair = AudioSystem::CHANNEL_OUT_SIDE_LEFT |
+                              AudioSystem::CHANNEL_OUT_SIDE_RIGHT;
+    const uint32_t pcmCount = mHandle->channels;
+    const uint32_t *layout;
+    uint32_t in[ALSA_MAX_CHANNELS];
+    uint32_t inCount = 0;
+    bool identity;
+
+    if ((mask & ~supported) || (pcmCount > ALSA_MAX_CHANNELS) ||
+        !sPcmLayouts[pcmCount][0]) {
+        LOGE("setupRemix: unsupported channel mask 0x%x for %d PCM channels",
+             mask, pcmCount);
+        return BAD_VALUE;
+    }
+    layout = sPcmLayouts[pcmCount];
+
+    for (uint32_t bit = 1; bit && bit <= mask; bit <<= 1) {
+        if (!(mask & bit))
+            continue;
+        if (inCount == ALSA_MAX_CHANNELS)
+            return BAD_VALUE;
+        in[inCount] = bit;
+        // The legacy 7.1 mask carries its 7th and 8th channel as the
+        // center pair, in the slots of the side pair
+        if (((mask & centerPair) == centerPair) && !(mask & sidePair)) {
+            if (bit == AudioSystem::CHANNEL_OUT_FRONT_LEFT_OF_CENTER)
+                in[inCount] = AudioSystem::CHANNEL_OUT_SIDE_LEFT;
+            else if (bit == AudioSystem::CHANNEL_OUT_FRONT_RIGHT_OF_CENTER)
+                in[inCount] = AudioSystem::CHANNEL_OUT_SIDE_RIGHT;
+        }
+        inCount++;
+    }
+    if (!inCount)
+        return BAD_VALUE;
+
+    identity = (inCount == pcmCount);
+    for (uint32_t i = 0; identity && i < inCount; i++) {
+        identity = (in[i] == layout[i]);
+    }
+
+    mClientChannels = inCount;
+    mClientChannelMask = mask;
+    mRemix = false;
+    if (identity)
+        return NO_ERROR;
+
+    if (mClientFormat != SNDRV_PCM_FORMAT_S16_LE) {
+        LOGE("setupRemix: channel mixing needs 16 bit, format %d", mClientFormat);
+        return BAD_VALUE;
+    }
+
+    memset(mRemixMatrix, 0, sizeof(mRemixMatrix));
+    for (uint32_t o = 0; o < pcmCount; o++) {
+        int16_t *row = mRemixMatrix + o * 8;
+        for (uint32_t i = 0; i < inCount; i++) {
+            if (inCount == 1) {
+                // Mono feeds both fronts
+                if ((pcmCount == 1) || (layout[o] == AudioSystem::CHANNEL_OUT_FRONT_LEFT) ||
+                    (layout[o] == AudioSystem::CHANNEL_OUT_FRONT_RIGHT))
+                    row[i] = Q14_UNITY;
+            } else if (pcmCount == 1) {
+                // Mono output, half of what either front would get
+                uint32_t stereo = 2;
+                const uint32_t *fronts = sPcmLayouts[stereo];
+                int16_t l, r;
+                l = (in[i] == fronts[0]) ? Q14_UNITY : foldGain(in[i], fronts[0], fronts, stereo);
+                r = (in[i] == fronts[1]) ? Q14_UNITY : foldGain(in[i], fronts[1], fronts, stereo);
+                row[i] = (l + r) / 2;
+            } else if (in[i] == layout[o]) {
+                row[i] = Q14_UNITY;
+            } else if (!hasChannel(layout, pcmCount, in[i])) {
+                row[i] = foldGain(in[i], layout[o], layout, pcmCount);
+            }
+        }
+    }
+
+    // Keep every row within what remix_s16() can sum without overflow
+    for (uint32_t o = 0; o < pcmCount; o++) {
+        int16_t *row = mRemixMatrix + o * 8;
+        int32_t sum = 0;
+        for (uint32_t i = 0; i < inCount; i++)
+            sum += row[i];
+        if (sum >= 4 * Q14_UNITY) {
+            for (uint32_t i = 0; i < inCount; i++)
+                row[i] = (int32_t)row[i] * (4 * Q14_UNITY - 1) / sum;
+        }
+    }
+
+    // A matrix of unity or silent rows, each input used at most once, is a
+    // plain reorder
+    mRemixIsMap = true;
+    for (uint32_t o = 0; mRemixIsMap && o < pcmCount; o++) {
+        const int16_t *row = mRemixMatrix + o * 8;
+        mChannelMap[o] = -1;
+        for (uint32_t i = 0; i < inCount; i++) {
+            if (!row[i])
+                continue;
+            if ((row[i] != Q14_UNITY) || (mChannelMap[o] >= 0)) {
+                mRemixIsMap = false;
+                break;
+            }
+            mChannelMap[o] = i;
+        }
+    }
+
+    mRemix = true;
+    LOGD("setupRemix: mask 0x%x, %d -> %d channels by %s", mask, inCount,
+         pcmCount, mRemixIsMap ? "reorder" : "mixing");
+    return NO_ERROR;
+}
+
+//
+// Multi-mic capture, count channels for the client out of the PCM's mics.
+// select[o] is the mic read into client channel o. Without one, all the
+// mics come through as captured, a mono client gets their mean and any
+// other count the first mics. The choice is kept for pcmReopened().
+//
+status_t ALSAStreamOps::setupMics(uint32_t count, const int8_t *select)
+{
+    uint32_t mics = mHandle->channels;
+    bool identity = (count == mics);
+
+    if (!count || (count > mics))
+        return BAD_VALUE;
+
+    for (uint32_t o = 0; o < count; o++) {
+        int8_t mic = select ? select[o] : (int8_t)o;
+        if ((mic < 0) || ((uint32_t)mic >= mics))
+            return BAD_VALUE;
+        identity = identity && ((uint32_t)mic == o);
+    }
+    if (!identity && (mClientFormat != SNDRV_PCM_FORMAT_S16_LE)) {
+        LOGE("setupMics: selecting mics needs 16 bit, format %d", mClientFormat);
+        return BAD_VALUE;
+    }
+    if (select && (select != mMicSelect)) {
+        memcpy(mMicSelect, select, count * sizeof(select[0]));
+    }
+    mMicSelected = (select != NULL);
+
+    mClientChannels = count;
+    mRemix = !identity;
+    mRemixIsMap = false;
+    mRemixIsDownmix = false;
+    if (identity)
+        return NO_ERROR;
+
+    if ((count == 1) && !select) {
+        memset(mRemixMatrix, 0, sizeof(mRemixMatrix));
+        for (uint32_t i = 0; i < mics; i++)
+            mRemixMatrix[i] = Q14_UNITY / mics;
+        mRemixIsDownmix = true;
+    } else {
+        for (uint32_t o = 0; o < count; o++)
+            mChannelMap[o] = select ? select[o] : (int8_t)o;
+        mRemixIsMap = true;
+    }
+    LOGD("setupMics: %d of %d mics by %s", count, mics, mRemixIsDownmix ? "downmix" : "select");
+    return NO_ERROR;
+}
+
+//
+// Any count of capture channels from whatever the PCM runs at: a mono
+// client takes the mean of the PCM's channels, others channel o of it,
+// repeated when the PCM has fewer.
+//
+void ALSAStreamOps::foldCapture(uint32_t count)
+{
+    mClientChannels = count;
+    mRemix = (count != mHandle->channels);
+    mRemixIsDownmix = mRemix && (count == 1);
+    mRemixIsMap = mRemix && (count > 1);
+    for (uint32_t o = 0; o < count; o++)
+        mChannelMap[o] = o % mHandle->channels;
+}
+
+//
+// setHardwareParams() steps a PCM down to 16 bit or fewer channels when
+// the back end refuses it, and a reopen may land on a different layout
+// than the one set() saw. Rebuild the remix for the new one and drop the
+// partial period staged in the old. Called after every open of mHandle.
+//
+status_t ALSAStreamOps::pcmReopened()
+{
+    if (!mHandle->handle ||
+        ((mHandle->format == mPcmFormat) && (mHandle->channels == mPcmChannels)))
+        return NO_ERROR;
+
+    LOGW("PCM reopened as format %d with %d channels, was %d with %d",
+         mHandle->format, mHandle->channels, mPcmFormat, mPcmChannels);
+    mPcmFormat = mHandle->format;
+    mPcmChannels = mHandle->channels;
+    mStagingBytes = 0;
+    mStagingOffset = 0;
+
+    if ((mClientFormat != mHandle->format) &&
+        ((mClientFormat == SNDRV_PCM_FORMAT_S8) || (mHandle->format == SNDRV_PCM_FORMAT_S8)))
+        return BAD_VALUE;
+
+    if (mDevices & AudioSystem::DEVICE_OUT_ALL)
+        return setupRemix(mClientChannelMask);
+
+    if (mMultiMic &&
+        (setupMics(mClientChannels, mMicSelected ? mMicSelect : NULL) == NO_ERROR))
+        return NO_ERROR;
+    foldCapture(mClientChannels);
+    if (mRemix && ((mClientFormat != SNDRV_PCM_FORMAT_S16_LE) ||
+                   (mHandle->format != SNDRV_PCM_FORMAT_S16_LE)))
+        return BAD_VALUE;
+    return NO_ERROR;
+}
+
+void ALSAStreamOps::remixFrames(int16_t *dst, const int16_t *src, size_t frames)
+{
+    if (mRemixIsMap) {
+        remap_s16(dst, mHandle->channels, src, mClientChannels, mChannelMap, frames);
+    } else {
+        remix_s16(dst, mHandle->channels, src, mClientChannels, mRemixMatrix, frames);
+    }
+}
+
+//
+// Tiered recovery after a failed pcm_write()/pcm_read():
+//  - EPIPE (underrun/overrun) and ESTRPIPE only need the stream to go back
+//    to PREPARED, the hw/sw params and the UCM route are still valid.
+//  - EBADFD and ENODEV mean the PCM is gone, it has to be reopened.
+// Anything else is tried with a prepare first and escalated to a reopen
+// if that fails. Only the reopen needs mParent->mRoutingLock,
+// the caller holds mHandle->lock.
+// Returns an error once the caller should stop retrying, the stream is
+// then backed off until recoveryAllowed() turns true again.
+//
+status_t ALSAStreamOps::recover(struct pcm *pcm, int err)
+{
+    mErrorCount++;
+    if (err == -EPIPE) {
+        mXrunCount++;
+    }
+
+    if (!recoveryAllowed()) {
+        return INVALID_OPERATION;
+    }
+    if (mRecoveryAttempts >= RECOVERY_MAX_RETRIES) {
+        recoveryFailed();
+        return INVALID_OPERATION;
+    }
+    // Retries go ahead right away, the caller holds mHandle->lock and a
+    // sleep here would stall routing and standby on this handle. Waiting
+    // happens once the retries are used up, see recoveryFailed().
+    mRecoveryAttempts++;
+
+    if (pcm && (err != -EBADFD) && (err != -ENODEV)) {
+        if (pcm_prepare(pcm) == 0) {
+            if (pcm == mHandle->handle) {
+                mHandle->state = ALSA_STATE_PREPARED;
+            }
+            mPrepareCount++;
+            LOGW("recovered from error %d with pcm_prepare", err);
+            return NO_ERROR;
+        }
+        LOGE("pcm_prepare failed after error %d, reopening", err);
+    }
+
+    mParent->mRoutingLock.lock();
+    LOGE("reopening PCM after error %d", err);
+    reopen();
+    mParent->mRoutingLock.unlock();
+    mReopenCount++;
+
+    if (mHandle->handle == NULL) {
+        recoveryFailed();
+        return NO_INIT;
+    }
+    return NO_ERROR;
+}
+
+bool ALSAStreamOps::recoveryAllowed() const
+{
+    return !mRecoveryBlocked ||
+           (systemTime(SYSTEM_TIME_MONOTONIC) >= mRecoveryRetryTime);
+}
+
+//
+// Give up on the device for the current backoff period and double it.
+// Until then the stream runs on emulateTime() instead of the PCM.
+//
+void ALSAStreamOps::recoveryFailed()
+{
+    LOGE("%s: device failing, next attempt in %u ms (%u errors)",
+         mHandle->useCase, mRecoveryBackoffMs, mErrorCount);
+    mRecoveryBlocked = true;
+    mRecoveryAttempts = 0;
+    mRecoveryRetryTime = systemTime(SYSTEM_TIME_MONOTONIC) +
+                         milliseconds(mRecoveryBackoffMs);
+    if (mRecoveryBackoffMs < RECOVERY_BACKOFF_MAX_MS)
+        mRecoveryBackoffMs *= 2;
+}
+
+void ALSAStreamOps::recoverySucceeded()
+{
+    if (!mRecoveryAttempts && !mRecoveryBlocked)
+        return;
+
+    mRecoveryBlocked = false;
+    mRecoveryAttempts = 0;
+    mRecoveryRetryTime = 0;
+    mRecoveryBackoffMs = RECOVERY_BACKOFF_MIN_MS;
+    mEmulationStart = 0;
+}
+
+//
+// Sleep for as long as the hardware would have taken to consume or
+// produce bytes. The deadline is computed from the total number of
+// emulated frames since the device went down, so rounding does not
+// accumulate from one call to the next.
+//
+void ALSAStreamOps::emulateTime(size_t bytes)
+{
+    nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+    nsecs_t deadline;
+
+    // bytes are always at the PCM rate
+    if (!mHandle->sampleRate || !frameSize())
+        return;
+
+    if (!mEmulationStart) {
+        mEmulationStart = now;
+        mEmulatedFrames = 0;
+    }
+    mEmulatedFrames += bytes / frameSize();
+    deadline = mEmulationStart +
+               (nsecs_t)(mEmulatedFrames * 1000000000LL / mHandle->sampleRate);
+
+    if (deadline > now) {
+        usleep(ns2us(deadline - now));
+    } else if (now - deadline > seconds(1)) {
+        // The caller stalled, do not try to catch up
+        mEmulationStart = now;
+        mEmulatedFrames = 0;
+    }
+}
+
+//
+// Close and reopen the PCM(s) of this stream, caller holds mHandle->lock
+// and mParent->mRoutingLock
+//
+void ALSAStreamOps::reopen()
+{
+    pcm_close(mHandle->handle);
+    mHandle->handle = NULL;
+    mHandle->state = ALSA_STATE_CLOSED;
+    if((!strncmp(mHandle->useCase, SND_USE_CASE_VERB_IP_VOICECALL, strlen(SND_USE_CASE_VERB_IP_VOICECALL))) ||
+      (!strncmp(mHandle->useCase, SND_USE_CASE_MOD_PLAY_VOIP, strlen(SND_USE_CASE_MOD_PLAY_VOIP)))) {
+         pcm_close(mHandle->rxHandle);
+         mHandle->rxHandle = NULL;
+         mHandle->module->startVoipCall(mHandle);
+    }
+    else
+         mHandle->module->open(mHandle);
+    reopened();
+}
+
+//
+// After any open of mHandle: a PCM the stream can no longer feed is
+// closed again, the caller then treats it as a failed open.
+//
+void ALSAStreamOps::reopened()
+{
+    if (pcmReopened() != NO_ERROR) {
+        LOGE("Cannot convert to the reopened PCM, closing it");
+        mHandle->module->standby(mHandle);
+    }
+}
+
+void ALSAStreamOps::dumpRecovery(int fd) const
+{
+    char buffer[256];
+
+    snprintf(buffer, sizeof(buffer),
+             "  use case: %s\n  pcm state: %s\n  errors: %u\n  xruns: %u\n"
+             "  prepare recoveries: %u\n  reopens: %u\n  backoff: %u ms\n",
+             mHandle->useCase, alsaStateName(mHandle->state), mErrorCount, mXrunCount, mPrepareCount,
+             mReopenCount, mRecoveryBlocked ? mRecoveryBackoffMs : 0);
+    ::write(fd, buffer, strlen(buffer));
+}
+
 void ALSAStreamOps::close()
 {
     LOGD("close");
@@ -294,6 +1005,9 @@ void ALSAStreamOps::close()
        mParent->mVoipMicMute = false;
        mParent->mVoipStreamCount = 0;
     }
+
+    Mutex::Autolock handleLock(mHandle->lock);
+    Mutex::Autolock routingLock(mParent->mRoutingLock);
     mParent->mALSADevice->close(mHandle);
 }
 
@@ -310,7 +1024,12 @@ void ALSAStreamOps::close()
 status_t ALSAStreamOps::open(int mode)
 {
     LOGD("open");
-    return mParent->mALSADevice->open(mHandle);
+
+    Mutex::Autolock handleLock(mHandle->lock);
+    Mutex::Autolock routingLock(mParent->mRoutingLock);
+    status_t err = mParent->mALSADevice->open(mHandle);
+    reopened();
+    return mHandle->handle ? err : NO_INIT;
 }
 
 }       // namespace androidi_audio_legacy
@@ -0,0 +1,378 @@
+/* ALSAStreamSplitter.cpp
+ **
+ ** Copyright (c) 2012, Code Aurora Forum. All rights reserved.
+ **
+ ** Licensed under the Apache License, Version 2.0 (the "License");
+ ** you may not use this file except in compliance with the License.
+ ** You may obtain a copy of the License at
+ **
+ **     http://www.apache.org/licenses/LICENSE-2.0
+ **
+ ** Unless required by applicable law or agreed to in writing, software
+ ** distributed under the License is distributed on an "AS IS" BASIS,
+ ** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ ** See the License for the specific language governing permissions and
+ ** limitations under the License.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+
+#define LOG_TAG "ALSAStreamSplitter"
+//#define LOG_NDEBUG 0
+#define LOG_NDDEBUG 0
+#include <utils/Log.h>
+#include <utils/String8.h>
+
+#include <cutils/atomic.h>
+
+#include "AudioHardwareALSA.h"
+
+// Periods of capture kept for the clients, rounded up to a power of two
+#define SPLITTER_RING_PERIODS       8
+#define SPLITTER_THREAD_PRIORITY    2
+#define SPLITTER_WAIT_TIMEOUT_NS    100000000LL
+
+namespace android_audio_legacy
+{
+
+// ----------------------------------------------------------------------------
+
+//
+// history is how far back a client may start, see setPreroll(). The ring
+// holds that on top of the period being written.
+//
+ALSAStreamSplitter::ALSAStreamSplitter(AudioStreamInALSA *source, alsa_handle_t *handle,
+                                       uint32_t history) :
+    mSource(source),
+    mHandle(handle),
+    mPeriodBytes(source->bufferSize()),
+    mFrameSize(source->clientFrameSize()),
+    mPeriodBuffer(NULL),
+    mRing(NULL),
+    mRingFrames(1),
+    mWritePos(0),
+    mFramesCaptured(0),
+    mOverruns(0),
+    mAlwaysOn(false),
+    mRunning(false),
+    mExit(false)
+{
+    size_t periodFrames = mFrameSize ? mPeriodBytes / mFrameSize : 0;
+
+    memset(mClients, 0, sizeof(mClients));
+
+    if (!periodFrames) {
+        LOGE("Bad capture period of %d bytes", mPeriodBytes);
+        return;
+    }
+    while ((mRingFrames < periodFrames * SPLITTER_RING_PERIODS) ||
+           (mRingFrames < history + periodFrames))
+        mRingFrames <<= 1;
+
+    mPeriodBuffer = (char *) malloc(mPeriodBytes);
+    mRing = (char *) malloc(mRingFrames * mFrameSize);
+    if (!mPeriodBuffer || !mRing) {
+        LOGE("Failed to allocate a %d frame capture ring", mRingFrames);
+        return;
+    }
+
+    if (pthread_create(&mThread, NULL, threadWrapper, this)) {
+        LOGE("Failed to create splitter thread");
+        return;
+    }
+    mRunning = true;
+    LOGD("splitter started, period %d bytes, ring %d frames", mPeriodBytes, mRingFrames);
+}
+
+//
+// The source is only taken over once the splitter is running, if it failed
+// to start the caller keeps using the source as a plain input.
+//
+ALSAStreamSplitter::~ALSAStreamSplitter()
+{
+    if (mRunning) {
+        mLock.lock();
+        mExit = true;
+        mCond.broadcast();
+        mLock.unlock();
+        pthread_join(mThread, NULL);
+        delete mSource;
+    }
+
+    free(mPeriodBuffer);
+    free(mRing);
+}
+
+int ALSAStreamSplitter::addClient()
+{
+    Mutex::Autolock autoLock(mLock);
+
+    for (int i = 0; i < ALSA_SPLITTER_MAX_CLIENTS; i++) {
+        Client *c = &mClients[i];
+        if (c->used)
+            continue;
+
+        memset(c, 0, sizeof(*c));
+        c->used = true;
+        LOGD("addClient: client %d", i);
+        return i;
+    }
+
+    LOGE("addClient: all %d clients in use", ALSA_SPLITTER_MAX_CLIENTS);
+    return -1;
+}
+
+void ALSAStreamSplitter::removeClient(int client)
+{
+    Mutex::Autolock autoLock(mLock);
+
+    LOGD("removeClient: client %d", client);
+    mClients[client].used = false;
+    mClients[client].active = false;
+    mCond.broadcast();
+}
+
+size_t ALSAStreamSplitter::clientCount()
+{
+    Mutex::Autolock autoLock(mLock);
+    size_t count = 0;
+
+    for (int i = 0; i < ALSA_SPLITTER_MAX_CLIENTS; i++) {
+        if (mClients[i].used)
+            count++;
+    }
+    return count;
+}
+
+void ALSAStreamSplitter::setAlwaysOn(bool on)
+{
+    Mutex::Autolock autoLock(mLock);
+
+    mAlwaysOn = on;
+    mCond.broadcast();
+}
+
+void ALSAStreamSplitter::setPreroll(int client, uint32_t frames)
+{
+    Mutex::Autolock autoLock(mLock);
+
+    mClients[client].preroll = frames;
+}
+
+//
+// Called from the client's read(). A client starts its pre-roll behind
+// the newest frame when it leaves standby and then only moves its own
+// cursor, blocking while it has caught up with the capture. Anything
+// older than the ring (less the period being written) is skipped and
+// added to *lost.
+//
+ssize_t ALSAStreamSplitter::read(int client, void *buffer, size_t bytes, uint32_t *lost)
+{
+    Client *c = &mClients[client];
+    char *dst = (char *)buffer;
+    size_t frames = bytes / mFrameSize;
+    size_t done = 0;
+    uint32_t usable = mRingFrames - mPeriodBytes / mFrameSize;
+
+    mLock.lock();
+    if (!c->active) {
+        // The history is handed out straight from the ring, as far back
+        // as it goes
+        uint64_t history = mFramesCaptured < usable ? mFramesCaptured : usable;
+        uint32_t preroll = c->preroll < history ? c->preroll : (uint32_t)history;
+
+        c->active = true;
+        c->readPos = (uint32_t)android_atomic_acquire_load(&mWritePos) - preroll;
+        mCond.broadcast();
+    }
+    *lost = c->lost;
+    c->lost = 0;
+    mLock.unlock();
+
+    while (done < frames) {
+        uint32_t writePos = (uint32_t)android_atomic_acquire_load(&mWritePos);
+        uint32_t avail = writePos - c->readPos;
+        uint32_t n, offset, chunk;
+
+        if (avail > usable) {
+            *lost += avail - usable;
+            c->readPos = writePos - usable;
+            avail = usable;
+        }
+
+        if (!avail) {
+            Mutex::Autolock autoLock(mLock);
+            if (mExit)
+                break;
+            if ((uint32_t)android_atomic_acquire_load(&mWritePos) == c->readPos)
+                mCond.waitRelative(mLock, SPLITTER_WAIT_TIMEOUT_NS);
+            continue;
+        }
+
+        n = frames - done;
+        if (n > avail)
+            n = avail;
+        offset = c->readPos & (mRingFrames - 1);
+        chunk = mRingFrames - offset;
+        if (chunk > n)
+            chunk = n;
+        memcpy(dst + done * mFrameSize, mRing + offset * mFrameSize, chunk * mFrameSize);
+        if (chunk < n)
+            memcpy(dst + (done + chunk) * mFrameSize, mRing, (n - chunk) * mFrameSize);
+
+        // The thread may have lapped us while copying, then the copy is
+        // torn: drop it, the next pass counts the skipped frames. As in a
+        // seqlock reader, the ring loads must complete before the check.
+        android_memory_barrier();
+        writePos = (uint32_t)android_atomic_acquire_load(&mWritePos);
+        if (writePos - c->readPos > usable)
+            continue;
+
+        c->readPos += n;
+        done += n;
+    }
+
+    c->framesRead += done;
+    return done * mFrameSize;
+}
+
+// The client stops holding the capture up, its cursor restarts at the
+// newest frame on the next read()
+void ALSAStreamSplitter::standby(int client)
+{
+    Mutex::Autolock autoLock(mLock);
+
+    mClients[client].active = false;
+    mCond.broadcast();
+}
+
+void ALSAStreamSplitter::dump(int fd)
+{
+    Mutex::Autolock autoLock(mLock);
+    char buffer[256];
+    uint32_t writePos = (uint32_t)android_atomic_acquire_load(&mWritePos);
+
+    snprintf(buffer, sizeof(buffer),
+             "  capture splitter: period %d bytes, ring %d frames, %llu source overruns%s\n",
+             mPeriodBytes, mRingFrames, (unsigned long long)mOverruns,
+             mAlwaysOn ? ", always on" : "");
+    ::write(fd, buffer, strlen(buffer));
+    for (int i = 0; i < ALSA_SPLITTER_MAX_CLIENTS; i++) {
+        Client *c = &mClients[i];
+        if (!c->used)
+            continue;
+        snprintf(buffer, sizeof(buffer),
+                 "    client %d: %s behind %u frames read %llu preroll %u\n",
+                 i, c->active ? "active" : "idle", c->active ? writePos - c->readPos : 0,
+                 (unsigned long long)c->framesRead, c->preroll);
+        ::write(fd, buffer, strlen(buffer));
+    }
+}
+
+void *ALSAStreamSplitter::threadWrapper(void *me)
+{
+    static_cast<ALSAStreamSplitter *>(me)->threadLoop();
+    return NULL;
+}
+
+//
+// Copy one capture period into the ring and only then move mWritePos, so
+// a client never sees a position whose frames are not there yet.
+//
+void ALSAStreamSplitter::publish(const char *buffer, size_t frames)
+{
+    uint32_t writePos = (uint32_t)mWritePos;
+    uint32_t offset = writePos & (mRingFrames - 1);
+    uint32_t chunk = mRingFrames - offset;
+
+    if (chunk > frames)
+        chunk = frames;
+    memcpy(mRing + offset * mFrameSize, buffer, chunk * mFrameSize);
+    if (chunk < frames)
+        memcpy(mRing, buffer + chunk * mFrameSize, (frames - chunk) * mFrameSize);
+
+    android_atomic_release_store((int32_t)(writePos + frames), &mWritePos);
+}
+
+void ALSAStreamSplitter::threadLoop()
+{
+    struct sched_param param;
+    bool sourceActive = false;
+
+    param.sched_priority = SPLITTER_THREAD_PRIORITY;
+    if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &param)) {
+        LOGW("splitter thread: SCHED_FIFO not permitted, using urgent audio priority");
+        androidSetThreadPriority(0, ANDROID_PRIORITY_URGENT_AUDIO);
+    }
+
+    // Every client pre-processes what it reads, the ring holds the
+    // capture as is
+    mSource->setPreProcessing(0);
+
+    mLock.lock();
+    while (!mExit) {
+        bool any = mAlwaysOn;
+        uint32_t lost;
+        ssize_t n;
+
+        for (int i = 0; i < ALSA_SPLITTER_MAX_CLIENTS; i++) {
+            if (mClients[i].used && mClients[i].active)
+                any = true;
+        }
+
+        if (!any) {
+            if (sourceActive) {
+                // Nobody is reading, let the source close the PCM
+                mLock.unlock();
+                mSource->standby();
+                mLock.lock();
+                sourceActive = false;
+                // What is left in the ring is from before the gap
+                mFramesCaptured = 0;
+                continue;
+            }
+            mCond.wait(mLock);
+            continue;
+        }
+
+        mLock.unlock();
+        n = mSource->read(mPeriodBuffer, mPeriodBytes);
+        sourceActive = true;
+        if (n > 0) {
+            publish(mPeriodBuffer, n / mFrameSize);
+        }
+        lost = mSource->getInputFramesLost();
+        mLock.lock();
+        if (n > 0) {
+            mFramesCaptured += n / mFrameSize;
+        }
+
+        // What the PCM lost, every client reading at the time lost too
+        if (lost) {
+            mOverruns++;
+            for (int i = 0; i < ALSA_SPLITTER_MAX_CLIENTS; i++) {
+                if (mClients[i].used && mClients[i].active)
+                    mClients[i].lost += lost;
+            }
+        }
+        mCond.broadcast();
+
+        // Don't spin on a source that fails outright
+        if (n <= 0) {
+            mCond.waitRelative(mLock, SPLITTER_WAIT_TIMEOUT_NS);
+        }
+    }
+    mLock.unlock();
+
+    if (sourceActive) {
+        mSource->standby();
+    }
+}
+
+}       // namespace android_audio_legacy
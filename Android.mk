@@ -18,6 +18,13 @@ LOCAL_SRC_FILES := \
   AudioStreamOutALSA.cpp 	\
   AudioStreamInALSA.cpp 	\
   ALSAStreamOps.cpp		\
+  ALSARingBuffer.cpp		\
+  ALSAStreamMixer.cpp		\
+  ALSAKernels.cpp		\
+  ALSAResampler.cpp		\
+  ALSAProfileTable.cpp		\
+  ALSAStreamSplitter.cpp	\
+  ALSAPreProcessor.cpp		\
   audio_hw_hal.cpp
 
 LOCAL_STATIC_LIBRARIES := \
@@ -41,6 +48,7 @@ LOCAL_C_INCLUDES += hardware/libhardware/include
 LOCAL_C_INCLUDES += hardware/libhardware_legacy/include
 LOCAL_C_INCLUDES += frameworks/base/include
 LOCAL_C_INCLUDES += system/core/include
+LOCAL_C_INCLUDES += system/media/audio_effects/include
 
 LOCAL_MODULE := audio.primary.msm8960
 LOCAL_MODULE_PATH := $(TARGET_OUT_SHARED_LIBRARIES)/hw
@@ -110,5 +118,7 @@ LOCAL_MODULE_TAGS := optional
 
 include $(BUILD_SHARED_LIBRARY)
 
+include $(LOCAL_PATH)/tests/Android.mk
+
 endif # TARGET_BOARD_PLATFORM := msm8960
 endif # BOARD_USES_ALSA_AUDIO :true
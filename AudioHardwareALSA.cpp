@@ -24,6 +24,7 @@
 #include <unistd.h>
 #include <dlfcn.h>
 #include <math.h>
+#include <pthread.h>
 
 #define LOG_TAG "AudioHardwareALSA"
 //#define LOG_NDEBUG 0
@@ -52,19 +53,86 @@ namespace android_audio_legacy
 
 // ----------------------------------------------------------------------------
 
+// Output devices behind each ALSA_ROUTE_LATENCY_* route, with the property
+// holding its DSP delay in usec
+static const struct {
+    uint32_t        devices;
+    const char *    property;
+} routeLatencyTable[ALSA_ROUTE_LATENCY_COUNT] = {
+    { AudioSystem::DEVICE_OUT_EARPIECE,
+      "audio.latency.handset_us" },
+    { AudioSystem::DEVICE_OUT_SPEAKER,
+      "audio.latency.speaker_us" },
+    { AudioSystem::DEVICE_OUT_WIRED_HEADSET | AudioSystem::DEVICE_OUT_WIRED_HEADPHONE |
+      AudioSystem::DEVICE_OUT_ANC_HEADSET | AudioSystem::DEVICE_OUT_ANC_HEADPHONE,
+      "audio.latency.headset_us" },
+    { AudioSystem::DEVICE_OUT_AUX_DIGITAL,
+      "audio.latency.hdmi_us" },
+    { AudioSystem::DEVICE_OUT_BLUETOOTH_SCO | AudioSystem::DEVICE_OUT_BLUETOOTH_SCO_HEADSET |
+      AudioSystem::DEVICE_OUT_BLUETOOTH_SCO_CARKIT | AudioSystem::DEVICE_OUT_BLUETOOTH_A2DP |
+      AudioSystem::DEVICE_OUT_BLUETOOTH_A2DP_HEADPHONES | AudioSystem::DEVICE_OUT_BLUETOOTH_A2DP_SPEAKER,
+      "audio.latency.bt_us" },
+    { AudioSystem::DEVICE_OUT_PROXY,
+      "audio.latency.proxy_us" },
+};
+
 AudioHardwareInterface *AudioHardwareALSA::create() {
     return new AudioHardwareALSA();
 }
 
+int AudioHardwareALSA::outputProfile(const String8& name)
+{
+    if (name == "fast") {
+        return ALSA_PROFILE_FAST;
+    } else if (name == "deep_buffer") {
+        return ALSA_PROFILE_DEEP_BUFFER;
+    }
+    return ALSA_PROFILE_DEFAULT;
+}
+
+int AudioHardwareALSA::resamplerQuality(const String8& name)
+{
+    if (name == "low") {
+        return ALSA_RESAMPLER_LOW;
+    } else if (name == "medium") {
+        return ALSA_RESAMPLER_MEDIUM;
+    } else if (name == "high") {
+        return ALSA_RESAMPLER_HIGH;
+    }
+    return ALSA_RESAMPLER_OFF;
+}
+
+int AudioHardwareALSA::pcmFormat(const String8& name)
+{
+    if (name == "s16") {
+        return SNDRV_PCM_FORMAT_S16_LE;
+    } else if (name == "s24") {
+        return SNDRV_PCM_FORMAT_S24_LE;
+    } else if (name == "s24_3") {
+        return SNDRV_PCM_FORMAT_S24_3LE;
+    } else if (name == "s32") {
+        return SNDRV_PCM_FORMAT_S32_LE;
+    }
+    return ALSA_FORMAT_FOLLOW_CLIENT;
+}
+
 AudioHardwareALSA::AudioHardwareALSA() :
-    mALSADevice(0),mVoipStreamCount(0),mVoipMicMute(false)
+    mALSADevice(0),mVoipStreamCount(0),mVoipMicMute(false),mOutputWriterThread(false),
+    mOutputProfile(ALSA_PROFILE_DEFAULT),mSoftwareMixer(false),mMixer(NULL),
+    mCaptureFanout(false),mMultiMic(false),mSplitter(NULL),mCapturePreProc(0),mNativeEffects(true),
+    mPrerollMs(0),mPreroll(false),
+    mResamplerQuality(ALSA_RESAMPLER_OFF),mOutputFormat(ALSA_FORMAT_FOLLOW_CLIENT),
+    mHdmiMaxChannels(2),mSoftwareVolume(true),mStandbyDelayMs(0),
+    mStandbyThreadRunning(false),mStandbyExit(false)
 {
     FILE *fp;
     char soundCardInfo[200];
+    char value[PROPERTY_VALUE_MAX];
     hw_module_t *module;
     int err = hw_get_module(ALSA_HARDWARE_MODULE_ID,
             (hw_module_t const**)&module);
     int codec_rev = 2;
+    memset(mRouteLatency, 0, sizeof(mRouteLatency));
     LOGD("hw_get_module(ALSA_HARDWARE_MODULE_ID) returned err %d", err);
     if (err == 0) {
         hw_device_t* device;
@@ -78,6 +146,65 @@ AudioHardwareALSA::AudioHardwareALSA() :
             mDevSettingsFlag |= TTY_OFF;
             mBluetoothVGS = false;
 
+            property_get("audio.playback.writer_thread", value, "0");
+            mOutputWriterThread = (!strcmp("1", value) || !strcmp("true", value));
+
+            property_get("audio.playback.profile", value, "default");
+            mOutputProfile = outputProfile(String8(value));
+
+            property_get("audio.playback.sw_mixer", value, "0");
+            mSoftwareMixer = (!strcmp("1", value) || !strcmp("true", value));
+
+            // Let several inputs record from one capture PCM
+            property_get("audio.capture.fanout", value, "0");
+            mCaptureFanout = (!strcmp("1", value) || !strcmp("true", value));
+
+            // Record from every Fluence mic instead of the processed pair
+            property_get("audio.capture.multimic", value, "0");
+            mMultiMic = (!strcmp("1", value) || !strcmp("true", value));
+
+            // Pre-processing run on every input, and whether the AGC and
+            // NS effects use the built-in stages instead of their own
+            property_get("audio.capture.preproc", value, "");
+            mCapturePreProc = ALSAPreProcessor::parseStages(value);
+            property_get("audio.capture.native_effects", value, "1");
+            mNativeEffects = (!strcmp("1", value) || !strcmp("true", value));
+
+            // Keep this much of the built-in mic captured in the
+            // background, 0 disables the pre-roll
+            property_get("audio.capture.preroll_ms", value, "0");
+            mPrerollMs = atoi(value);
+
+            property_get("audio.resampler.quality", value, "off");
+            mResamplerQuality = resamplerQuality(String8(value));
+
+            property_get("audio.playback.format", value, "");
+            mOutputFormat = pcmFormat(String8(value));
+
+            // What the HDMI sink takes, the PCM still steps down if the
+            // back end refuses
+            property_get("audio.hdmi.max_channels", value, "2");
+            mHdmiMaxChannels = atoi(value);
+
+            // Scale direct outputs in the HAL rather than leaving them at
+            // full volume or to AudioFlinger
+            property_get("audio.playback.sw_volume", value, "1");
+            mSoftwareVolume = (!strcmp("1", value) || !strcmp("true", value));
+
+            // Grace period before an output in standby gives up its PCM
+            // and route, 0 closes them right away
+            property_get("audio.playback.standby_delay_ms", value, "0");
+            mStandbyDelayMs = atoi(value);
+
+            for (int i = 0; i < ALSA_ROUTE_LATENCY_COUNT; i++) {
+                property_get(routeLatencyTable[i].property, value, "0");
+                mRouteLatency[i] = atoi(value);
+            }
+
+            // Per-device buffering of each use case, the built-in
+            // profiles cover whatever the file leaves out
+            property_get("audio.profiles.config", value, ALSA_PROFILE_CONFIG);
+            mProfiles.load(value);
 
             if((fp = fopen("/proc/asound/cards","r")) == NULL) {
                 LOGE("Cannot open /proc/asound/cards file to get sound card info");
@@ -104,6 +231,8 @@ AudioHardwareALSA::AudioHardwareALSA() :
                 LOGE("Failed to open ucm instance: %d", errno);
             } else {
                 LOGI("ucm instance opened: %u", (unsigned)mUcMgr);
+                Mutex::Autolock prerollLock(mPrerollLock);
+                startPreroll();
             }
         } else {
             LOGE("ALSA Module could not be opened!!!");
@@ -115,6 +244,16 @@ AudioHardwareALSA::AudioHardwareALSA() :
 
 AudioHardwareALSA::~AudioHardwareALSA()
 {
+    if (mStandbyThreadRunning) {
+        mStandbyLock.lock();
+        mStandbyExit = true;
+        mStandbyCond.signal();
+        mStandbyLock.unlock();
+        pthread_join(mStandbyThread, NULL);
+    }
+    mPrerollLock.lock();
+    stopPreroll();
+    mPrerollLock.unlock();
     if (mUcMgr != NULL) {
         LOGD("closing ucm instance: %u", (unsigned)mUcMgr);
         snd_use_case_mgr_close(mUcMgr);
@@ -204,6 +343,18 @@ status_t AudioHardwareALSA::setMode(int mode)
 
     if (mode != mMode) {
         status = AudioHardwareBase::setMode(mode);
+
+        // Calls take the mic over, the pre-roll resumes once idle. Back in
+        // normal mode a call is still up until doRouting() ends it, see
+        // setParameters().
+        Mutex::Autolock prerollLock(mPrerollLock);
+        if (mode != AudioSystem::MODE_NORMAL) {
+            if (mPreroll && !mSplitter->clientCount()) {
+                stopPreroll();
+            }
+        } else {
+            startPreroll();
+        }
     }
 
     return status;
@@ -217,8 +368,13 @@ status_t AudioHardwareALSA::setParameters(const String8& keyValuePairs)
     status_t status = NO_ERROR;
     int device;
     int btRate;
+    bool busy;
     LOGD("setParameters() %s", keyValuePairs.string());
 
+    mLock.lock();
+    busy = mIsVoiceCallActive || mIsFmActive;
+    mLock.unlock();
+
     key = String8(TTY_MODE_KEY);
     if (param.get(key, value) == NO_ERROR) {
         mDevSettingsFlag &= TTY_CLEAR;
@@ -307,6 +463,15 @@ status_t AudioHardwareALSA::setParameters(const String8& keyValuePairs)
         param.remove(key);
     }
 
+    // Takes effect for the HiFi outputs opened afterwards, the mixer sizes
+    // its buffers from the stream when it opens it.
+    key = String8(OUTPUT_PROFILE_KEY);
+    if (param.get(key, value) == NO_ERROR) {
+        mOutputProfile = outputProfile(value);
+        LOGI("Output profile set to %s", value.string());
+        param.remove(key);
+    }
+
     key = String8(FENS_KEY);
     if (param.get(key, value) == NO_ERROR) {
         bool flag = false;
@@ -328,6 +493,20 @@ status_t AudioHardwareALSA::setParameters(const String8& keyValuePairs)
         param.remove(key);
     }
 #endif
+
+    // Back to the background capture once doRouting() or handleFm() has
+    // torn a call or FM down and their verb is gone
+    if (busy) {
+        mLock.lock();
+        busy = mIsVoiceCallActive || mIsFmActive;
+        mLock.unlock();
+        if (!busy) {
+            mPrerollLock.lock();
+            startPreroll();
+            mPrerollLock.unlock();
+        }
+    }
+
     if (param.size()) {
         status = BAD_VALUE;
     }
@@ -394,9 +573,11 @@ void AudioHardwareALSA::doRouting(int device)
           device, newMode, mIsVoiceCallActive, mIsFmActive);
     if((newMode == AudioSystem::MODE_IN_CALL) && (mIsVoiceCallActive == 0)) {
         // Start voice call
-        unsigned long bufferSize = DEFAULT_BUFFER_SIZE;
         alsa_handle_t alsa_handle;
         char *use_case;
+        // The new handle is not visible to any stream yet, only the UCM
+        // manager needs locking
+        Mutex::Autolock routingLock(mRoutingLock);
         snd_use_case_get(mUcMgr, "_verb", (const char **)&use_case);
         if ((use_case == NULL) || (!strcmp(use_case, SND_USE_CASE_VERB_INACTIVE))) {
             strlcpy(alsa_handle.useCase, SND_USE_CASE_VERB_VOICECALL, sizeof(alsa_handle.useCase));
@@ -405,18 +586,7 @@ void AudioHardwareALSA::doRouting(int device)
         }
         free(use_case);
 
-        for (size_t b = 1; (bufferSize & ~b) != 0; b <<= 1)
-        bufferSize &= ~b;
-        alsa_handle.module = mALSADevice;
-        alsa_handle.bufferSize = bufferSize;
-        alsa_handle.devices = device;
-        alsa_handle.handle = 0;
-        alsa_handle.format = SNDRV_PCM_FORMAT_S16_LE;
-        alsa_handle.channels = VOICE_CHANNEL_MODE;
-        alsa_handle.sampleRate = VOICE_SAMPLING_RATE;
-        alsa_handle.latency = VOICE_LATENCY;
-        alsa_handle.rxHandle = 0;
-        alsa_handle.ucMgr = mUcMgr;
+        initHandle(&alsa_handle, ALSA_PROFILE_VOICE_CALL, device);
         mIsVoiceCallActive = 1;
         mDeviceList.push_back(alsa_handle);
         ALSAHandleList::iterator it = mDeviceList.end();
@@ -436,8 +606,12 @@ void AudioHardwareALSA::doRouting(int device)
             if((!strcmp(it->useCase, SND_USE_CASE_VERB_VOICECALL)) ||
                (!strcmp(it->useCase, SND_USE_CASE_MOD_PLAY_VOICE))) {
                 LOGV("Disabling voice call");
-                mALSADevice->close(&(*it));
-                mALSADevice->route(&(*it), (uint32_t)device, newMode);
+                {
+                    Mutex::Autolock handleLock(it->lock);
+                    Mutex::Autolock routingLock(mRoutingLock);
+                    mALSADevice->close(&(*it));
+                    mALSADevice->route(&(*it), (uint32_t)device, newMode);
+                }
                 mDeviceList.erase(it);
                 break;
             }
@@ -459,18 +633,54 @@ void AudioHardwareALSA::doRouting(int device)
                        strlen(SND_USE_CASE_VERB_HIFI))) ||
                      (!strncmp(it->useCase, SND_USE_CASE_MOD_PLAY_MUSIC,
                        strlen(SND_USE_CASE_MOD_PLAY_MUSIC)))) {
-                     mALSADevice->route(&(*it), (uint32_t)device, newMode);
+                     routeHandle(&(*it), (uint32_t)device, newMode);
                      break;
                   }
              }
      } else {
         ALSAHandleList::iterator it = mDeviceList.end();
         it--;
-        mALSADevice->route(&(*it), (uint32_t)device, newMode);
+        routeHandle(&(*it), (uint32_t)device, newMode);
     }
     mCurDevice = device;
 }
 
+//
+// A new handle with the buffering of a use case profile, the caller then
+// adjusts it to the client and picks the UCM use case.
+//
+void AudioHardwareALSA::initHandle(alsa_handle_t *handle, int profile, uint32_t devices)
+{
+    const alsa_profile_t *config = mProfiles.get(profile);
+
+    handle->module = mALSADevice;
+    handle->bufferSize = config->periodBytes;
+    handle->devices = devices;
+    handle->handle = 0;
+    handle->format = SNDRV_PCM_FORMAT_S16_LE;
+    handle->channels = config->channels;
+    handle->sampleRate = config->sampleRate;
+    handle->latency = config->latency;
+    handle->rxHandle = 0;
+    handle->ucMgr = mUcMgr;
+    handle->profile = profile;
+    handle->config = config;
+    handle->state = ALSA_STATE_CLOSED;
+    handle->canPause = false;
+}
+
+//
+// Reroute a handle a stream may be using, waiting for its current read or
+// write to complete. Caller holds mLock.
+//
+void AudioHardwareALSA::routeHandle(alsa_handle_t *handle, uint32_t device, int mode)
+{
+    Mutex::Autolock handleLock(handle->lock);
+    Mutex::Autolock routingLock(mRoutingLock);
+
+    mALSADevice->route(handle, device, mode);
+}
+
 AudioStreamOut *
 AudioHardwareALSA::openOutputStream(uint32_t devices,
                                     int *format,
@@ -508,29 +718,19 @@ AudioHardwareALSA::openOutputStream(uint32_t devices,
          mVoipStreamCount = 0;
          mVoipMicMute = false;
          alsa_handle_t alsa_handle;
-         unsigned long bufferSize;
-         if(*sampleRate == VOIP_SAMPLING_RATE_8K) {
-             bufferSize = VOIP_BUFFER_SIZE_8K;
-         }
-         else if(*sampleRate == VOIP_SAMPLING_RATE_16K) {
-             bufferSize = VOIP_BUFFER_SIZE_16K;
-         }
-         else {
+         if((*sampleRate != VOIP_SAMPLING_RATE_8K) &&
+            (*sampleRate != VOIP_SAMPLING_RATE_16K)) {
              LOGE("unsupported samplerate %d for voip",*sampleRate);
              if (status) *status = err;
                  return out;
           }
-          alsa_handle.module = mALSADevice;
-          alsa_handle.bufferSize = bufferSize;
-          alsa_handle.devices = devices;
-          alsa_handle.handle = 0;
-          alsa_handle.format = SNDRV_PCM_FORMAT_S16_LE;
-          alsa_handle.channels = VOIP_DEFAULT_CHANNEL_MODE;
+          initHandle(&alsa_handle, ALSA_PROFILE_VOIP, devices);
+          // Same period duration at the client's rate
+          alsa_handle.bufferSize = (uint64_t)alsa_handle.bufferSize * *sampleRate /
+                                   alsa_handle.sampleRate;
           alsa_handle.sampleRate = *sampleRate;
-          alsa_handle.latency = VOIP_PLAYBACK_LATENCY;
-          alsa_handle.rxHandle = 0;
-          alsa_handle.ucMgr = mUcMgr;
           char *use_case;
+          Mutex::Autolock routingLock(mRoutingLock);
           snd_use_case_get(mUcMgr, "_verb", (const char **)&use_case);
           if ((use_case == NULL) || (!strcmp(use_case, SND_USE_CASE_VERB_INACTIVE))) {
               strlcpy(alsa_handle.useCase, SND_USE_CASE_VERB_IP_VOICECALL, sizeof(alsa_handle.useCase));
@@ -564,25 +764,51 @@ AudioHardwareALSA::openOutputStream(uint32_t devices,
       return out;
     } else
     {
+      if (mMixer && mixerServes(mMixer->handle(), devices, format, channels, sampleRate)) {
+          // Further outputs share the PCM of the first one
+          out = new AudioStreamOutALSA(this, mMixer->handle());
+          err = out->set(format, channels, sampleRate, devices);
+          if (err == NO_ERROR) {
+              err = out->attachMixer(mMixer);
+          }
+          if (status) *status = err;
+          return out;
+      }
 
       alsa_handle_t alsa_handle;
-      unsigned long bufferSize = DEFAULT_BUFFER_SIZE;
-
-      for (size_t b = 1; (bufferSize & ~b) != 0; b <<= 1)
-          bufferSize &= ~b;
-
-      alsa_handle.module = mALSADevice;
-      alsa_handle.bufferSize = bufferSize;
-      alsa_handle.devices = devices;
-      alsa_handle.handle = 0;
-      alsa_handle.format = SNDRV_PCM_FORMAT_S16_LE;
-      alsa_handle.channels = DEFAULT_CHANNEL_MODE;
-      alsa_handle.sampleRate = DEFAULT_SAMPLING_RATE;
-      alsa_handle.latency = PLAYBACK_LATENCY;
-      alsa_handle.rxHandle = 0;
-      alsa_handle.ucMgr = mUcMgr;
+
+      initHandle(&alsa_handle, mOutputProfile, devices);
+
+      // Play high resolution clients at their own precision unless the
+      // PCM format is forced, a format the codec rejects falls back to
+      // 16 bit in setHardwareParams(). Those never go through the mixer,
+      // see mixerServes().
+      if (mOutputFormat != ALSA_FORMAT_FOLLOW_CLIENT) {
+          alsa_handle.format = (snd_pcm_format_t)mOutputFormat;
+      } else if (format) {
+          if (*format == AUDIO_FORMAT_PCM_8_24_BIT) {
+              alsa_handle.format = SNDRV_PCM_FORMAT_S24_LE;
+          } else if ((*format == AUDIO_FORMAT_PCM_32_BIT) ||
+                     (*format == ALSA_FORMAT_PCM_FLOAT)) {
+              alsa_handle.format = SNDRV_PCM_FORMAT_S32_LE;
+          }
+      }
+
+      // Discrete surround on HDMI, the stream mixes down whatever the
+      // sink cannot take
+      if ((devices & AudioSystem::DEVICE_OUT_AUX_DIGITAL) && channels &&
+          (AudioSystem::popCount(*channels) > 2) && (mHdmiMaxChannels >= 6)) {
+          alsa_handle.channels = ((AudioSystem::popCount(*channels) > 6) &&
+                                  (mHdmiMaxChannels >= 8)) ? 8 : 6;
+      }
+
+      // The profile's period is 16 bit at its own channel count, keep the
+      // period duration
+      alsa_handle.bufferSize = alsa_handle.bufferSize / (2 * alsa_handle.config->channels) *
+                               pcm_format_bytes(alsa_handle.format) * alsa_handle.channels;
 
       char *use_case;
+      mRoutingLock.lock();
       snd_use_case_get(mUcMgr, "_verb", (const char **)&use_case);
       if ((use_case == NULL) || (!strcmp(use_case, SND_USE_CASE_VERB_INACTIVE))) {
           strlcpy(alsa_handle.useCase, SND_USE_CASE_VERB_HIFI, sizeof(alsa_handle.useCase));
@@ -601,10 +827,39 @@ AudioHardwareALSA::openOutputStream(uint32_t devices,
           snd_use_case_set(mUcMgr, "_enamod", SND_USE_CASE_MOD_PLAY_MUSIC);
       }
       err = mALSADevice->open(&(*it));
+      mRoutingLock.unlock();
       if (err) {
           LOGE("Device open failed");
       } else {
           out = new AudioStreamOutALSA(this, &(*it));
+          if (mSoftwareMixer && !mMixer &&
+              mixerServes(&(*it), devices, format, channels, sampleRate)) {
+              // The stream just opened becomes the mixer's sink, fed 16 bit
+              // at the PCM rate, and the caller gets the mixer's first
+              // track instead
+              int sinkFormat = AudioSystem::PCM_16_BIT;
+              uint32_t sinkRate = it->sampleRate;
+              ALSAStreamMixer *mixer = NULL;
+
+              if (out->set(&sinkFormat, NULL, &sinkRate, devices) == NO_ERROR) {
+                  mixer = new ALSAStreamMixer(out, &(*it));
+                  if (mixer->initCheck() != NO_ERROR) {
+                      LOGE("Software mixer failed to start, using the PCM directly");
+                      delete mixer;
+                      mixer = NULL;
+                  }
+              }
+              if (mixer) {
+                  mMixer = mixer;
+                  out = new AudioStreamOutALSA(this, &(*it));
+                  err = out->set(format, channels, sampleRate, devices);
+                  if (err == NO_ERROR) {
+                      err = out->attachMixer(mMixer);
+                  }
+                  if (status) *status = err;
+                  return out;
+              }
+          }
           err = out->set(format, channels, sampleRate, devices);
       }
 
@@ -616,7 +871,123 @@ AudioHardwareALSA::openOutputStream(uint32_t devices,
 void
 AudioHardwareALSA::closeOutputStream(AudioStreamOut* out)
 {
+    ALSAStreamMixer *mixer = NULL;
+
     delete out;
+
+    // Decided under mLock, where openOutputStream() attaches tracks. The
+    // mixer closes its sink as it goes, which takes mLock itself.
+    mLock.lock();
+    if (mMixer && !mMixer->trackCount()) {
+        LOGD("closeOutputStream: last mixer track closed");
+        mixer = mMixer;
+        mMixer = NULL;
+    }
+    mLock.unlock();
+
+    delete mixer;
+}
+
+//
+// Queue the full close of an output whose PCM standby() only stopped.
+// The standby thread is started on first use, the caller closes the
+// output itself if that fails.
+//
+status_t AudioHardwareALSA::scheduleStandby(AudioStreamOutALSA *out)
+{
+    Mutex::Autolock autoLock(mStandbyLock);
+    nsecs_t deadline = systemTime() + milliseconds(mStandbyDelayMs);
+
+    for (List<PendingStandby>::iterator it = mStandbyList.begin();
+         it != mStandbyList.end(); ++it) {
+        if (it->out == out) {
+            it->deadline = deadline;
+            return NO_ERROR;
+        }
+    }
+
+    if (!mStandbyThreadRunning) {
+        if (pthread_create(&mStandbyThread, NULL, standbyThreadWrapper, this)) {
+            LOGE("scheduleStandby: failed to create standby thread");
+            return NO_INIT;
+        }
+        mStandbyThreadRunning = true;
+    }
+
+    PendingStandby pending;
+    pending.out = out;
+    pending.deadline = deadline;
+    mStandbyList.push_back(pending);
+    mStandbyCond.signal();
+    return NO_ERROR;
+}
+
+//
+// Called before the output touches its PCM again. Once this returns the
+// standby thread is not closing the stream and will not.
+//
+void AudioHardwareALSA::cancelStandby(AudioStreamOutALSA *out)
+{
+    Mutex::Autolock autoLock(mStandbyLock);
+
+    for (List<PendingStandby>::iterator it = mStandbyList.begin();
+         it != mStandbyList.end(); ++it) {
+        if (it->out == out) {
+            mStandbyList.erase(it);
+            return;
+        }
+    }
+}
+
+// Several routes can play at once, e.g. speaker and headset for a ringtone,
+// the slowest one is what the listener hears last
+uint32_t AudioHardwareALSA::routeLatency(uint32_t devices) const
+{
+    uint32_t latency = 0;
+
+    for (int i = 0; i < ALSA_ROUTE_LATENCY_COUNT; i++) {
+        if ((devices & routeLatencyTable[i].devices) && (mRouteLatency[i] > latency))
+            latency = mRouteLatency[i];
+    }
+    return latency;
+}
+
+void *AudioHardwareALSA::standbyThreadWrapper(void *me)
+{
+    static_cast<AudioHardwareALSA *>(me)->standbyThreadLoop();
+    return NULL;
+}
+
+// Outputs are closed with mStandbyLock held, so cancelStandby() waits for
+// a close in progress.
+void AudioHardwareALSA::standbyThreadLoop()
+{
+    Mutex::Autolock autoLock(mStandbyLock);
+
+    while (!mStandbyExit) {
+        nsecs_t now = systemTime();
+        nsecs_t next = 0;
+        List<PendingStandby>::iterator it = mStandbyList.begin();
+
+        while (it != mStandbyList.end()) {
+            if (it->deadline <= now) {
+                AudioStreamOutALSA *out = it->out;
+                it = mStandbyList.erase(it);
+                out->closeStandby();
+            } else {
+                if (!next || it->deadline < next) {
+                    next = it->deadline;
+                }
+                ++it;
+            }
+        }
+
+        if (next) {
+            mStandbyCond.waitRelative(mStandbyLock, next - now);
+        } else {
+            mStandbyCond.wait(mStandbyLock);
+        }
+    }
 }
 
 AudioStreamOut *
@@ -631,23 +1002,11 @@ AudioHardwareALSA::openOutputSession(uint32_t devices,
     status_t err = BAD_VALUE;
 
     alsa_handle_t alsa_handle;
-    unsigned long bufferSize = DEFAULT_BUFFER_SIZE;
-
-    for (size_t b = 1; (bufferSize & ~b) != 0; b <<= 1)
-        bufferSize &= ~b;
-
-    alsa_handle.module = mALSADevice;
-    alsa_handle.bufferSize = bufferSize;
-    alsa_handle.devices = devices;
-    alsa_handle.handle = 0;
-    alsa_handle.format = SNDRV_PCM_FORMAT_S16_LE;
-    alsa_handle.channels = DEFAULT_CHANNEL_MODE;
-    alsa_handle.sampleRate = DEFAULT_SAMPLING_RATE;
-    alsa_handle.latency = VOICE_LATENCY;
-    alsa_handle.rxHandle = 0;
-    alsa_handle.ucMgr = mUcMgr;
+
+    initHandle(&alsa_handle, ALSA_PROFILE_LPA, devices);
 
     char *use_case;
+    mRoutingLock.lock();
     snd_use_case_get(mUcMgr, "_verb", (const char **)&use_case);
     if ((use_case == NULL) || (!strcmp(use_case, SND_USE_CASE_VERB_INACTIVE))) {
         strlcpy(alsa_handle.useCase, SND_USE_CASE_VERB_HIFI_LOW_POWER, sizeof(alsa_handle.useCase));
@@ -666,6 +1025,7 @@ AudioHardwareALSA::openOutputSession(uint32_t devices,
         snd_use_case_set(mUcMgr, "_enamod", SND_USE_CASE_MOD_PLAY_LPA);
     }
     err = mALSADevice->open(&(*it));
+    mRoutingLock.unlock();
     out = new AudioStreamOutALSA(this, &(*it));
 
     if (status) *status = err;
@@ -686,7 +1046,6 @@ AudioHardwareALSA::openInputStream(uint32_t devices,
                                    status_t *status,
                                    AudioSystem::audio_in_acoustics acoustics)
 {
-    Mutex::Autolock autoLock(mLock);
     char *use_case;
     int newMode = mode();
     uint32_t route_devices;
@@ -695,6 +1054,16 @@ AudioHardwareALSA::openInputStream(uint32_t devices,
     AudioStreamInALSA *in = 0;
     ALSAHandleList::iterator it;
 
+    // The background capture gives way to an input it can't serve. Its
+    // source takes mLock as it closes.
+    Mutex::Autolock prerollLock(mPrerollLock);
+    if (mPreroll && !mSplitter->clientCount() &&
+        !prerollServes(devices, sampleRate ? *sampleRate : 0)) {
+        stopPreroll();
+    }
+
+    Mutex::Autolock autoLock(mLock);
+
     LOGD("openInputStream: devices 0x%x channels %d sampleRate %d", devices, *channels, *sampleRate);
     if (devices & (devices - 1)) {
         if (status) *status = err;
@@ -716,28 +1085,18 @@ AudioHardwareALSA::openInputStream(uint32_t devices,
            mVoipStreamCount = 0;
            mVoipMicMute = false;
            alsa_handle_t alsa_handle;
-           unsigned long bufferSize;
-           if(*sampleRate == VOIP_SAMPLING_RATE_8K) {
-               bufferSize = VOIP_BUFFER_SIZE_8K;
-           }
-           else if(*sampleRate == VOIP_SAMPLING_RATE_16K) {
-               bufferSize = VOIP_BUFFER_SIZE_16K;
-           }
-           else {
+           if((*sampleRate != VOIP_SAMPLING_RATE_8K) &&
+              (*sampleRate != VOIP_SAMPLING_RATE_16K)) {
                LOGE("unsupported samplerate %d for voip",*sampleRate);
                if (status) *status = err;
                return in;
            }
-           alsa_handle.module = mALSADevice;
-           alsa_handle.bufferSize = bufferSize;
-           alsa_handle.devices = devices;
-           alsa_handle.handle = 0;
-           alsa_handle.format = SNDRV_PCM_FORMAT_S16_LE;
-           alsa_handle.channels = VOIP_DEFAULT_CHANNEL_MODE;
+           initHandle(&alsa_handle, ALSA_PROFILE_VOIP, devices);
+           // Same period duration at the client's rate
+           alsa_handle.bufferSize = (uint64_t)alsa_handle.bufferSize * *sampleRate /
+                                    alsa_handle.sampleRate;
            alsa_handle.sampleRate = *sampleRate;
-           alsa_handle.latency = VOIP_RECORD_LATENCY;
-           alsa_handle.rxHandle = 0;
-           alsa_handle.ucMgr = mUcMgr;
+           Mutex::Autolock routingLock(mRoutingLock);
            snd_use_case_get(mUcMgr, "_verb", (const char **)&use_case);
            if ((use_case != NULL) && (strcmp(use_case, SND_USE_CASE_VERB_INACTIVE))) {
                 strcpy(alsa_handle.useCase, SND_USE_CASE_MOD_PLAY_VOIP);
@@ -776,6 +1135,20 @@ AudioHardwareALSA::openInputStream(uint32_t devices,
         return in;
       } else
       {
+        if (mSplitter && (mSplitter->handle()->devices == devices) &&
+            (mSplitter->clientCount() < ALSA_SPLITTER_MAX_CLIENTS) &&
+            !multiMicChannels(devices) &&
+            (!mPreroll || prerollServes(devices, sampleRate ? *sampleRate : 0))) {
+            // Further inputs from the same device read the shared capture
+            in = new AudioStreamInALSA(this, mSplitter->handle(), acoustics);
+            err = in->attachSplitter(mSplitter);
+            if (err == NO_ERROR) {
+                err = in->set(format, channels, sampleRate, devices);
+            }
+            if (status) *status = err;
+            return in;
+        }
+
         for(ALSAHandleList::iterator itDev = mDeviceList.begin();
               itDev != mDeviceList.end(); ++itDev)
         {
@@ -802,18 +1175,9 @@ AudioHardwareALSA::openInputStream(uint32_t devices,
         }
 
         alsa_handle_t alsa_handle;
-        unsigned long bufferSize = DEFAULT_IN_BUFFER_SIZE;
-
-        alsa_handle.module = mALSADevice;
-        alsa_handle.bufferSize = bufferSize;
-        alsa_handle.devices = devices;
-        alsa_handle.handle = 0;
-        alsa_handle.format = SNDRV_PCM_FORMAT_S16_LE;
-        alsa_handle.channels = VOICE_CHANNEL_MODE;
-        alsa_handle.sampleRate = android::AudioRecord::DEFAULT_SAMPLE_RATE;
-        alsa_handle.latency = RECORD_LATENCY;
-        alsa_handle.rxHandle = 0;
-        alsa_handle.ucMgr = mUcMgr;
+
+        initHandle(&alsa_handle, ALSA_PROFILE_RECORD, devices);
+        mRoutingLock.lock();
         snd_use_case_get(mUcMgr, "_verb", (const char **)&use_case);
         if ((use_case != NULL) && (strcmp(use_case, SND_USE_CASE_VERB_INACTIVE))) {
             if ((devices == AudioSystem::DEVICE_IN_VOICE_CALL) &&
@@ -875,7 +1239,15 @@ AudioHardwareALSA::openInputStream(uint32_t devices,
             snd_use_case_set(mUcMgr, "_enamod", it->useCase);
         }
         if(sampleRate) {
-            it->sampleRate = *sampleRate;
+            // Capture at the native rate and convert if the resampler
+            // is enabled for this rate
+            if ((mResamplerQuality != ALSA_RESAMPLER_OFF) &&
+                (*sampleRate != DEFAULT_SAMPLING_RATE) &&
+                ALSAResampler::isSupported(DEFAULT_SAMPLING_RATE, *sampleRate)) {
+                it->sampleRate = DEFAULT_SAMPLING_RATE;
+            } else {
+                it->sampleRate = *sampleRate;
+            }
         }
         if(channels) {
             it->channels = AudioSystem::popCount((*channels) &
@@ -883,11 +1255,55 @@ AudioHardwareALSA::openInputStream(uint32_t devices,
                        AudioSystem::CHANNEL_IN_MONO));
             LOGD("channels %d", it->channels);
         }
+        uint32_t mics = multiMicChannels(devices);
+        bool fanout = !mics && mCaptureFanout && sharedCapture(it->useCase);
+        if (mics) {
+            // Every mic, each client picks its channels in set(). The
+            // period keeps its duration.
+            it->bufferSize = it->bufferSize / it->config->channels * mics;
+            it->channels = mics;
+            LOGD("openInputStream: capturing %d mics", mics);
+        } else if (fanout) {
+            // Capture stereo so later clients can have either layout
+            it->channels = 2;
+        }
         err = mALSADevice->open(&(*it));
+        mRoutingLock.unlock();
         if (err) {
            LOGE("Error opening pcm input device");
         } else {
            in = new AudioStreamInALSA(this, &(*it), acoustics);
+           if (mics) {
+               in->setMultiMic();
+           }
+           if (fanout) {
+               // The stream just opened becomes the splitter's source, read
+               // 16 bit at the PCM rate and layout, and the caller gets the
+               // splitter's first client instead
+               int sourceFormat = AudioSystem::PCM_16_BIT;
+               uint32_t sourceChannels = 0;
+               uint32_t sourceRate = it->sampleRate;
+               ALSAStreamSplitter *splitter = NULL;
+
+               if (in->set(&sourceFormat, &sourceChannels, &sourceRate, devices) == NO_ERROR) {
+                   splitter = new ALSAStreamSplitter(in, &(*it));
+                   if (splitter->initCheck() != NO_ERROR) {
+                       LOGE("Capture splitter failed to start, using the PCM directly");
+                       delete splitter;
+                       splitter = NULL;
+                   }
+               }
+               if (splitter) {
+                   mSplitter = splitter;
+                   in = new AudioStreamInALSA(this, &(*it), acoustics);
+                   err = in->attachSplitter(mSplitter);
+                   if (err == NO_ERROR) {
+                       err = in->set(format, channels, sampleRate, devices);
+                   }
+                   if (status) *status = err;
+                   return in;
+               }
+           }
            err = in->set(format, channels, sampleRate, devices);
         }
         if (status) *status = err;
@@ -898,7 +1314,167 @@ AudioHardwareALSA::openInputStream(uint32_t devices,
 void
 AudioHardwareALSA::closeInputStream(AudioStreamIn* in)
 {
+    Mutex::Autolock prerollLock(mPrerollLock);
+
     delete in;
+
+    if (mSplitter && !mSplitter->clientCount() && !mPreroll) {
+        LOGD("closeInputStream: last splitter client closed");
+        delete mSplitter;
+        mSplitter = NULL;
+    }
+
+    // Back to the background capture once nothing else records
+    if (!mSplitter) {
+        startPreroll();
+    }
+}
+
+//
+// Capture mPrerollMs of the built-in mic into a splitter ring which keeps
+// running with no client, so an input opened later can start reading
+// from before it was opened, see PREROLL_KEY. Only while the phone is
+// idle, with no call or FM up, and nothing else captures. Called with
+// mPrerollLock held and without mLock, a stream that failed to open
+// closes itself under it.
+//
+void AudioHardwareALSA::startPreroll()
+{
+    alsa_handle_t alsa_handle;
+    ALSAHandleList::iterator it;
+    AudioStreamInALSA *source;
+    ALSAStreamSplitter *splitter;
+    int sourceFormat = AudioSystem::PCM_16_BIT;
+    uint32_t sourceChannels = 0;
+    uint32_t sourceRate;
+    char *use_case;
+    status_t err;
+
+    if (!mPrerollMs || mSplitter || !mALSADevice)
+        return;
+
+    mLock.lock();
+    if ((mode() != AudioSystem::MODE_NORMAL) || mIsVoiceCallActive || mIsFmActive) {
+        mLock.unlock();
+        return;
+    }
+    for (it = mDeviceList.begin(); it != mDeviceList.end(); ++it) {
+        if (it->devices & AudioSystem::DEVICE_IN_ALL) {
+            mLock.unlock();
+            return;
+        }
+    }
+
+    initHandle(&alsa_handle, ALSA_PROFILE_PREROLL, AudioSystem::DEVICE_IN_BUILTIN_MIC);
+    mRoutingLock.lock();
+    snd_use_case_get(mUcMgr, "_verb", (const char **)&use_case);
+    if ((use_case != NULL) && (strcmp(use_case, SND_USE_CASE_VERB_INACTIVE))) {
+        strlcpy(alsa_handle.useCase, SND_USE_CASE_MOD_CAPTURE_MUSIC, sizeof(alsa_handle.useCase));
+    } else {
+        strlcpy(alsa_handle.useCase, SND_USE_CASE_VERB_HIFI_REC, sizeof(alsa_handle.useCase));
+    }
+    free(use_case);
+    mDeviceList.push_back(alsa_handle);
+    it = mDeviceList.end();
+    it--;
+    mALSADevice->route(&(*it), it->devices, mode());
+    if (!strcmp(it->useCase, SND_USE_CASE_VERB_HIFI_REC)) {
+        snd_use_case_set(mUcMgr, "_verb", it->useCase);
+    } else {
+        snd_use_case_set(mUcMgr, "_enamod", it->useCase);
+    }
+    err = mALSADevice->open(&(*it));
+    mRoutingLock.unlock();
+    mLock.unlock();
+
+    source = new AudioStreamInALSA(this, &(*it), (AudioSystem::audio_in_acoustics)0);
+    sourceRate = it->sampleRate;
+    if (err || (source->set(&sourceFormat, &sourceChannels, &sourceRate, it->devices) != NO_ERROR)) {
+        LOGE("startPreroll: failed to open the background capture");
+        delete source;
+        return;
+    }
+
+    splitter = new ALSAStreamSplitter(source, &(*it), mPrerollMs * it->sampleRate / 1000);
+    if (splitter->initCheck() != NO_ERROR) {
+        delete splitter;
+        delete source;
+        return;
+    }
+    splitter->setAlwaysOn(true);
+    mSplitter = splitter;
+    mPreroll = true;
+    LOGD("startPreroll: %u ms at %u Hz", mPrerollMs, it->sampleRate);
+}
+
+// Called with mPrerollLock held and without mLock
+void AudioHardwareALSA::stopPreroll()
+{
+    if (!mPreroll)
+        return;
+
+    LOGD("stopPreroll");
+    delete mSplitter;
+    mSplitter = NULL;
+    mPreroll = false;
+}
+
+// Inputs the background capture can feed, it is only ever resampled down
+bool AudioHardwareALSA::prerollServes(uint32_t devices, uint32_t rate)
+{
+    alsa_handle_t *handle = mSplitter->handle();
+
+    if ((devices != handle->devices) || multiMicChannels(devices))
+        return false;
+    if (!rate || (rate == handle->sampleRate))
+        return true;
+    return (rate < handle->sampleRate) && (mResamplerQuality != ALSA_RESAMPLER_OFF) &&
+           ALSAResampler::isSupported(handle->sampleRate, rate);
+}
+
+//
+// Outputs the software mixer can take on: the sink's device, 16 bit, at
+// most stereo and at the sink rate. The mix is 16 bit stereo, anything
+// else gets a PCM of its own.
+//
+bool AudioHardwareALSA::mixerServes(const alsa_handle_t *sink, uint32_t devices,
+                                    const int *format, const uint32_t *channels,
+                                    const uint32_t *rate)
+{
+    if ((devices != sink->devices) || (sink->format != SNDRV_PCM_FORMAT_S16_LE) ||
+        (sink->channels != 2))
+        return false;
+    if (format && *format && (*format != AudioSystem::PCM_16_BIT))
+        return false;
+    if (channels && *channels && (AudioSystem::popCount(*channels) > 2))
+        return false;
+    return !rate || !*rate || (*rate == sink->sampleRate);
+}
+
+// Captures that any number of plain recording clients can share
+bool AudioHardwareALSA::sharedCapture(const char *useCase)
+{
+    return !strcmp(useCase, SND_USE_CASE_VERB_HIFI_REC) ||
+           !strcmp(useCase, SND_USE_CASE_MOD_CAPTURE_MUSIC) ||
+           !strcmp(useCase, SND_USE_CASE_VERB_FM_REC) ||
+           !strcmp(useCase, SND_USE_CASE_MOD_CAPTURE_FM);
+}
+
+//
+// Mics a recording from devices opens with audio.capture.multimic set, 0
+// for a regular capture. The dual and quad mic Fluence setups route every
+// mic of the built-in array to the capture, see FLUENCE_KEY.
+//
+uint32_t AudioHardwareALSA::multiMicChannels(uint32_t devices) const
+{
+    if (!mMultiMic || ((devices != AudioSystem::DEVICE_IN_BUILTIN_MIC) &&
+                       (devices != AudioSystem::DEVICE_IN_BACK_MIC)))
+        return 0;
+    if (mDevSettingsFlag & QMIC_FLAG)
+        return 4;
+    if (mDevSettingsFlag & DMIC_FLAG)
+        return 2;
+    return 0;
 }
 
 status_t AudioHardwareALSA::setMicMute(bool state)
@@ -938,34 +1514,45 @@ status_t AudioHardwareALSA::getMicMute(bool *state)
 
 status_t AudioHardwareALSA::dump(int fd, const Vector<String16>& args)
 {
+    mProfiles.dump(fd);
     return NO_ERROR;
 }
 
 size_t AudioHardwareALSA::getInputBufferSize(uint32_t sampleRate, int format, int channelCount)
 {
     size_t bufferSize;
-    if (format != AudioSystem::PCM_16_BIT) {
+    size_t sampleBytes;
+    // Capture runs at 16 bit, wider client formats are converted
+    if (format == AudioSystem::PCM_16_BIT) {
+        sampleBytes = 2;
+    } else if ((format == AUDIO_FORMAT_PCM_8_24_BIT) ||
+               (format == AUDIO_FORMAT_PCM_32_BIT) ||
+               (format == ALSA_FORMAT_PCM_FLOAT)) {
+        sampleBytes = 4;
+    } else {
          LOGW("getInputBufferSize bad format: %d", format);
          return 0;
     }
+    size_t periodBytes = mProfiles.get(ALSA_PROFILE_RECORD)->periodBytes;
     if(sampleRate == 16000) {
-        bufferSize = DEFAULT_IN_BUFFER_SIZE * 2 * channelCount;
+        bufferSize = periodBytes * 2 * channelCount;
     } else if(sampleRate < 44100) {
-        bufferSize = DEFAULT_IN_BUFFER_SIZE * channelCount;
+        bufferSize = periodBytes * channelCount;
     } else {
-        bufferSize = DEFAULT_IN_BUFFER_SIZE * 12;
+        bufferSize = periodBytes * 12;
     }
-    return bufferSize;
+    return bufferSize / 2 * sampleBytes;
 }
 
 void AudioHardwareALSA::handleFm(int device)
 {
+    Mutex::Autolock autoLock(mLock);
 int newMode = mode();
     if(device & AudioSystem::DEVICE_OUT_FM && mIsFmActive == 0) {
         // Start FM Radio on current active device
-        unsigned long bufferSize = FM_BUFFER_SIZE;
         alsa_handle_t alsa_handle;
         char *use_case;
+        Mutex::Autolock routingLock(mRoutingLock);
         LOGV("Start FM");
         snd_use_case_get(mUcMgr, "_verb", (const char **)&use_case);
         if ((use_case == NULL) || (!strcmp(use_case, SND_USE_CASE_VERB_INACTIVE))) {
@@ -975,18 +1562,7 @@ int newMode = mode();
         }
         free(use_case);
 
-        for (size_t b = 1; (bufferSize & ~b) != 0; b <<= 1)
-        bufferSize &= ~b;
-        alsa_handle.module = mALSADevice;
-        alsa_handle.bufferSize = bufferSize;
-        alsa_handle.devices = device;
-        alsa_handle.handle = 0;
-        alsa_handle.format = SNDRV_PCM_FORMAT_S16_LE;
-        alsa_handle.channels = DEFAULT_CHANNEL_MODE;
-        alsa_handle.sampleRate = DEFAULT_SAMPLING_RATE;
-        alsa_handle.latency = VOICE_LATENCY;
-        alsa_handle.rxHandle = 0;
-        alsa_handle.ucMgr = mUcMgr;
+        initHandle(&alsa_handle, ALSA_PROFILE_FM, device);
         mIsFmActive = 1;
         mDeviceList.push_back(alsa_handle);
         ALSAHandleList::iterator it = mDeviceList.end();
@@ -1005,8 +1581,12 @@ int newMode = mode();
             it != mDeviceList.end(); ++it) {
             if((!strcmp(it->useCase, SND_USE_CASE_VERB_DIGITAL_RADIO)) ||
               (!strcmp(it->useCase, SND_USE_CASE_MOD_PLAY_FM))) {
-                mALSADevice->close(&(*it));
-                //mALSADevice->route(&(*it), (uint32_t)device, newMode);
+                {
+                    Mutex::Autolock handleLock(it->lock);
+                    Mutex::Autolock routingLock(mRoutingLock);
+                    mALSADevice->close(&(*it));
+                    //mALSADevice->route(&(*it), (uint32_t)device, newMode);
+                }
                 mDeviceList.erase(it);
                 break;
             }
@@ -27,6 +27,7 @@
 #include <system/audio.h>
 #include <hardware/audio.h>
 #include <utils/threads.h>
+#include <utils/Timers.h>
 
 extern "C" {
    #include <sound/asound.h>
@@ -40,6 +41,7 @@ namespace android_audio_legacy
 {
 using android::List;
 using android::Mutex;
+using android::Condition;
 class AudioHardwareALSA;
 
 /**
@@ -50,23 +52,17 @@ class AudioHardwareALSA;
 
 #define DEFAULT_SAMPLING_RATE 48000
 #define DEFAULT_CHANNEL_MODE  2
-#define VOICE_SAMPLING_RATE   8000
-#define VOICE_CHANNEL_MODE    1
-#define PLAYBACK_LATENCY      96000
-#define RECORD_LATENCY        96000
-#define VOICE_LATENCY         85333
-#define DEFAULT_BUFFER_SIZE   2048
-#define DEFAULT_IN_BUFFER_SIZE   320
-#define FM_BUFFER_SIZE        1024
+// Buffer sizes, rates and latencies of each use case, see ALSAProfileTable
+#define ALSA_PROFILE_CONFIG   "/system/etc/audio_profiles.conf"
+// Float client data, AUDIO_FORMAT_PCM_SUB_FLOAT in newer system/audio.h
+#define ALSA_FORMAT_PCM_FLOAT  0x5
+// audio.playback.format unset, the PCM takes the client's format
+#define ALSA_FORMAT_FOLLOW_CLIENT  -1
+#define ALSA_MAX_CHANNELS     8
 
 #define VOIP_SAMPLING_RATE_8K 8000
 #define VOIP_SAMPLING_RATE_16K 16000
-#define VOIP_DEFAULT_CHANNEL_MODE  1
-#define VOIP_BUFFER_SIZE_8K    320
-#define VOIP_BUFFER_SIZE_16K   640
-#define VOIP_BUFFER_MAX_SIZE   VOIP_BUFFER_SIZE_16K
-#define VOIP_PLAYBACK_LATENCY      6400
-#define VOIP_RECORD_LATENCY        6400
+#define VOIP_BUFFER_MAX_SIZE   640      // 20 ms at 16 kHz mono
 
 #define DUALMIC_KEY         "dualmic_enabled"
 #define FLUENCE_KEY         "fluence"
@@ -76,6 +72,12 @@ class AudioHardwareALSA;
 #define BTHEADSET_VGS       "bt_headset_vgs"
 #define WIDEVOICE_KEY "wide_voice_enable"
 #define FENS_KEY "fens_enable"
+#define PRESENTATION_POSITION_KEY "presentation_position"
+#define OUTPUT_PROFILE_KEY "output_profile"
+#define PREROLL_KEY "preroll_ms"
+#define MIC_CHANNELS_KEY "mic_channels"
+#define MIC_SELECT_KEY "mic_select"
+#define MIC_LAYOUT_KEY "mic_layout"
 
 #define ANC_FLAG        0x00000001
 #define DMIC_FLAG       0x00000002
@@ -94,6 +96,73 @@ struct alsa_device_t;
 static uint32_t FLUENCE_MODE_ENDFIRE   = 0;
 static uint32_t FLUENCE_MODE_BROADSIDE = 1;
 
+// Use case profiles, each PCM is opened with the buffering of one of them.
+// The first three are the HiFi output profiles picked by
+// audio.playback.profile.
+enum {
+    ALSA_PROFILE_DEFAULT = 0,   // HiFi playback
+    ALSA_PROFILE_FAST,          // small double-buffered periods, low latency
+    ALSA_PROFILE_DEEP_BUFFER,   // large periods, few wakeups for screen-off playback
+    ALSA_PROFILE_LPA,           // low power audio session
+    ALSA_PROFILE_VOICE_CALL,
+    ALSA_PROFILE_VOIP,          // VoIP playback and capture
+    ALSA_PROFILE_RECORD,
+    ALSA_PROFILE_FM,
+    ALSA_PROFILE_PREROLL,       // background capture kept for hotword clients
+    ALSA_PROFILE_COUNT
+};
+
+// Buffering of a use case profile. The period is in bytes of 16 bit
+// samples at the profile's rate and channels, and is the smallest one
+// setHardwareParams() asks for. A non-zero availMin replaces the module's
+// built-in sw_params, with both thresholds in percent of a period.
+struct alsa_profile_t {
+    uint32_t            sampleRate;
+    uint32_t            channels;
+    uint32_t            periodBytes;
+    uint32_t            periodCount;     // 0 leaves it to the driver
+    uint32_t            latency;         // usec, until the hw params are set
+    uint32_t            availMin;
+    uint32_t            startThreshold;  // 0 starts at availMin
+    bool                stopOnXrun;      // stop and recover instead of playing stale data
+    bool                mmap;            // map the DMA ring instead of read/write calls
+};
+
+// State of alsa_handle_t::handle, moved between the warm standby states by
+// alsa_device_t::setState()
+enum {
+    ALSA_STATE_CLOSED = 0,      // no PCM, the route may be down too
+    ALSA_STATE_PREPARED,        // configured and prepared, next write starts it
+    ALSA_STATE_RUNNING,         // DMA running
+    ALSA_STATE_PAUSED,          // DMA paused, queued frames kept
+};
+
+static inline const char *alsaStateName(int state)
+{
+    static const char *names[] = { "closed", "prepared", "running", "paused" };
+    return (state >= ALSA_STATE_CLOSED && state <= ALSA_STATE_PAUSED) ? names[state] : "unknown";
+}
+
+// Output routes with their own DSP pipeline delay, see
+// AudioHardwareALSA::routeLatency()
+enum {
+    ALSA_ROUTE_LATENCY_HANDSET = 0,
+    ALSA_ROUTE_LATENCY_SPEAKER,
+    ALSA_ROUTE_LATENCY_HEADSET,
+    ALSA_ROUTE_LATENCY_HDMI,
+    ALSA_ROUTE_LATENCY_BT,
+    ALSA_ROUTE_LATENCY_PROXY,
+    ALSA_ROUTE_LATENCY_COUNT
+};
+
+// A Mutex that copies as a new unlocked one, so alsa_handle_t can still be
+// copied into ALSAHandleList
+struct ALSAHandleLock : public Mutex {
+    ALSAHandleLock() : Mutex() {}
+    ALSAHandleLock(const ALSAHandleLock&) : Mutex() {}
+    ALSAHandleLock& operator=(const ALSAHandleLock&) { return *this; }
+};
+
 struct alsa_handle_t {
     alsa_device_t *     module;
     uint32_t            devices;
@@ -107,6 +176,11 @@ struct alsa_handle_t {
     unsigned int        periodSize;
     struct pcm *        rxHandle;
     snd_use_case_mgr_t  *ucMgr;
+    int                 profile;
+    const alsa_profile_t *config;        // buffering of profile
+    int                 state;
+    bool                canPause;        // front end has SNDRV_PCM_INFO_PAUSE
+    ALSAHandleLock      lock;            // guards the PCMs and state above
 };
 
 typedef List<alsa_handle_t> ALSAHandleList;
@@ -118,7 +192,11 @@ struct alsa_device_t {
     status_t (*open)(alsa_handle_t *);
     status_t (*close)(alsa_handle_t *);
     status_t (*standby)(alsa_handle_t *);
+    status_t (*setState)(alsa_handle_t *, int);
     status_t (*route)(alsa_handle_t *, uint32_t, int);
+    status_t (*mmapWrite)(alsa_handle_t *, const void *, size_t);
+    status_t (*mmapRead)(alsa_handle_t *, void *, size_t);
+    status_t (*getDelay)(struct pcm *, snd_pcm_sframes_t *, struct timespec *);
     status_t (*startVoiceCall)(alsa_handle_t *);
     status_t (*startVoipCall)(alsa_handle_t *);
     status_t (*startFm)(alsa_handle_t *);
@@ -136,6 +214,24 @@ struct alsa_device_t {
 
 // ----------------------------------------------------------------------------
 
+// The alsa_profile_t of every use case, built-in values overridden from a
+// per-device config file, see ALSAProfileTable.cpp
+class ALSAProfileTable
+{
+public:
+    ALSAProfileTable();
+
+    status_t                load(const char *path);
+    const alsa_profile_t *  get(int profile) const;
+    static const char *     name(int profile);
+    void                    dump(int fd) const;
+
+private:
+    alsa_profile_t          mProfiles[ALSA_PROFILE_COUNT];
+};
+
+// ----------------------------------------------------------------------------
+
 class ALSAMixer
 {
 public:
@@ -170,6 +266,199 @@ private:
     struct mixer*             mHandle;
 };
 
+// Single producer / single consumer byte FIFO. The producer only advances
+// mWritePos and the consumer only advances mReadPos, so neither side needs
+// a lock to move data.
+class ALSARingBuffer
+{
+public:
+    ALSARingBuffer(size_t size);
+    virtual                ~ALSARingBuffer();
+
+    bool                    initCheck() const { return mBuffer != NULL; }
+    size_t                  size() const { return mSize; }
+
+    size_t                  availableToRead() const;
+    size_t                  availableToWrite() const;
+
+    size_t                  write(const void *buffer, size_t bytes);
+    size_t                  read(void *buffer, size_t bytes);
+
+    // Only valid while neither side is running
+    void                    reset();
+
+private:
+    char *                  mBuffer;
+    size_t                  mSize;          // power of two
+    volatile int32_t        mReadPos;
+    volatile int32_t        mWritePos;
+};
+
+// ----------------------------------------------------------------------------
+
+// Sample processing kernels, see ALSAKernels.cpp. Counts are in samples.
+
+// Q15 gain of 1.0 for mix_s16(), anything at or above it is unity
+#define ALSA_GAIN_UNITY_Q15     0x8000
+
+void mix_s16(int16_t *dst, const int16_t *src, size_t count, uint32_t gain);
+void mix_s16_to_float(float *acc, const int16_t *src, size_t count, float gain);
+void float_to_s16(int16_t *dst, const float *src, size_t count);
+int32_t dot_s16(const int16_t *x, const int16_t *h, size_t count);
+
+// Bytes per sample, and conversion between any two of S8, S16_LE, S24_LE,
+// S24_3LE, S32_LE and FLOAT_LE
+size_t pcm_format_bytes(snd_pcm_format_t format);
+void convert_pcm(void *dst, snd_pcm_format_t dstFormat,
+                 const void *src, snd_pcm_format_t srcFormat, size_t count);
+
+// Channel reordering and Q14 matrix mixing of 16 bit frames, up to
+// ALSA_MAX_CHANNELS channels on either side. Counts are in frames.
+void remap_s16(int16_t *dst, uint32_t outChannels, const int16_t *src,
+               uint32_t inChannels, const int8_t *map, size_t frames);
+void remix_s16(int16_t *dst, uint32_t outChannels, const int16_t *src,
+               uint32_t inChannels, const int16_t *matrix, size_t frames);
+
+// Multi-mic capture, counts in frames. deinterleave_s16() gives each
+// channel its own plane of frames samples, back to back in dst.
+// downmix_s16() takes the mean of every channel of a frame.
+void deinterleave_s16(int16_t *dst, const int16_t *src, uint32_t channels, size_t frames);
+void downmix_s16(int16_t *dst, const int16_t *src, uint32_t channels, size_t frames);
+
+// Stream volume for 16 bit and float frames, dst may be src. Stereo takes
+// separate left and right gains, other layouts use left throughout. The
+// ramp variants scale frame n by gain + n * step.
+void volume_s16(int16_t *dst, const int16_t *src, size_t frames, uint32_t channels,
+                float left, float right);
+void volume_float(float *dst, const float *src, size_t frames, uint32_t channels,
+                  float left, float right);
+void volume_ramp_s16(int16_t *dst, const int16_t *src, size_t frames, uint32_t channels,
+                     float left, float right, float stepLeft, float stepRight);
+void volume_ramp_float(float *dst, const float *src, size_t frames, uint32_t channels,
+                       float left, float right, float stepLeft, float stepRight);
+
+// Capture pre-processing. energy_s16() returns the sum of squares of count
+// samples and their largest magnitude in *peak. highpass_s16() is a first
+// order DC blocker on frames in place, state keeps two floats per channel.
+uint64_t energy_s16(const int16_t *src, size_t count, int32_t *peak);
+void highpass_s16(int16_t *buf, size_t frames, uint32_t channels, float pole, float *state);
+
+// ----------------------------------------------------------------------------
+
+// Resampler quality presets, picked with the audio.resampler.quality property
+enum {
+    ALSA_RESAMPLER_OFF = 0,
+    ALSA_RESAMPLER_LOW,         // 8 taps per phase
+    ALSA_RESAMPLER_MEDIUM,      // 16 taps per phase
+    ALSA_RESAMPLER_HIGH,        // 32 taps per phase
+};
+
+#define ALSA_RESAMPLER_MAX_PHASES   160     // 44.1 kHz <-> 48 kHz
+
+// Rational polyphase FIR sample rate converter for interleaved 16 bit PCM
+class ALSAResampler
+{
+public:
+    ALSAResampler(uint32_t inRate, uint32_t outRate, uint32_t channels, int quality);
+    virtual                ~ALSAResampler();
+
+    static bool             isSupported(uint32_t inRate, uint32_t outRate);
+
+    status_t                initCheck() const { return mCoefs ? NO_ERROR : NO_INIT; }
+
+    // Convert up to *inFrames frames of in into at most outFrames frames of
+    // out. *inFrames is updated with the frames consumed, the return value
+    // is the number of frames produced.
+    size_t                  resample(const int16_t *in, size_t *inFrames,
+                                     int16_t *out, size_t outFrames);
+
+    // Input frames still needed to produce outFrames frames
+    size_t                  inputFramesFor(size_t outFrames) const;
+    // Upper bound of the frames produced from inFrames more input frames
+    size_t                  outputFramesFor(size_t inFrames) const;
+
+    void                    reset();
+
+private:
+    uint32_t                mChannels;
+    uint32_t                mL;             // interpolation factor
+    uint32_t                mM;             // decimation factor
+    size_t                  mTaps;          // per phase, multiple of 8
+    int16_t *               mCoefs;         // mL phases of mTaps, reversed, Q15
+
+    int16_t *               mBuffer;        // planar history, one row per channel
+    size_t                  mCapacity;      // frames per row
+    size_t                  mFrames;        // frames buffered
+    size_t                  mIndex;         // first frame of the next output
+    uint32_t                mPhase;
+};
+
+// ----------------------------------------------------------------------------
+
+// Built-in capture pre-processing stages. audio.capture.preproc lists the
+// ones always on, NS and AGC also stand in for the framework effects.
+enum {
+    ALSA_PREPROC_HPF = 0x1,     // DC and rumble high-pass
+    ALSA_PREPROC_NS  = 0x2,     // broadband noise suppression
+    ALSA_PREPROC_AGC = 0x4,     // automatic gain control
+};
+
+#define ALSA_PREPROC_MAX_EFFECTS    8
+
+// Effect chain of an input stream, run in place on 16 bit capture at the
+// client's rate and layout. Effects added to the stream run through their
+// own process(), except AGC and NS which the built-in stages replace when
+// native is set.
+class ALSAPreProcessor
+{
+public:
+    ALSAPreProcessor();
+    virtual                ~ALSAPreProcessor();
+
+    static uint32_t         parseStages(const char *list);
+
+    void                    setStages(uint32_t stages);
+    status_t                addEffect(effect_handle_t effect, bool native);
+    status_t                removeEffect(effect_handle_t effect);
+
+    void                    process(int16_t *buffer, size_t frames, uint32_t rate,
+                                    uint32_t channels);
+    void                    reset();
+    void                    dump(int fd);
+
+private:
+    struct Effect {
+        effect_handle_t     handle;         // NULL for a free slot
+        uint32_t            stage;          // built-in stage run instead
+        char                name[32];
+        nsecs_t             time;           // spent in process()
+        uint64_t            frames;
+    };
+
+    void                    configure(uint32_t rate, uint32_t channels);
+    float                   noiseGain(float power, size_t frames);
+    float                   agcGain(float power, int32_t peak, size_t frames);
+
+    Mutex                   mLock;
+    uint32_t                mStages;        // always on
+    Effect                  mEffects[ALSA_PREPROC_MAX_EFFECTS];
+
+    uint32_t                mRate;
+    uint32_t                mChannels;
+    float                   mPole;
+    float                   mHighpassState[2 * ALSA_MAX_CHANNELS];
+    float                   mNoise;         // floor, mean square of full scale
+    float                   mNoiseGain;
+    float                   mAgcGain;
+    float                   mGain;          // applied at the end of the last block
+
+    nsecs_t                 mHighpassTime;
+    nsecs_t                 mGainTime;      // level detection and NS/AGC gain
+    uint64_t                mFrames;
+};
+
+// ----------------------------------------------------------------------------
+
 class ALSAStreamOps
 {
 public:
@@ -185,18 +474,238 @@ public:
     size_t              bufferSize() const;
     int                 format() const;
     uint32_t            channels() const;
+    size_t              frameSize() const;
+    size_t              clientFrameSize() const;
 
     status_t            open(int mode);
     void                close();
 
 protected:
     friend class AudioHardwareALSA;
+    friend class ALSAStreamMixer;
+    friend class ALSAStreamSplitter;
+
+    status_t                resizeStaging(size_t size);
+    status_t                resizeResampleBuffer(size_t size);
+    status_t                resizeConvertBuffer(size_t size);
+    status_t                resizeRemixBuffer(size_t size);
+    status_t                resizeVolumeBuffer(size_t size);
+    status_t                resizePlanarBuffer(size_t size);
+    status_t                setupRemix(uint32_t mask);
+    status_t                setupMics(uint32_t count, const int8_t *select);
+    void                    foldCapture(uint32_t count);
+    status_t                pcmReopened();
+    void                    reopened();
+    void                    remixFrames(int16_t *dst, const int16_t *src, size_t frames);
+    status_t                recover(struct pcm *pcm, int err);
+    void                    reopen();
+    void                    dumpRecovery(int fd) const;
+    bool                    recoveryAllowed() const;
+    void                    recoveryFailed();
+    void                    recoverySucceeded();
+    void                    emulateTime(size_t bytes);
 
     AudioHardwareALSA *     mParent;
     alsa_handle_t *         mHandle;
     uint32_t                mDevices;
 
     bool                    mPowerLock;
+    bool                    mSharedHandle;  // mHandle belongs to the software mixer
+    bool                    mMultiMic;      // mHandle captures every mic, see setupMics()
+    bool                    mMicSelected;   // mMicSelect holds the client's mic choice
+    int8_t                  mMicSelect[ALSA_MAX_CHANNELS];
+    // PCM layout the conversions were set up for, see pcmReopened()
+    snd_pcm_format_t        mPcmFormat;
+    uint32_t                mPcmChannels;
+
+    // Partial period carried over between write()/read() calls
+    char *                  mStaging;
+    size_t                  mStagingSize;
+    size_t                  mStagingBytes;
+    size_t                  mStagingOffset;
+
+    // Optional conversion between the client and the PCM rate
+    ALSAResampler *         mResampler;
+    uint32_t                mClientRate;
+    int16_t *               mResampleBuffer;
+    size_t                  mResampleBufferSize;
+
+    // Sample format the client reads or writes, converted from/to the
+    // PCM's mHandle->format
+    snd_pcm_format_t        mClientFormat;
+    void *                  mConvertBuffer;
+    size_t                  mConvertBufferSize;
+
+    // Client channel layout, mixed or reordered to the PCM's when they
+    // differ, see setupRemix()
+    uint32_t                mClientChannels;
+    uint32_t                mClientChannelMask;
+    bool                    mRemix;
+    bool                    mRemixIsMap;
+    bool                    mRemixIsDownmix;
+    int8_t                  mChannelMap[ALSA_MAX_CHANNELS];
+    int16_t                 mRemixMatrix[ALSA_MAX_CHANNELS * 8];
+    int16_t *               mRemixBuffer;
+    size_t                  mRemixBufferSize;
+    void *                  mVolumeBuffer;
+    size_t                  mVolumeBufferSize;
+
+    // Capture handed out one plane per channel instead of interleaved
+    bool                    mPlanar;
+    int16_t *               mPlanarBuffer;
+    size_t                  mPlanarBufferSize;
+
+    // xrun recovery statistics, see recover()
+    uint32_t                mXrunCount;
+    uint32_t                mPrepareCount;
+    uint32_t                mReopenCount;
+    uint32_t                mErrorCount;
+
+    // Backoff while the device keeps failing, see recoveryFailed()
+    uint32_t                mRecoveryAttempts;
+    bool                    mRecoveryBlocked;
+    uint32_t                mRecoveryBackoffMs;
+    nsecs_t                 mRecoveryRetryTime;
+    nsecs_t                 mEmulationStart;
+    uint64_t                mEmulatedFrames;
+};
+
+// ----------------------------------------------------------------------------
+
+#define ALSA_MIXER_MAX_TRACKS   8
+
+class AudioStreamOutALSA;
+
+// Sums up to ALSA_MIXER_MAX_TRACKS client output streams into one PCM, so
+// more streams can play than the codec has front ends. The mixed periods
+// are written through a regular AudioStreamOutALSA (the sink), which keeps
+// standby, recovery and position reporting in one place.
+class ALSAStreamMixer
+{
+public:
+    ALSAStreamMixer(AudioStreamOutALSA *sink, alsa_handle_t *handle);
+    virtual                ~ALSAStreamMixer();
+
+    status_t                initCheck() const { return mRunning ? NO_ERROR : NO_INIT; }
+    alsa_handle_t *         handle() const { return mHandle; }
+
+    int                     addTrack();
+    void                    removeTrack(int track);
+    size_t                  trackCount();
+
+    ssize_t                 write(int track, const void *buffer, size_t bytes);
+    void                    standby(int track);
+    void                    setGain(int track, float gain);
+    void                    setDevices(uint32_t devices);
+    status_t                getPresentationPosition(int track, uint64_t *frames,
+                                                    struct timespec *timestamp);
+    uint32_t                latency() const;   // usec queued in a track's ring
+    void                    dump(int fd);
+
+private:
+    struct Track {
+        bool                used;
+        bool                active;
+        float               gain;
+        ALSARingBuffer *    ring;
+        uint64_t            framesMixed;
+        uint32_t            underruns;      // periods padded with silence
+    };
+
+    static void *           threadWrapper(void *me);
+    void                    threadLoop();
+    bool                    tracksReady(bool *any);
+    size_t                  mixPeriod();
+
+    AudioStreamOutALSA *    mSink;
+    alsa_handle_t *         mHandle;
+    size_t                  mPeriodBytes;
+    size_t                  mFrameSize;
+
+    Mutex                   mLock;
+    Condition               mCond;
+    Track                   mTracks[ALSA_MIXER_MAX_TRACKS];
+    int16_t *               mMixBuffer;
+    int16_t *               mTrackBuffer;
+    float *                 mAccumulator;
+    uint64_t                mFramesMixed;   // handed to the sink
+
+    pthread_t               mThread;
+    bool                    mRunning;
+    bool                    mExit;
+};
+
+// ----------------------------------------------------------------------------
+
+#define ALSA_SPLITTER_MAX_CLIENTS   8
+
+class AudioStreamInALSA;
+
+// Hands one capture PCM to up to ALSA_SPLITTER_MAX_CLIENTS input streams.
+// A thread reads it through a regular AudioStreamInALSA (the source) into
+// a single ring which every client reads with its own cursor, so a slow
+// client never holds up the capture or the others; what a client lets
+// the ring overwrite is reported as lost.
+class ALSAStreamSplitter
+{
+public:
+    ALSAStreamSplitter(AudioStreamInALSA *source, alsa_handle_t *handle,
+                       uint32_t history = 0);
+    virtual                ~ALSAStreamSplitter();
+
+    status_t                initCheck() const { return mRunning ? NO_ERROR : NO_INIT; }
+    alsa_handle_t *         handle() const { return mHandle; }
+
+    int                     addClient();
+    void                    removeClient(int client);
+    size_t                  clientCount();
+
+    ssize_t                 read(int client, void *buffer, size_t bytes, uint32_t *lost);
+    void                    standby(int client);
+    void                    dump(int fd);
+
+    // Keep capturing with no client active, for the pre-roll
+    void                    setAlwaysOn(bool on);
+    // Frames of history the client starts with when it leaves standby
+    void                    setPreroll(int client, uint32_t frames);
+
+private:
+    struct Client {
+        bool                used;
+        bool                active;
+        uint32_t            preroll;        // frames
+        uint32_t            readPos;        // frames, only touched by the client
+        uint32_t            lost;           // frames, handed over on read()
+        uint64_t            framesRead;
+    };
+
+    static void *           threadWrapper(void *me);
+    void                    threadLoop();
+    void                    publish(const char *buffer, size_t frames);
+
+    AudioStreamInALSA *     mSource;
+    alsa_handle_t *         mHandle;
+    size_t                  mPeriodBytes;
+    size_t                  mFrameSize;
+    char *                  mPeriodBuffer;
+
+    // Written only by the thread, mWritePos counts frames since start and
+    // wraps, positions are compared modulo 2^32
+    char *                  mRing;
+    uint32_t                mRingFrames;    // power of two
+    volatile int32_t        mWritePos;
+    uint64_t                mFramesCaptured;
+    uint64_t                mOverruns;      // source losses passed on
+    bool                    mAlwaysOn;
+
+    // Only for sleeping and the client table, the data path is lock-free
+    Mutex                   mLock;
+    Condition               mCond;
+    Client                  mClients[ALSA_SPLITTER_MAX_CLIENTS];
+
+    pthread_t               mThread;
+    bool                    mRunning;
+    bool                    mExit;
 };
 
 // ----------------------------------------------------------------------------
@@ -233,23 +742,72 @@ public:
 
     virtual status_t    standby();
 
-    virtual status_t    setParameters(const String8& keyValuePairs) {
-        return ALSAStreamOps::setParameters(keyValuePairs);
-    }
+    virtual status_t    setParameters(const String8& keyValuePairs);
 
-    virtual String8     getParameters(const String8& keys) {
-        return ALSAStreamOps::getParameters(keys);
-    }
+    virtual String8     getParameters(const String8& keys);
 
     // return the number of audio frames written by the audio dsp to DAC since
     // the output has exited standby
     virtual status_t    getRenderPosition(uint32_t *dspFrames);
 
+    // return the number of frames presented to the DAC over the lifetime of
+    // the stream, along with the CLOCK_MONOTONIC time it was sampled at
+    status_t            getPresentationPosition(uint64_t *frames, struct timespec *timestamp);
+
     status_t            open(int mode);
     status_t            close();
 
+    // Turn this stream into a client of the software mixer
+    status_t            attachMixer(ALSAStreamMixer *mixer);
+
+    // Close the PCM and the route kept open by standby(), once the grace
+    // period expires
+    void                closeStandby();
+
 private:
-    uint32_t            mFrameCount;
+    ssize_t             writeFrames(const void *buffer, size_t frames);
+    const void *        applyVolume(const void *buffer, size_t frames);
+    ssize_t             writeStream(const void *buffer, size_t bytes);
+    status_t            exitStandby();
+    ssize_t             writeToDevice(const void *buffer, size_t bytes);
+    status_t            writePeriod(const char *buffer);
+    void                discard(size_t bytes);
+    uint64_t            queuedFrames();
+    void                dropPaused();
+    ssize_t             writeToRing(const void *buffer, size_t bytes);
+
+    status_t            startWriter();
+    void                stopWriter();
+    static void *       writerThreadWrapper(void *me);
+    void                writerThreadLoop();
+
+    uint64_t            mFramesWritten;     // handed to the driver, kept across standby
+    uint64_t            mStandbyFrames;     // presented frames at the last standby
+
+    // Optional drain thread which owns the PCM, see writeToRing()
+    ALSARingBuffer *    mRing;
+    char *              mWriterPeriod;      // the drain thread's period buffer
+    pthread_t           mWriterThread;
+    bool                mWriterRunning;
+    volatile int32_t    mWriterExit;
+    Mutex               mWriterLock;
+    Condition           mWriterCond;
+
+    // Set when the stream is a track of the software mixer
+    ALSAStreamMixer *   mMixer;
+    int                 mMixerTrack;
+
+    // standby() only stopped the PCM and queued the full close with the
+    // parent, see AudioHardwareALSA::scheduleStandby()
+    bool                mStandbyPending;
+
+    // Software volume, ramped from mVolume to mVolumeTarget over
+    // mVolumeRampFrames when it changes, see applyVolume()
+    Mutex               mVolumeLock;
+    bool                mSoftwareVolume;
+    float               mVolume[2];
+    float               mVolumeTarget[2];
+    size_t              mVolumeRampFrames;
 
 protected:
     AudioHardwareALSA *     mParent;
@@ -290,15 +848,9 @@ public:
 
     virtual status_t    standby();
 
-    virtual status_t    setParameters(const String8& keyValuePairs)
-    {
-        return ALSAStreamOps::setParameters(keyValuePairs);
-    }
+    virtual status_t    setParameters(const String8& keyValuePairs);
 
-    virtual String8     getParameters(const String8& keys)
-    {
-        return ALSAStreamOps::getParameters(keys);
-    }
+    virtual String8     getParameters(const String8& keys);
 
     // Return the amount of input frames lost in the audio driver since the last call of this function.
     // Audio driver is expected to reset the value to 0 and restart counting upon returning the current value by this function call.
@@ -306,24 +858,49 @@ public:
     // Unit: the number of input audio frames
     virtual unsigned int  getInputFramesLost() const;
 
-    virtual status_t addAudioEffect(effect_handle_t effect)
-    {
-        return BAD_VALUE;
-    }
-   
-    virtual status_t removeAudioEffect(effect_handle_t effect)
-    {
-        return BAD_VALUE;
-    }
+    virtual status_t    addAudioEffect(effect_handle_t effect);
+    virtual status_t    removeAudioEffect(effect_handle_t effect);
     status_t            setAcousticParams(void* params);
 
     status_t            open(int mode);
     status_t            close();
 
+    // Turn this stream into a client of the capture splitter
+    status_t            attachSplitter(ALSAStreamSplitter *splitter);
+
+    // The PCM was opened with every mic, set() takes any of them
+    void                setMultiMic() { mMultiMic = true; }
+
+    // Stages run on every read(), audio.capture.preproc unless changed
+    void                setPreProcessing(uint32_t stages) { mPreProcessor.setStages(stages); }
+
 private:
     void                resetFramesLost();
+    ssize_t             readClient(void *buffer, ssize_t bytes);
+    ssize_t             readFrames(void *buffer, size_t frames);
+    ssize_t             readStream(void *buffer, ssize_t bytes);
+    ssize_t             readPeriods(void *buffer, size_t periods);
+    bool                lapped();
+    void                countOverrun(bool overrun, size_t framesRead);
+
+    // Overrun accounting, see countOverrun(). mFramesLost is cleared by
+    // getInputFramesLost(), the totals only for dump().
+    volatile int32_t    mFramesLost;
+    uint32_t            mOverrunCount;
+    uint64_t            mTotalFramesLost;
+    nsecs_t             mLastReadTime;      // 0 until the capture runs
+
+    // Ring fill at the last delay query less what was read since, see
+    // lapped(). mLapCheckTime is 0 when there is no valid query.
+    nsecs_t             mLapCheckTime;
+    int64_t             mLapCheckFill;
+
+    // Set when the stream reads the shared capture of the splitter
+    ALSAStreamSplitter * mSplitter;
+    int                 mSplitterClient;
+
+    ALSAPreProcessor    mPreProcessor;
 
-    unsigned int        mFramesLost;
     AudioSystem::audio_in_acoustics mAcoustics;
 
 protected:
@@ -413,7 +990,25 @@ public:
 protected:
     virtual status_t    dump(int fd, const Vector<String16>& args);
     void                doRouting(int device);
+    static int          outputProfile(const String8& name);
+    static int          resamplerQuality(const String8& name);
+    static int          pcmFormat(const String8& name);
+    static bool         sharedCapture(const char *useCase);
+    static bool         mixerServes(const alsa_handle_t *sink, uint32_t devices,
+                                    const int *format, const uint32_t *channels,
+                                    const uint32_t *rate);
+    uint32_t            multiMicChannels(uint32_t devices) const;
     void                handleFm(int device);
+    void                initHandle(alsa_handle_t *handle, int profile, uint32_t devices);
+    void                startPreroll();
+    void                stopPreroll();
+    bool                prerollServes(uint32_t devices, uint32_t rate);
+    void                routeHandle(alsa_handle_t *handle, uint32_t device, int mode);
+    status_t            scheduleStandby(AudioStreamOutALSA *out);
+    void                cancelStandby(AudioStreamOutALSA *out);
+    uint32_t            routeLatency(uint32_t devices) const;
+    static void *       standbyThreadWrapper(void *me);
+    void                standbyThreadLoop();
     friend class AudioStreamOutALSA;
     friend class AudioStreamInALSA;
     friend class ALSAStreamOps;
@@ -422,7 +1017,13 @@ protected:
 
     ALSAHandleList      mDeviceList;
 
+    // Lock order: mPrerollLock, mLock, mStandbyLock, alsa_handle_t::lock,
+    // mRoutingLock.
+    // mLock guards mDeviceList and the call/FM state, a handle's lock its
+    // PCM, mRoutingLock the UCM manager and the route of every handle.
+    // Steady-state reads and writes only take their own handle's lock.
     Mutex                   mLock;
+    Mutex                   mRoutingLock;
 
     snd_use_case_mgr_t *mUcMgr;
 
@@ -435,6 +1036,46 @@ protected:
     uint32_t            mIncallMode;
 
     bool                mMicMute;
+    bool                mOutputWriterThread;
+    int                 mOutputProfile;
+    bool                mSoftwareMixer;
+    ALSAStreamMixer *   mMixer;
+    bool                mCaptureFanout;
+    bool                mMultiMic;
+    ALSAStreamSplitter * mSplitter;
+    uint32_t            mCapturePreProc;
+    // Length of the background capture, and whether mSplitter is it
+    uint32_t            mPrerollMs;
+    bool                mPreroll;
+    // Guards mSplitter and mPreroll, taken before mLock since the
+    // splitter's source takes mLock as it closes
+    Mutex               mPrerollLock;
+    bool                mNativeEffects;
+    int                 mResamplerQuality;
+    int                 mOutputFormat;
+    uint32_t            mHdmiMaxChannels;
+    bool                mSoftwareVolume;
+
+    ALSAProfileTable    mProfiles;
+
+    // DSP pipeline delay in usec behind each output route, added to the
+    // PCM ring by AudioStreamOutALSA::latency()
+    uint32_t            mRouteLatency[ALSA_ROUTE_LATENCY_COUNT];
+
+    // Outputs in standby whose PCM and route stay up for mStandbyDelayMs,
+    // closed by the standby thread unless written to again
+    struct PendingStandby {
+        AudioStreamOutALSA *out;
+        nsecs_t             deadline;
+    };
+    uint32_t            mStandbyDelayMs;
+    List<PendingStandby> mStandbyList;
+    Mutex               mStandbyLock;
+    Condition           mStandbyCond;
+    pthread_t           mStandbyThread;
+    bool                mStandbyThreadRunning;
+    bool                mStandbyExit;
+
     int mIsVoiceCallActive;
     int mIsFmActive;
     bool mBluetoothVGS;
@@ -30,6 +30,7 @@
 #include <utils/Log.h>
 #include <utils/String8.h>
 
+#include <cutils/atomic.h>
 #include <cutils/properties.h>
 #include <media/AudioRecord.h>
 #include <hardware_legacy/power.h>
@@ -44,14 +45,43 @@ AudioStreamInALSA::AudioStreamInALSA(AudioHardwareALSA *parent,
         AudioSystem::audio_in_acoustics audio_acoustics) :
     ALSAStreamOps(parent, handle),
     mFramesLost(0),
+    mOverrunCount(0),
+    mTotalFramesLost(0),
+    mLastReadTime(0),
+    mLapCheckTime(0),
+    mLapCheckFill(0),
+    mSplitter(NULL),
+    mSplitterClient(-1),
     mParent(parent),
     mAcoustics(audio_acoustics)
 {
+    mPreProcessor.setStages(parent->mCapturePreProc);
 }
 
 AudioStreamInALSA::~AudioStreamInALSA()
 {
     close();
+
+    if (mSplitter) {
+        mSplitter->removeClient(mSplitterClient);
+    }
+}
+
+//
+// Reads come from the splitter's ring instead of the PCM, which the
+// splitter's source owns along with the handle
+//
+status_t AudioStreamInALSA::attachSplitter(ALSAStreamSplitter *splitter)
+{
+    // Never ours to close, even if no client slot is left
+    mSharedHandle = true;
+
+    mSplitterClient = splitter->addClient();
+    if (mSplitterClient < 0) {
+        return NO_INIT;
+    }
+    mSplitter = splitter;
+    return NO_ERROR;
 }
 
 status_t AudioStreamInALSA::setGain(float gain)
@@ -61,25 +91,163 @@ status_t AudioStreamInALSA::setGain(float gain)
 
 ssize_t AudioStreamInALSA::read(void *buffer, ssize_t bytes)
 {
-    int period_size;
+    void *dst = buffer;
+    ssize_t n;
 
     LOGV("read:: buffer %p, bytes %d", buffer, bytes);
 
+    if (mPlanar) {
+        // Everything up to the pre-processing works on interleaved frames,
+        // they are split into planes on the way out
+        if (resizePlanarBuffer(bytes) != NO_ERROR) {
+            return -ENOMEM;
+        }
+        dst = mPlanarBuffer;
+    }
+
+    n = readClient(dst, bytes);
+    if ((n > 0) && (mClientFormat == SNDRV_PCM_FORMAT_S16_LE)) {
+        mPreProcessor.process((int16_t *)dst, n / clientFrameSize(), sampleRate(),
+                              mClientChannels);
+    }
+    if ((n > 0) && mPlanar) {
+        deinterleave_s16((int16_t *)buffer, mPlanarBuffer, mClientChannels,
+                         n / clientFrameSize());
+    }
+    return n;
+}
+
+//
+// Fill the client's buffer at its rate, layout and format. Returns bytes
+// read.
+//
+ssize_t AudioStreamInALSA::readClient(void *buffer, ssize_t bytes)
+{
+    size_t wanted = bytes / clientFrameSize();
+    ssize_t n;
+
+    if (mResampler) {
+        int16_t *dst = (int16_t *)buffer;
+        size_t done = 0;
+
+        while (done < wanted) {
+            size_t inFrames = mResampler->inputFramesFor(wanted - done);
+            size_t consumed;
+
+            if (inFrames) {
+                if (resizeResampleBuffer(inFrames * clientFrameSize()) != NO_ERROR) {
+                    return -ENOMEM;
+                }
+                n = readFrames(mResampleBuffer, inFrames);
+                if (n <= 0) {
+                    return done ? (ssize_t)(done * clientFrameSize()) : n;
+                }
+                inFrames = n;
+            }
+            consumed = inFrames;
+            done += mResampler->resample(mResampleBuffer, &consumed,
+                                         dst + done * mClientChannels,
+                                         wanted - done);
+        }
+        return done * clientFrameSize();
+    }
+
+    n = readFrames(buffer, wanted);
+    if (n < 0) {
+        return n;
+    }
+    return n * clientFrameSize();
+}
+
+//
+// Read PCM frames and convert them to the client format. Returns frames
+// read.
+//
+ssize_t AudioStreamInALSA::readFrames(void *buffer, size_t frames)
+{
+    void *dst = buffer;
+    void *pcm;
+    ssize_t n;
+
+    if (mClientFormat != mHandle->format) {
+        if (resizeConvertBuffer(frames * mClientChannels *
+                                pcm_format_bytes(mHandle->format)) != NO_ERROR) {
+            return -ENOMEM;
+        }
+        dst = mConvertBuffer;
+    }
+
+    pcm = dst;
+    if (mRemix) {
+        if (resizeRemixBuffer(frames * frameSize()) != NO_ERROR) {
+            return -ENOMEM;
+        }
+        pcm = mRemixBuffer;
+    }
+
+    n = readStream(pcm, frames * frameSize());
+    if (n <= 0) {
+        return n;
+    }
+    n /= frameSize();
+
+    if (pcm != dst) {
+        if (mRemixIsMap) {
+            remap_s16((int16_t *)dst, mClientChannels, (const int16_t *)pcm,
+                      mHandle->channels, mChannelMap, n);
+        } else if (mRemixIsDownmix) {
+            downmix_s16((int16_t *)dst, (const int16_t *)pcm, mHandle->channels, n);
+        } else {
+            remix_s16((int16_t *)dst, mClientChannels, (const int16_t *)pcm,
+                      mHandle->channels, mRemixMatrix, n);
+        }
+    }
+    if (dst != buffer) {
+        convert_pcm(buffer, mClientFormat, dst, mHandle->format, n * mClientChannels);
+    }
+    return n;
+}
+
+//
+// Read at the PCM rate
+//
+ssize_t AudioStreamInALSA::readStream(void *buffer, ssize_t bytes)
+{
+    int period_size;
+
+    if (mSplitter) {
+        uint32_t lost = 0;
+        ssize_t n = mSplitter->read(mSplitterClient, buffer, bytes, &lost);
+
+        if (lost) {
+            mOverrunCount++;
+            mTotalFramesLost += lost;
+            android_atomic_add((int32_t)lost, &mFramesLost);
+        }
+        return n;
+    }
+
     if (!mPowerLock) {
         acquire_wake_lock (PARTIAL_WAKE_LOCK, "AudioInLock");
         mPowerLock = true;
     }
 
-    int n;
     status_t          err;
     size_t            read = 0;
+    char *            dst = (char *)buffer;
     char *use_case;
     int newMode = mParent->mode();
 
     if((mHandle->handle == NULL) && (mHandle->rxHandle == NULL) &&
          (strcmp(mHandle->useCase, SND_USE_CASE_VERB_IP_VOICECALL)) &&
          (strcmp(mHandle->useCase, SND_USE_CASE_MOD_PLAY_VOIP))) {
-        mParent->mLock.lock();
+        if (!recoveryAllowed()) {
+            memset(dst, 0, bytes);
+            emulateTime(bytes);
+            return bytes;
+        }
+        mHandle->lock.lock();
+        mParent->mRoutingLock.lock();
         snd_use_case_get(mHandle->ucMgr, "_verb", (const char **)&use_case);
         if ((use_case != NULL) && (strcmp(use_case, SND_USE_CASE_VERB_INACTIVE))) {
             if ((mHandle->devices == AudioSystem::DEVICE_IN_VOICE_CALL) &&
@@ -145,57 +313,216 @@ ssize_t AudioStreamInALSA::read(void *buffer, ssize_t bytes)
         }
         else
             mHandle->module->open(mHandle);
+        reopened();
         if(mHandle->handle == NULL) {
             LOGE("read:: PCM device open failed");
-            mParent->mLock.unlock();
+            mParent->mRoutingLock.unlock();
+            mHandle->lock.unlock();
+            recoveryFailed();
 
-            return 0;
+            memset(dst, 0, bytes);
+            emulateTime(bytes);
+            return bytes;
         }
-        mParent->mLock.unlock();
+        mParent->mRoutingLock.unlock();
+        mHandle->lock.unlock();
     }
 
+    //
+    // The driver is only ever asked for whole periods, as many as fit in
+    // one go straight into the caller's buffer. Whatever the caller did not
+    // ask for stays in mStaging and is handed out first next time.
+    //
     period_size = mHandle->periodSize;
-    int read_pending = bytes;
-    do {
-        if (read_pending < period_size) {
-            read_pending = period_size;
+    if (resizeStaging(period_size) != NO_ERROR) {
+        return 0;
+    }
+    if (mStagingOffset + mStagingBytes > (size_t)period_size) {
+        // The period shrank across a reopen, the old remainder is stale
+        mStagingBytes = 0;
+    }
+
+    if (mStagingBytes) {
+        size_t chunk = mStagingBytes;
+        if (chunk > (size_t)bytes)
+            chunk = bytes;
+        memcpy(dst, mStaging + mStagingOffset, chunk);
+        mStagingOffset += chunk;
+        mStagingBytes -= chunk;
+        read += chunk;
+    }
+
+    while ((size_t)bytes - read >= (size_t)period_size) {
+        ssize_t periods = readPeriods(dst + read, ((size_t)bytes - read) / period_size);
+        if (periods <= 0) {
+            goto silence;
         }
+        read += periods * period_size;
+    }
+
+    if (read < (size_t)bytes) {
+        if (readPeriods(mStaging, 1) <= 0) {
+            goto silence;
+        }
+        mStagingOffset = bytes - read;
+        mStagingBytes = period_size - mStagingOffset;
+        memcpy(dst + read, mStaging, mStagingOffset);
+        read = bytes;
+    }
+
+    return read;
+
+silence:
+    // The device is down: hand out silence at the capture rate rather
+    // than returning immediately and having the caller spin on read()
+    memset(dst + read, 0, bytes - read);
+    emulateTime(bytes - read);
+    return bytes;
+}
 
-        n = pcm_read(mHandle->handle, buffer,
-            period_size);
+//
+// Read up to periods whole periods with a single READI. The batch is kept
+// within the ring so an overrun can't happen inside one call, and VoIP
+// hands out one packet per read so it always reads a single period.
+// Returns periods read.
+//
+ssize_t AudioStreamInALSA::readPeriods(void *buffer, size_t periods)
+{
+    int period_size = mHandle->periodSize;
+    int n;
+    status_t err;
+    bool overrun = false;
+    Mutex::Autolock autoLock(mHandle->lock);
+
+    if (!recoveryAllowed()) {
+        return INVALID_OPERATION;
+    }
+
+    while (mHandle->handle) {
+        if (mHandle->profile == ALSA_PROFILE_VOIP) {
+            periods = 1;
+        } else if (periods > mHandle->handle->period_cnt) {
+            periods = mHandle->handle->period_cnt ? mHandle->handle->period_cnt : 1;
+        }
+        if (mHandle->state != ALSA_STATE_RUNNING) {
+            mLapCheckTime = 0;
+        }
+        if ((mHandle->state == ALSA_STATE_RUNNING) && lapped()) {
+            n = -EPIPE;
+        } else if (mHandle->handle->flags & PCM_MMAP) {
+            n = mHandle->module->mmapRead(mHandle, buffer, periods * period_size);
+        } else {
+            n = pcm_read(mHandle->handle, buffer, periods * period_size);
+        }
         LOGV("pcm_read() returned n = %d", n);
-        if (n && (n == -EIO || n == -EAGAIN || n == -EPIPE || n == -EBADFD)) {
-            mParent->mLock.lock();
+        if (n && (n == -EIO || n == -EAGAIN || n == -EPIPE || n == -EBADFD || n == -ENODEV)) {
             LOGW("pcm_read() returned error n %d, Recovering from error\n", n);
-            pcm_close(mHandle->handle);
-            mHandle->handle = NULL;
-            if((!strncmp(mHandle->useCase, SND_USE_CASE_VERB_IP_VOICECALL, strlen(SND_USE_CASE_VERB_IP_VOICECALL))) ||
-              (!strncmp(mHandle->useCase, SND_USE_CASE_MOD_PLAY_VOIP, strlen(SND_USE_CASE_MOD_PLAY_VOIP)))) {
-                 pcm_close(mHandle->rxHandle);
-                 mHandle->rxHandle = NULL;
-                 mHandle->module->startVoipCall(mHandle);
+            if (n == -EPIPE) {
+                overrun = true;
+            }
+            mLapCheckTime = 0;
+            err = recover(mHandle->handle, n);
+            if (err != NO_ERROR) {
+                return err;
             }
-            else
-                 mHandle->module->open(mHandle);
-            mParent->mLock.unlock();
             continue;
         }
         else if (n < 0) {
             LOGD("pcm_read() returned n < 0");
-            return static_cast<ssize_t>(n);
-        }
-        else {
-            read += static_cast<ssize_t>((period_size));
-            read_pending -= period_size;
+            return static_cast<status_t>(n);
         }
+        recoverySucceeded();
+        mHandle->state = ALSA_STATE_RUNNING;
+        mLapCheckFill -= periods * period_size / frameSize();
+        countOverrun(overrun, periods * period_size / frameSize());
+        return periods;
+    }
 
-    } while (mHandle->handle && read < bytes);
+    return NO_INIT;
+}
 
-    return read;
+//
+// The capture only stops on overrun if its stop threshold says so, and
+// pcm_read() may restart it without telling. Otherwise the DMA keeps
+// going and the kernel hands out frames it has already overwritten, so
+// treat more than a ring of pending frames as an overrun too.
+//
+// The fill is extrapolated from the last query at the capture rate, the
+// delay is only queried again once that estimate passes half a ring.
+//
+bool AudioStreamInALSA::lapped()
+{
+    snd_pcm_sframes_t avail;
+    struct timespec timestamp;
+    status_t err;
+    int64_t ring = mHandle->handle->buffer_size / frameSize();
+    nsecs_t now;
+
+    if (mHandle->profile == ALSA_PROFILE_VOIP) {
+        return false;
+    }
+    now = systemTime(SYSTEM_TIME_MONOTONIC);
+    if (mLapCheckTime &&
+        (mLapCheckFill + (now - mLapCheckTime) * mHandle->sampleRate / 1000000000LL < ring / 2)) {
+        return false;
+    }
+    err = mHandle->module->getDelay(mHandle->handle, &avail, &timestamp);
+    if (err != NO_ERROR) {
+        mLapCheckTime = 0;
+        // -EPIPE if the kernel did stop it
+        return err == -EPIPE;
+    }
+    mLapCheckTime = now;
+    mLapCheckFill = avail;
+    return avail > ring;
+}
+
+//
+// After a read that had to recover from an overrun everything captured
+// since the previous read went with the prepare, so the loss is the time
+// in between at the capture rate less what the restarted capture has
+// produced so far.
+//
+void AudioStreamInALSA::countOverrun(bool overrun, size_t framesRead)
+{
+    nsecs_t now = systemTime(SYSTEM_TIME_MONOTONIC);
+    int64_t lost = 0;
+
+    if (overrun) {
+        if (mLastReadTime) {
+            lost = (now - mLastReadTime) * mHandle->sampleRate / 1000000000LL -
+                   (int64_t)framesRead;
+            if (lost < 0)
+                lost = 0;
+        }
+        mOverrunCount++;
+        mTotalFramesLost += lost;
+        android_atomic_add((int32_t)lost, &mFramesLost);
+        LOGW("capture overrun, %lld frames lost", lost);
+    }
+    mLastReadTime = now;
 }
 
 status_t AudioStreamInALSA::dump(int fd, const Vector<String16>& args)
 {
+    char buffer[256];
+
+    if (mSplitter) {
+        snprintf(buffer, sizeof(buffer), "  splitter client %d\n", mSplitterClient);
+        ::write(fd, buffer, strlen(buffer));
+        mSplitter->dump(fd);
+    } else {
+        dumpRecovery(fd);
+    }
+    snprintf(buffer, sizeof(buffer), "  overruns: %u\n  frames lost: %llu\n",
+             mOverrunCount, (unsigned long long)mTotalFramesLost);
+    ::write(fd, buffer, strlen(buffer));
+    if (mMultiMic) {
+        snprintf(buffer, sizeof(buffer), "  mics: %d, %d read%s\n", mHandle->channels,
+                 mClientChannels, mPlanar ? " as planes" : "");
+        ::write(fd, buffer, strlen(buffer));
+    }
+    mPreProcessor.dump(fd);
     return NO_ERROR;
 }
 
@@ -210,6 +537,11 @@ status_t AudioStreamInALSA::open(int mode)
 
 status_t AudioStreamInALSA::close()
 {
+    // The splitter's source closes the shared PCM
+    if (mSplitter) {
+        return NO_ERROR;
+    }
+
     Mutex::Autolock autoLock(mParent->mLock);
 
     if((!strcmp(mHandle->useCase, SND_USE_CASE_VERB_IP_VOICECALL)) ||
@@ -235,7 +567,18 @@ status_t AudioStreamInALSA::close()
 
 status_t AudioStreamInALSA::standby()
 {
-    Mutex::Autolock autoLock(mParent->mLock);
+    if (mSplitter) {
+        mSplitter->standby(mSplitterClient);
+        mStagingBytes = 0;
+        if (mResampler) {
+            mResampler->reset();
+        }
+        mPreProcessor.reset();
+        return NO_ERROR;
+    }
+
+    Mutex::Autolock handleLock(mHandle->lock);
+    Mutex::Autolock routingLock(mParent->mRoutingLock);
 
     if((!strcmp(mHandle->useCase, SND_USE_CASE_VERB_IP_VOICECALL)) ||
         (!strcmp(mHandle->useCase, SND_USE_CASE_MOD_PLAY_VOIP))) {
@@ -245,6 +588,13 @@ status_t AudioStreamInALSA::standby()
     LOGD("standby");
 
     mHandle->module->standby(mHandle);
+    mStagingBytes = 0;
+    // Nothing is lost while the capture is stopped on purpose
+    mLastReadTime = 0;
+    if (mResampler) {
+        mResampler->reset();
+    }
+    mPreProcessor.reset();
 
     if (mPowerLock) {
         release_wake_lock ("AudioInLock");
@@ -256,16 +606,114 @@ status_t AudioStreamInALSA::standby()
 
 void AudioStreamInALSA::resetFramesLost()
 {
-    mFramesLost = 0;
+    android_atomic_and(0, &mFramesLost);
 }
 
 unsigned int AudioStreamInALSA::getInputFramesLost() const
 {
-    unsigned int count = mFramesLost;
     // Stupid interface wants us to have a side effect of clearing the count
     // but is defined as a const to prevent such a thing.
-    ((AudioStreamInALSA *)this)->resetFramesLost();
-    return count;
+    return (unsigned int)android_atomic_and(0, &((AudioStreamInALSA *)this)->mFramesLost);
+}
+
+//
+// PREROLL_KEY has a client of the background capture start that many ms
+// before the newest frame when it next leaves standby. A multi-mic capture
+// also takes MIC_SELECT_KEY, the mic read into each client channel as
+// "2,0", and MIC_LAYOUT_KEY, "planar" for each channel's frames of a
+// read() back to back or "interleaved".
+//
+status_t AudioStreamInALSA::setParameters(const String8& keyValuePairs)
+{
+    AudioParameter param = AudioParameter(keyValuePairs);
+    String8 key = String8(PREROLL_KEY);
+    String8 value;
+    status_t err;
+    int ms;
+
+    if (param.getInt(key, ms) == NO_ERROR) {
+        param.remove(key);
+        if (!mSplitter) {
+            return INVALID_OPERATION;
+        }
+        mSplitter->setPreroll(mSplitterClient,
+                              ms > 0 ? (uint64_t)ms * mHandle->sampleRate / 1000 : 0);
+    }
+
+    key = String8(MIC_SELECT_KEY);
+    if (param.get(key, value) == NO_ERROR) {
+        int8_t select[ALSA_MAX_CHANNELS];
+        uint32_t count = 0;
+        const char *p = value.string();
+        char *end;
+
+        param.remove(key);
+        if (!mMultiMic) {
+            return INVALID_OPERATION;
+        }
+        while (*p && (count < ALSA_MAX_CHANNELS)) {
+            select[count++] = strtol(p, &end, 10);
+            if (end == p) {
+                return BAD_VALUE;
+            }
+            p = (*end == ',') ? end + 1 : end;
+        }
+        // The client's frame size is fixed at open
+        if (*p || (count != mClientChannels)) {
+            return BAD_VALUE;
+        }
+        err = setupMics(count, select);
+        if (err != NO_ERROR) {
+            return err;
+        }
+    }
+
+    key = String8(MIC_LAYOUT_KEY);
+    if (param.get(key, value) == NO_ERROR) {
+        param.remove(key);
+        if (!mMultiMic || (mClientFormat != SNDRV_PCM_FORMAT_S16_LE)) {
+            return INVALID_OPERATION;
+        }
+        if (!strcmp(value.string(), "planar")) {
+            mPlanar = true;
+        } else if (!strcmp(value.string(), "interleaved")) {
+            mPlanar = false;
+        } else {
+            return BAD_VALUE;
+        }
+    }
+
+    if (!param.size()) {
+        return NO_ERROR;
+    }
+    return ALSAStreamOps::setParameters(param.toString());
+}
+
+String8 AudioStreamInALSA::getParameters(const String8& keys)
+{
+    AudioParameter param = AudioParameter(keys);
+    String8 key = String8(MIC_CHANNELS_KEY);
+    String8 value;
+
+    // 0 unless the stream captures every mic
+    if (param.get(key, value) == NO_ERROR) {
+        param.addInt(key, mMultiMic ? (int)mHandle->channels : 0);
+    }
+    key = String8(MIC_LAYOUT_KEY);
+    if (param.get(key, value) == NO_ERROR) {
+        param.add(key, String8(mPlanar ? "planar" : "interleaved"));
+    }
+    return ALSAStreamOps::getParameters(param.toString());
+}
+
+status_t AudioStreamInALSA::addAudioEffect(effect_handle_t effect)
+{
+    return mPreProcessor.addEffect(effect, mParent->mNativeEffects);
+}
+
+status_t AudioStreamInALSA::removeAudioEffect(effect_handle_t effect)
+{
+    return mPreProcessor.removeEffect(effect);
 }
 
 status_t AudioStreamInALSA::setAcousticParams(void *params)
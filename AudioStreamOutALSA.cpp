@@ -24,6 +24,9 @@
 #include <unistd.h>
 #include <dlfcn.h>
 #include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
 
 #define LOG_TAG "AudioStreamOutALSA"
 //#define LOG_NDEBUG 0
@@ -32,6 +35,7 @@
 #include <utils/String8.h>
 
 #include <cutils/properties.h>
+#include <cutils/atomic.h>
 #include <media/AudioRecord.h>
 #include <hardware_legacy/power.h>
 
@@ -41,6 +45,13 @@
 #define ALSA_DEFAULT_SAMPLE_RATE 44100 // in Hz
 #endif
 
+#define WRITER_RING_PERIODS     2
+#define WRITER_THREAD_PRIORITY  2
+#define WRITER_WAIT_TIMEOUT_NS  100000000LL
+
+// Length of the software volume ramp, long enough to avoid zipper noise
+#define VOLUME_RAMP_MS          20
+
 namespace android_audio_legacy
 {
 
@@ -53,13 +64,41 @@ static const int DEFAULT_SAMPLE_RATE = ALSA_DEFAULT_SAMPLE_RATE;
 AudioStreamOutALSA::AudioStreamOutALSA(AudioHardwareALSA *parent, alsa_handle_t *handle) :
     ALSAStreamOps(parent, handle),
     mParent(parent),
-    mFrameCount(0)
+    mFramesWritten(0),
+    mStandbyFrames(0),
+    mRing(NULL),
+    mWriterPeriod(NULL),
+    mWriterRunning(false),
+    mWriterExit(0),
+    mMixer(NULL),
+    mMixerTrack(-1),
+    mStandbyPending(false),
+    mSoftwareVolume(false),
+    mVolumeRampFrames(0)
 {
+    mVolume[0] = mVolume[1] = 1.0f;
+    mVolumeTarget[0] = mVolumeTarget[1] = 1.0f;
 }
 
 AudioStreamOutALSA::~AudioStreamOutALSA()
 {
     close();
+    if (mMixer) {
+        mMixer->removeTrack(mMixerTrack);
+    }
+    delete mRing;
+    free(mWriterPeriod);
+}
+
+status_t AudioStreamOutALSA::attachMixer(ALSAStreamMixer *mixer)
+{
+    mMixerTrack = mixer->addTrack();
+    if (mMixerTrack < 0) {
+        return NO_INIT;
+    }
+    mMixer = mixer;
+    mSharedHandle = true;
+    return NO_ERROR;
 }
 
 uint32_t AudioStreamOutALSA::channels() const
@@ -74,6 +113,11 @@ status_t AudioStreamOutALSA::setVolume(float left, float right)
     float volume;
     status_t status = NO_ERROR;
 
+    if (mMixer) {
+        mMixer->setGain(mMixerTrack, (left + right) / 2);
+        return status;
+    }
+
     if(!strcmp(mHandle->useCase, SND_USE_CASE_VERB_HIFI_LOW_POWER) ||
        !strcmp(mHandle->useCase, SND_USE_CASE_MOD_PLAY_LPA)) {
         volume = (left + right) / 2;
@@ -97,30 +141,234 @@ status_t AudioStreamOutALSA::setVolume(float left, float right)
         LOGV("Avoid Software volume by returning success\n");
         return status;
     }
-    return INVALID_OPERATION;
+
+    // Everything else is scaled in write(), 16 bit and float clients only
+    if (!mParent->mSoftwareVolume ||
+        ((mClientFormat != SNDRV_PCM_FORMAT_S16_LE) &&
+         (mClientFormat != SNDRV_PCM_FORMAT_FLOAT_LE))) {
+        return INVALID_OPERATION;
+    }
+
+    left = left < 0.0f ? 0.0f : (left > 1.0f ? 1.0f : left);
+    right = right < 0.0f ? 0.0f : (right > 1.0f ? 1.0f : right);
+
+    Mutex::Autolock autoLock(mVolumeLock);
+    mSoftwareVolume = true;
+    if ((left != mVolumeTarget[0]) || (right != mVolumeTarget[1])) {
+        LOGV("setVolume(%f, %f) ramping from (%f, %f)", left, right, mVolume[0], mVolume[1]);
+        mVolumeTarget[0] = left;
+        mVolumeTarget[1] = right;
+        mVolumeRampFrames = VOLUME_RAMP_MS * mHandle->sampleRate / 1000;
+    }
+    return status;
+}
+
+//
+// Scale frames at the PCM rate by the stream volume. Returns buffer itself
+// at unity gain, otherwise the scaled frames, written in place when buffer
+// is our own resampler output.
+//
+const void *AudioStreamOutALSA::applyVolume(const void *buffer, size_t frames)
+{
+    size_t ramp = 0;
+    void *dst;
+    bool s16 = (mClientFormat == SNDRV_PCM_FORMAT_S16_LE);
+
+    Mutex::Autolock autoLock(mVolumeLock);
+    if (!mVolumeRampFrames && (mVolume[0] == 1.0f) && (mVolume[1] == 1.0f)) {
+        return buffer;
+    }
+
+    if (buffer == mResampleBuffer) {
+        dst = mResampleBuffer;
+    } else if (resizeVolumeBuffer(frames * clientFrameSize()) == NO_ERROR) {
+        dst = mVolumeBuffer;
+    } else {
+        return buffer;
+    }
+
+    if (mVolumeRampFrames) {
+        float stepLeft = (mVolumeTarget[0] - mVolume[0]) / mVolumeRampFrames;
+        float stepRight = (mVolumeTarget[1] - mVolume[1]) / mVolumeRampFrames;
+
+        ramp = frames < mVolumeRampFrames ? frames : mVolumeRampFrames;
+        if (s16) {
+            volume_ramp_s16((int16_t *)dst, (const int16_t *)buffer, ramp, mClientChannels,
+                            mVolume[0], mVolume[1], stepLeft, stepRight);
+        } else {
+            volume_ramp_float((float *)dst, (const float *)buffer, ramp, mClientChannels,
+                              mVolume[0], mVolume[1], stepLeft, stepRight);
+        }
+        mVolumeRampFrames -= ramp;
+        if (mVolumeRampFrames) {
+            mVolume[0] += stepLeft * ramp;
+            mVolume[1] += stepRight * ramp;
+        } else {
+            mVolume[0] = mVolumeTarget[0];
+            mVolume[1] = mVolumeTarget[1];
+        }
+    }
+
+    if (ramp < frames) {
+        size_t offset = ramp * mClientChannels;
+        if ((mVolume[0] == 1.0f) && (mVolume[1] == 1.0f)) {
+            // Ramped back up to unity, which Q15 cannot represent
+            memmove((char *)dst + ramp * clientFrameSize(),
+                    (const char *)buffer + ramp * clientFrameSize(),
+                    (frames - ramp) * clientFrameSize());
+        } else if (s16) {
+            volume_s16((int16_t *)dst + offset, (const int16_t *)buffer + offset,
+                       frames - ramp, mClientChannels, mVolume[0], mVolume[1]);
+        } else {
+            volume_float((float *)dst + offset, (const float *)buffer + offset,
+                         frames - ramp, mClientChannels, mVolume[0], mVolume[1]);
+        }
+    }
+    return dst;
 }
 
 ssize_t AudioStreamOutALSA::write(const void *buffer, size_t bytes)
 {
-    int period_size;
-    char *use_case;
+    size_t frames = bytes / clientFrameSize();
+    ssize_t n;
 
     LOGV("write:: buffer %p, bytes %d", buffer, bytes);
+    if (mResampler) {
+        size_t outFrames = mResampler->outputFramesFor(frames);
+
+        if (resizeResampleBuffer(outFrames * clientFrameSize()) != NO_ERROR) {
+            return 0;
+        }
+        outFrames = mResampler->resample((const int16_t *)buffer, &frames,
+                                         mResampleBuffer, outFrames);
+        if (outFrames) {
+            n = writeFrames(mResampleBuffer, outFrames);
+            if (n < 0) {
+                return n;
+            }
+        }
+        return frames * clientFrameSize();
+    }
+
+    n = writeFrames(buffer, frames);
+    if (n < 0) {
+        return n;
+    }
+    return n * clientFrameSize();
+}
+
+//
+// Convert client frames to the channels and format taken below this
+// stream, the PCM's or 16 bit for the software mixer. Returns frames
+// written.
+//
+ssize_t AudioStreamOutALSA::writeFrames(const void *buffer, size_t frames)
+{
+    snd_pcm_format_t pcmFormat = mMixer ? SNDRV_PCM_FORMAT_S16_LE : mHandle->format;
+    size_t samples = frames * mHandle->channels;
+    size_t pcmFrameSize = mHandle->channels * pcm_format_bytes(pcmFormat);
+    ssize_t n;
+
+    if (mSoftwareVolume) {
+        buffer = applyVolume(buffer, frames);
+    }
+
+    if (mRemix) {
+        if (resizeRemixBuffer(samples * sizeof(int16_t)) != NO_ERROR) {
+            return 0;
+        }
+        remixFrames(mRemixBuffer, (const int16_t *)buffer, frames);
+        buffer = mRemixBuffer;
+    }
+
+    if (mClientFormat != pcmFormat) {
+        if (resizeConvertBuffer(samples * pcm_format_bytes(pcmFormat)) != NO_ERROR) {
+            return 0;
+        }
+        convert_pcm(mConvertBuffer, pcmFormat, buffer, mClientFormat, samples);
+        buffer = mConvertBuffer;
+    }
+
+    n = writeStream(buffer, frames * pcmFrameSize);
+    if (n < 0) {
+        return n;
+    }
+    return n / pcmFrameSize;
+}
+
+//
+// Write at the PCM rate, either to the mixer, the writer thread or the
+// PCM itself
+//
+ssize_t AudioStreamOutALSA::writeStream(const void *buffer, size_t bytes)
+{
+    if (mMixer) {
+        return mMixer->write(mMixerTrack, buffer, bytes);
+    }
+
+    if (mStandbyPending) {
+        mParent->cancelStandby(this);
+        mStandbyPending = false;
+    }
+
     if (!mPowerLock) {
         acquire_wake_lock (PARTIAL_WAKE_LOCK, "AudioOutLock");
         mPowerLock = true;
     }
 
-    snd_pcm_sframes_t n;
-    size_t            sent = 0;
-    status_t          err;
+    if (mParent->mOutputWriterThread &&
+        ((!strncmp(mHandle->useCase, SND_USE_CASE_VERB_HIFI, strlen(SND_USE_CASE_VERB_HIFI))) ||
+         (!strncmp(mHandle->useCase, SND_USE_CASE_MOD_PLAY_MUSIC, strlen(SND_USE_CASE_MOD_PLAY_MUSIC))))) {
+        return writeToRing(buffer, bytes);
+    }
+
+    if (exitStandby() != NO_ERROR) {
+        discard(bytes);
+        return bytes;
+    }
 
-    int write_pending = bytes;
+    return writeToDevice(buffer, bytes);
+}
+
+//
+// Drop data the device could not take, at the rate the device would have
+// consumed it, so the mixer thread keeps its timing while the hardware
+// is down instead of spinning on write().
+//
+void AudioStreamOutALSA::discard(size_t bytes)
+{
+    mStagingBytes = 0;
+    mHandle->lock.lock();
+    mFramesWritten += bytes / frameSize();
+    mHandle->lock.unlock();
+    emulateTime(bytes);
+}
+
+//
+// Bring the route, the UCM verb/modifier and the PCM back up after standby.
+// Nothing to do if the PCM is already open.
+//
+status_t AudioStreamOutALSA::exitStandby()
+{
+    char *use_case;
+    status_t          err;
+    Mutex::Autolock autoLock(mHandle->lock);
+
+    // A paused PCM only needs its DMA resumed, the frames it kept play
+    // first. If that fails they are dropped like a prepared PCM's.
+    if (mHandle->handle && (mHandle->state == ALSA_STATE_PAUSED) &&
+        (mHandle->module->setState(mHandle, ALSA_STATE_RUNNING) != NO_ERROR)) {
+        dropPaused();
+        mHandle->module->setState(mHandle, ALSA_STATE_PREPARED);
+    }
 
     if((mHandle->handle == NULL) && (mHandle->rxHandle == NULL) &&
          (strcmp(mHandle->useCase, SND_USE_CASE_VERB_IP_VOICECALL)) &&
          (strcmp(mHandle->useCase, SND_USE_CASE_MOD_PLAY_VOIP))) {
-        mParent->mLock.lock();
+        if (!recoveryAllowed()) {
+            return NO_INIT;
+        }
+        mParent->mRoutingLock.lock();
         snd_use_case_get(mHandle->ucMgr, "_verb", (const char **)&use_case);
         if ((use_case == NULL) || (!strcmp(use_case, SND_USE_CASE_VERB_INACTIVE))) {
             if(!strcmp(mHandle->useCase, SND_USE_CASE_VERB_IP_VOICECALL)){
@@ -155,57 +403,267 @@ ssize_t AudioStreamOutALSA::write(const void *buffer, size_t bytes)
         }
         else
              mHandle->module->open(mHandle);
+        reopened();
         if(mHandle->handle == NULL) {
             LOGE("write:: device open failed");
-            mParent->mLock.unlock();
-            return 0;
+            mParent->mRoutingLock.unlock();
+            recoveryFailed();
+            return NO_INIT;
+        }
+        mParent->mRoutingLock.unlock();
+    }
+
+    return NO_ERROR;
+}
+
+//
+// Only whole periods are handed to the driver. A trailing partial period is
+// kept in mStaging and completed by the next call, so the caller may use
+// any frame count.
+//
+ssize_t AudioStreamOutALSA::writeToDevice(const void *buffer, size_t bytes)
+{
+    const char *src = (const char *)buffer;
+    size_t period_size = mHandle->periodSize;
+    size_t consumed = 0;
+    size_t n;
+
+    if (resizeStaging(period_size) != NO_ERROR) {
+        return 0;
+    }
+    if (mStagingBytes >= period_size) {
+        // The period shrank across a reopen, the old remainder is stale
+        mStagingBytes = 0;
+    }
+
+    if (mStagingBytes) {
+        n = period_size - mStagingBytes;
+        if (n > bytes)
+            n = bytes;
+        memcpy(mStaging + mStagingBytes, src, n);
+        mStagingBytes += n;
+        consumed += n;
+        if (mStagingBytes < period_size) {
+            return consumed;
+        }
+        mStagingBytes = 0;
+        if (writePeriod(mStaging) != NO_ERROR) {
+            discard(period_size + bytes - consumed);
+            return bytes;
         }
-        mParent->mLock.unlock();
     }
 
-    period_size = mHandle->periodSize;
-    do {
-        if (write_pending < period_size) {
-            write_pending = period_size;
+    while (bytes - consumed >= period_size) {
+        if (writePeriod(src + consumed) != NO_ERROR) {
+            discard(bytes - consumed);
+            return bytes;
         }
+        consumed += period_size;
+    }
+
+    if (consumed < bytes) {
+        memcpy(mStaging, src + consumed, bytes - consumed);
+        mStagingBytes = bytes - consumed;
+        consumed = bytes;
+    }
+
+    return consumed;
+}
+
+status_t AudioStreamOutALSA::writePeriod(const char *buffer)
+{
+    int period_size = mHandle->periodSize;
+    snd_pcm_sframes_t n = -EBADFD;
+    status_t err;
+    Mutex::Autolock autoLock(mHandle->lock);
+
+    if (!recoveryAllowed()) {
+        return INVALID_OPERATION;
+    }
+
+    while (mHandle->handle || (mHandle->rxHandle && mParent->mVoipStreamCount)) {
+        struct pcm *pcm = NULL;
         if((mParent->mVoipStreamCount) && (mHandle->rxHandle != 0)) {
-            n = pcm_write(mHandle->rxHandle,
-                     (char *)buffer + sent,
-                      period_size);
+            pcm = mHandle->rxHandle;
+            n = pcm_write(pcm, (void *)buffer, period_size);
         } else if (mHandle->handle != 0){
-            n = pcm_write(mHandle->handle,
-                     (char *)buffer + sent,
-                      period_size);
+            pcm = mHandle->handle;
+            if (pcm->flags & PCM_MMAP) {
+                n = mHandle->module->mmapWrite(mHandle, buffer, period_size);
+            } else {
+                n = pcm_write(pcm, (void *)buffer, period_size);
+            }
         }
         if (n < 0) {
-	    mParent->mLock.lock();
-            LOGE("pcm_write returned error %d, trying to recover\n", n);
-            pcm_close(mHandle->handle);
-            mHandle->handle = NULL;
-            if((!strncmp(mHandle->useCase, SND_USE_CASE_VERB_IP_VOICECALL, strlen(SND_USE_CASE_VERB_IP_VOICECALL))) ||
-              (!strncmp(mHandle->useCase, SND_USE_CASE_MOD_PLAY_VOIP, strlen(SND_USE_CASE_MOD_PLAY_VOIP)))) {
-                 pcm_close(mHandle->rxHandle);
-                 mHandle->rxHandle = NULL;
-                 mHandle->module->startVoipCall(mHandle);
+            LOGE("pcm_write returned error %d, trying to recover\n", (int)n);
+            err = recover(pcm, n);
+            if (err != NO_ERROR) {
+                return err;
             }
-            else
-            mHandle->module->open(mHandle);
-            mParent->mLock.unlock();
             continue;
         }
-        else {
-            mFrameCount += n;
-            sent += static_cast<ssize_t>((period_size));
-            write_pending -= period_size;
+        recoverySucceeded();
+        mHandle->state = ALSA_STATE_RUNNING;
+        mFramesWritten += period_size / frameSize();
+        return NO_ERROR;
+    }
+
+    return NO_INIT;
+}
+
+//
+// Writer thread mode: the caller only copies into mRing, the SCHED_FIFO
+// drain thread owns the PCM and is the only one which blocks in pcm_write
+// or on the routing lock for recovery. Bring-up after standby still happens
+// here so the ring can be sized from the negotiated period.
+//
+ssize_t AudioStreamOutALSA::writeToRing(const void *buffer, size_t bytes)
+{
+    size_t written = 0;
+
+    if (!mWriterRunning) {
+        if (exitStandby() != NO_ERROR) {
+            discard(bytes);
+            return bytes;
+        }
+        if (startWriter() != NO_ERROR) {
+            return writeToDevice(buffer, bytes);
         }
+    }
 
-    } while ((mHandle->handle||(mHandle->rxHandle && mParent->mVoipStreamCount)) && sent < bytes);
+    while (written < bytes) {
+        size_t n = mRing->write((const char *)buffer + written, bytes - written);
+        Mutex::Autolock autoLock(mWriterLock);
+        if (n) {
+            written += n;
+            mWriterCond.broadcast();
+        } else {
+            // Ring is full, wait for the drain thread to consume a period
+            mWriterCond.waitRelative(mWriterLock, WRITER_WAIT_TIMEOUT_NS);
+        }
+    }
 
-    return sent;
+    return written;
+}
+
+//
+// Everything the drain thread needs is allocated here, so a failure leaves
+// writeToRing() on the direct write path instead of a thread which never
+// drains the ring.
+//
+status_t AudioStreamOutALSA::startWriter()
+{
+    size_t ringSize = mHandle->periodSize * WRITER_RING_PERIODS;
+    char *period;
+
+    if (!mRing || mRing->size() < ringSize) {
+        delete mRing;
+        mRing = new ALSARingBuffer(ringSize);
+    }
+    if (!mRing->initCheck()) {
+        LOGE("startWriter: failed to allocate ring");
+        delete mRing;
+        mRing = NULL;
+        return NO_MEMORY;
+    }
+    mRing->reset();
+
+    period = (char *) realloc(mWriterPeriod, mHandle->periodSize);
+    if (!period) {
+        LOGE("startWriter: failed to allocate period buffer");
+        return NO_MEMORY;
+    }
+    mWriterPeriod = period;
+
+    android_atomic_release_store(0, &mWriterExit);
+    if (pthread_create(&mWriterThread, NULL, writerThreadWrapper, this)) {
+        LOGE("startWriter: failed to create writer thread");
+        return NO_INIT;
+    }
+    mWriterRunning = true;
+    return NO_ERROR;
+}
+
+// Lets the drain thread play out what is queued, then joins it.
+void AudioStreamOutALSA::stopWriter()
+{
+    if (!mWriterRunning)
+        return;
+
+    mWriterLock.lock();
+    android_atomic_release_store(1, &mWriterExit);
+    mWriterCond.broadcast();
+    mWriterLock.unlock();
+
+    pthread_join(mWriterThread, NULL);
+    mWriterRunning = false;
+}
+
+void *AudioStreamOutALSA::writerThreadWrapper(void *me)
+{
+    static_cast<AudioStreamOutALSA *>(me)->writerThreadLoop();
+    return NULL;
+}
+
+void AudioStreamOutALSA::writerThreadLoop()
+{
+    struct sched_param param;
+    size_t period_size = mHandle->periodSize;
+    char *period = mWriterPeriod;
+
+    param.sched_priority = WRITER_THREAD_PRIORITY;
+    if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &param)) {
+        LOGW("writer thread: SCHED_FIFO not permitted, using urgent audio priority");
+        androidSetThreadPriority(0, ANDROID_PRIORITY_URGENT_AUDIO);
+    }
+
+    for (;;) {
+        size_t avail = mRing->availableToRead();
+        bool exiting = android_atomic_acquire_load(&mWriterExit);
+
+        if (avail < period_size) {
+            if (exiting) {
+                if (avail) {
+                    // Pad the last partial period with silence
+                    memset(period, 0, period_size);
+                    mRing->read(period, avail);
+                    if (exitStandby() == NO_ERROR)
+                        writeToDevice(period, period_size);
+                    else
+                        discard(period_size);
+                }
+                break;
+            }
+            Mutex::Autolock autoLock(mWriterLock);
+            if (mRing->availableToRead() < period_size &&
+                !android_atomic_acquire_load(&mWriterExit)) {
+                mWriterCond.waitRelative(mWriterLock, WRITER_WAIT_TIMEOUT_NS);
+            }
+            continue;
+        }
+
+        mRing->read(period, period_size);
+        {
+            Mutex::Autolock autoLock(mWriterLock);
+            mWriterCond.broadcast();
+        }
+
+        // The PCM may have been closed by a routing change
+        if (exitStandby() != NO_ERROR) {
+            discard(period_size);
+            continue;
+        }
+        writeToDevice(period, period_size);
+    }
 }
 
 status_t AudioStreamOutALSA::dump(int fd, const Vector<String16>& args)
 {
+    if (mMixer) {
+        mMixer->dump(fd);
+        return NO_ERROR;
+    }
+    dumpRecovery(fd);
     return NO_ERROR;
 }
 
@@ -218,6 +676,17 @@ status_t AudioStreamOutALSA::open(int mode)
 
 status_t AudioStreamOutALSA::close()
 {
+    if (mMixer) {
+        return NO_ERROR;
+    }
+
+    stopWriter();
+
+    if (mStandbyPending) {
+        mParent->cancelStandby(this);
+        mStandbyPending = false;
+    }
+
     Mutex::Autolock autoLock(mParent->mLock);
 
 
@@ -243,41 +712,228 @@ status_t AudioStreamOutALSA::close()
 
 status_t AudioStreamOutALSA::standby()
 {
-    Mutex::Autolock autoLock(mParent->mLock);
+    bool deferred = false;
+
+    if (mResampler) {
+        mResampler->reset();
+    }
+
+    if (mMixer) {
+        mMixer->standby(mMixerTrack);
+        return NO_ERROR;
+    }
+
+    stopWriter();
+
+    mHandle->lock.lock();
+    mParent->mRoutingLock.lock();
 
      if((!strcmp(mHandle->useCase, SND_USE_CASE_VERB_IP_VOICECALL)) ||
        (!strcmp(mHandle->useCase, SND_USE_CASE_MOD_PLAY_VOIP))) {
+         mParent->mRoutingLock.unlock();
+         mHandle->lock.unlock();
          return NO_ERROR;
      }
 
     LOGD("standby");
 
-    mHandle->module->standby(mHandle);
+    // A partial period left staged by the last write() was never handed
+    // to the driver, it is dropped.
+    mStagingBytes = 0;
+    mStandbyFrames = mFramesWritten - queuedFrames();
+
+    // Within the grace period the PCM is only paused, or where the front
+    // end cannot pause, dropped to prepared. A write soon after then does
+    // not pay for the route, the verb and the reopen again.
+    if (mParent->mStandbyDelayMs && mHandle->handle &&
+        strcmp(mHandle->useCase, SND_USE_CASE_VERB_HIFI_LOW_POWER) &&
+        strcmp(mHandle->useCase, SND_USE_CASE_MOD_PLAY_LPA)) {
+        deferred = (mHandle->module->setState(mHandle, ALSA_STATE_PAUSED) == NO_ERROR) ||
+                   (mHandle->module->setState(mHandle, ALSA_STATE_PREPARED) == NO_ERROR);
+    }
+    if (!deferred) {
+        mHandle->module->standby(mHandle);
+    }
+    // Frames still queued in the DMA buffer are discarded by the drop or
+    // the close, they never reach the DAC. A paused PCM keeps them.
+    if (mHandle->state != ALSA_STATE_PAUSED) {
+        mFramesWritten = mStandbyFrames;
+    }
 
     if (mPowerLock) {
         release_wake_lock ("AudioOutLock");
         mPowerLock = false;
     }
 
-    mFrameCount = 0;
+    mParent->mRoutingLock.unlock();
+    mHandle->lock.unlock();
+
+    if (deferred) {
+        if (mParent->scheduleStandby(this) == NO_ERROR) {
+            mStandbyPending = true;
+        } else {
+            closeStandby();
+        }
+    }
 
     return NO_ERROR;
 }
 
+void AudioStreamOutALSA::closeStandby()
+{
+    Mutex::Autolock handleLock(mHandle->lock);
+    Mutex::Autolock routingLock(mParent->mRoutingLock);
+
+    LOGD("closeStandby: grace period over");
+    if (mHandle->state == ALSA_STATE_PAUSED) {
+        dropPaused();
+    }
+    mHandle->module->standby(mHandle);
+}
+
+//
+// Frames handed to the driver which have not reached the DAC yet, at
+// most mFramesWritten. Caller holds mHandle->lock.
+//
+uint64_t AudioStreamOutALSA::queuedFrames()
+{
+    snd_pcm_sframes_t delay;
+    struct timespec timestamp;
+
+    if (!mHandle->handle ||
+        (mHandle->module->getDelay(mHandle->handle, &delay, &timestamp) != NO_ERROR) ||
+        (delay <= 0)) {
+        return 0;
+    }
+    return (uint64_t)delay < mFramesWritten ? (uint64_t)delay : mFramesWritten;
+}
+
+//
+// The frames a paused PCM kept are about to be dropped after all, take
+// them back out of mFramesWritten. Caller holds mHandle->lock.
+//
+void AudioStreamOutALSA::dropPaused()
+{
+    mFramesWritten -= queuedFrames();
+}
+
 #define USEC_TO_MSEC(x) ((x + 999) / 1000)
 
 uint32_t AudioStreamOutALSA::latency() const
 {
+    // The PCM ring as negotiated by setHardwareParams(), whatever is
+    // buffered ahead of it in the HAL and the DSP delay of the route
+    uint32_t latency = mHandle->latency;
+
+    if (mMixer) {
+        latency += mMixer->latency();
+    }
+    if (mRing && mHandle->sampleRate) {
+        latency += (uint32_t)((uint64_t)mRing->size() / frameSize() *
+                              1000000 / mHandle->sampleRate);
+    }
+    latency += mParent->routeLatency(mHandle->devices);
+
     // Android wants latency in milliseconds.
-    return USEC_TO_MSEC (mHandle->latency);
+    return USEC_TO_MSEC (latency);
 }
 
 // return the number of audio frames written by the audio dsp to DAC since
 // the output has exited standby
 status_t AudioStreamOutALSA::getRenderPosition(uint32_t *dspFrames)
 {
-    *dspFrames = mFrameCount;
+    uint64_t frames;
+    uint64_t standbyFrames;
+    struct timespec timestamp;
+
+    mHandle->lock.lock();
+    standbyFrames = mStandbyFrames;
+    mHandle->lock.unlock();
+
+    if (getPresentationPosition(&frames, &timestamp) != NO_ERROR) {
+        frames = standbyFrames;
+    }
+    *dspFrames = (uint32_t)(frames - standbyFrames);
     return NO_ERROR;
 }
 
+//
+// The position is what was handed to the driver minus what the kernel
+// reports as still queued (SNDRV_PCM_IOCTL_DELAY, which includes the
+// delay the DSP driver reports), so it tracks the DAC rather than
+// pcm_write(). The handle lock keeps the PCM from being closed under the
+// query and pairs mFramesWritten with it.
+//
+status_t AudioStreamOutALSA::getPresentationPosition(uint64_t *frames,
+                                                     struct timespec *timestamp)
+{
+    snd_pcm_sframes_t delay = 0;
+    status_t err;
+
+    if (mMixer) {
+        err = mMixer->getPresentationPosition(mMixerTrack, frames, timestamp);
+    } else {
+        Mutex::Autolock autoLock(mHandle->lock);
+        struct pcm *pcm = mHandle->rxHandle ? mHandle->rxHandle : mHandle->handle;
+        uint64_t written = mFramesWritten;
+
+        if (!pcm) {
+            // In standby nothing is queued
+            *frames = written;
+            clock_gettime(CLOCK_MONOTONIC, timestamp);
+            err = NO_ERROR;
+        } else {
+            err = mHandle->module->getDelay(pcm, &delay, timestamp);
+            if (err == NO_ERROR) {
+                if (delay < 0) {
+                    delay = 0;
+                } else if ((uint64_t)delay > written) {
+                    delay = written;
+                }
+                *frames = written - delay;
+            }
+        }
+    }
+
+    // Report in client frames
+    if ((err == NO_ERROR) && mResampler) {
+        *frames = *frames * mClientRate / mHandle->sampleRate;
+    }
+    return err;
+}
+
+status_t AudioStreamOutALSA::setParameters(const String8& keyValuePairs)
+{
+    status_t status = ALSAStreamOps::setParameters(keyValuePairs);
+
+    if (mMixer) {
+        mMixer->setDevices(mDevices);
+    }
+    return status;
+}
+
+String8 AudioStreamOutALSA::getParameters(const String8& keys)
+{
+    AudioParameter param = AudioParameter(keys);
+    String8 key = String8(PRESENTATION_POSITION_KEY);
+    String8 value;
+    uint64_t frames;
+    struct timespec timestamp;
+
+    if (param.get(key, value) == NO_ERROR) {
+        param.remove(key);
+        if (getPresentationPosition(&frames, &timestamp) == NO_ERROR) {
+            char position[64];
+            snprintf(position, sizeof(position), "%llu,%ld,%ld",
+                     (unsigned long long)frames, (long)timestamp.tv_sec,
+                     (long)timestamp.tv_nsec);
+            AudioParameter result = AudioParameter(ALSAStreamOps::getParameters(param.toString()));
+            result.add(key, String8(position));
+            return result.toString();
+        }
+    }
+
+    return ALSAStreamOps::getParameters(param.toString());
+}
+
 }       // namespace android_audio_legacy
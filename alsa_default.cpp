@@ -22,6 +22,8 @@
 #include <utils/Log.h>
 #include <cutils/properties.h>
 #include <linux/ioctl.h>
+#include <poll.h>
+#include <time.h>
 #include "AudioHardwareALSA.h"
 #include <media/AudioRecord.h>
 
@@ -30,6 +32,7 @@
 #endif
 
 #define BTSCO_RATE_16KHZ 16000
+#define MMAP_POLL_TIMEOUT_MS 1000
 
 namespace android_audio_legacy
 {
@@ -40,7 +43,11 @@ static status_t s_init(alsa_device_t *, ALSAHandleList &);
 static status_t s_open(alsa_handle_t *);
 static status_t s_close(alsa_handle_t *);
 static status_t s_standby(alsa_handle_t *);
+static status_t s_set_state(alsa_handle_t *, int);
 static status_t s_route(alsa_handle_t *, uint32_t, int);
+static status_t s_mmap_write(alsa_handle_t *, const void *, size_t);
+static status_t s_mmap_read(alsa_handle_t *, void *, size_t);
+static status_t s_get_delay(struct pcm *, snd_pcm_sframes_t *, struct timespec *);
 static status_t s_start_voice_call(alsa_handle_t *);
 static status_t s_start_voip_call(alsa_handle_t *);
 static status_t s_start_fm(alsa_handle_t *);
@@ -63,6 +70,7 @@ static int fmVolume;
 static uint32_t mDevSettingsFlag = TTY_OFF;
 static int btsco_samplerate = 8000;
 static bool pflag = false; // flag to check pcm close
+static bool mmapPlayback = false; // map the DMA ring for HiFi playback
  
 static hw_module_methods_t s_module_methods = {
     open            : s_device_open
@@ -99,7 +107,11 @@ static int s_device_open(const hw_module_t* module, const char* name,
     dev->open = s_open;
     dev->close = s_close;
     dev->route = s_route;
+    dev->mmapWrite = s_mmap_write;
+    dev->mmapRead = s_mmap_read;
+    dev->getDelay = s_get_delay;
     dev->standby = s_standby;
+    dev->setState = s_set_state;
     dev->startVoiceCall = s_start_voice_call;
     dev->startVoipCall = s_start_voip_call;
     dev->startFm = s_start_fm;
@@ -124,6 +136,8 @@ static int s_device_open(const hw_module_t* module, const char* name,
     } else {
         fluence_mode = FLUENCE_MODE_ENDFIRE;
     }
+    property_get("audio.playback.mmap",value,"0");
+    mmapPlayback = (!strcmp("1", value) || !strcmp("true", value));
     strlcpy(curRxUCMDevice, "None", sizeof(curRxUCMDevice));
     strlcpy(curTxUCMDevice, "None", sizeof(curTxUCMDevice));
     LOGD("ALSA module opened");
@@ -164,6 +178,75 @@ int deviceName(alsa_handle_t *handle, unsigned flags, char **value)
     return ret;
 }
 
+//
+// The HDMI back end is configured for its channel count separately from
+// the front end PCM, match it to what the PCM negotiated
+//
+static void setHdmiChannels(unsigned int channels)
+{
+    static const char *names[] = {
+        "Two", "Three", "Four", "Five", "Six", "Seven", "Eight"
+    };
+    ALSAControl control("/dev/snd/controlC0");
+
+    if (channels < 2 || channels > 8)
+        channels = 2;
+    if (control.set("HDMI_RX Channels", names[channels - 2]) != NO_ERROR) {
+        LOGW("setHdmiChannels: could not set %d channels", channels);
+    }
+}
+
+// Bytes one sample of the PCM format takes in memory
+static unsigned int sampleBytes(snd_pcm_format_t format)
+{
+    switch(format) {
+        case SNDRV_PCM_FORMAT_S8:
+            return 1;
+        case SNDRV_PCM_FORMAT_S24_3LE:
+            return 3;
+        case SNDRV_PCM_FORMAT_S24_LE:
+        case SNDRV_PCM_FORMAT_S32_LE:
+        case SNDRV_PCM_FORMAT_FLOAT_LE:
+            return 4;
+        default:
+            return 2;
+    }
+}
+
+static unsigned int frameBytes(alsa_handle_t *handle)
+{
+    return handle->channels * sampleBytes(handle->format);
+}
+
+#define PCM_CHANNEL_FLAGS   (PCM_MONO | PCM_STEREO | PCM_QUAD | PCM_5POINT1)
+
+static int channelFlags(unsigned int channels)
+{
+    switch(channels) {
+        case 1:
+            return PCM_MONO;
+        case 4:
+            return PCM_QUAD;
+        case 6:
+            return PCM_5POINT1;
+        default:
+            return PCM_STEREO;
+    }
+}
+
+//
+// pcm_write() and pcm_read() count frames from the channel flags at 2
+// bytes per sample. Any other format or channel count has to go through
+// the mapped ring, which s_mmap_write() and s_mmap_read() size with
+// frameBytes().
+//
+static bool rwSizable(alsa_handle_t *handle)
+{
+    return (handle->format == SNDRV_PCM_FORMAT_S16_LE) &&
+           ((handle->channels == 1) || (handle->channels == 2) ||
+            (handle->channels == 4) || (handle->channels == 6));
+}
+
 status_t setHardwareParams(alsa_handle_t *handle)
 {
     struct snd_pcm_hw_params *params;
@@ -183,28 +266,56 @@ status_t setHardwareParams(alsa_handle_t *handle)
     LOGD("setHardwareParams: reqBuffSize %d channels %d sampleRate %d",
          (int) reqBuffSize, handle->channels, handle->sampleRate);
 
-    param_init(params);
-    param_set_mask(params, SNDRV_PCM_HW_PARAM_ACCESS,
-                   SNDRV_PCM_ACCESS_RW_INTERLEAVED);
-    param_set_mask(params, SNDRV_PCM_HW_PARAM_FORMAT,
-                   SNDRV_PCM_FORMAT_S16_LE);
-    param_set_mask(params, SNDRV_PCM_HW_PARAM_SUBFORMAT,
-                   SNDRV_PCM_SUBFORMAT_STD);
-    param_set_min(params, SNDRV_PCM_HW_PARAM_PERIOD_BYTES, reqBuffSize);
-    param_set_int(params, SNDRV_PCM_HW_PARAM_SAMPLE_BITS, 16);
-    param_set_int(params, SNDRV_PCM_HW_PARAM_FRAME_BITS,
-                   handle->channels - 1 ? 32 : 16);
-    param_set_int(params, SNDRV_PCM_HW_PARAM_CHANNELS,
-                  handle->channels);
-    param_set_int(params, SNDRV_PCM_HW_PARAM_RATE, handle->sampleRate);
-    param_set_hw_refine(handle->handle, params);
-
-    if (param_set_hw_params(handle->handle, params)) {
-        LOGE("cannot set hw params");
-        return NO_INIT;
+    for (;;) {
+        param_init(params);
+        param_set_mask(params, SNDRV_PCM_HW_PARAM_ACCESS,
+                       (handle->handle->flags & PCM_MMAP) ?
+                       SNDRV_PCM_ACCESS_MMAP_INTERLEAVED :
+                       SNDRV_PCM_ACCESS_RW_INTERLEAVED);
+        param_set_mask(params, SNDRV_PCM_HW_PARAM_FORMAT,
+                       handle->format);
+        param_set_mask(params, SNDRV_PCM_HW_PARAM_SUBFORMAT,
+                       SNDRV_PCM_SUBFORMAT_STD);
+        param_set_min(params, SNDRV_PCM_HW_PARAM_PERIOD_BYTES, reqBuffSize);
+        if (handle->config && handle->config->periodCount) {
+            // Smallest period the front end takes at or above the request,
+            // in as many periods as the profile asks for
+            param_set_int(params, SNDRV_PCM_HW_PARAM_PERIODS, handle->config->periodCount);
+        }
+        param_set_int(params, SNDRV_PCM_HW_PARAM_SAMPLE_BITS,
+                      sampleBytes(handle->format) * 8);
+        param_set_int(params, SNDRV_PCM_HW_PARAM_FRAME_BITS,
+                      frameBytes(handle) * 8);
+        param_set_int(params, SNDRV_PCM_HW_PARAM_CHANNELS,
+                      handle->channels);
+        param_set_int(params, SNDRV_PCM_HW_PARAM_RATE, handle->sampleRate);
+        param_set_hw_refine(handle->handle, params);
+
+        if (!param_set_hw_params(handle->handle, params))
+            break;
+
+        // Not every back end takes more than 16 bit or stereo, step down
+        // and let the stream convert to whatever the PCM ends up with.
+        // The period keeps its duration.
+        if (handle->format != SNDRV_PCM_FORMAT_S16_LE) {
+            LOGW("setHardwareParams: format %d rejected, falling back to S16_LE",
+                 handle->format);
+            reqBuffSize = reqBuffSize / sampleBytes(handle->format) * 2;
+            handle->format = SNDRV_PCM_FORMAT_S16_LE;
+        } else if (handle->channels > 2) {
+            unsigned int channels = handle->channels > 6 ? 6 : 2;
+            LOGW("setHardwareParams: %d channels rejected, trying %d",
+                 handle->channels, channels);
+            reqBuffSize = reqBuffSize / handle->channels * channels;
+            handle->channels = channels;
+        } else {
+            LOGE("cannot set hw params");
+            return NO_INIT;
+        }
     }
     param_dump(params);
 
+    handle->canPause = (params->info & SNDRV_PCM_INFO_PAUSE) != 0;
     handle->handle->buffer_size = pcm_buffer_size(params);
     handle->handle->period_size = pcm_period_size(params);
     handle->handle->period_cnt = handle->handle->buffer_size/handle->handle->period_size;
@@ -213,8 +324,17 @@ status_t setHardwareParams(alsa_handle_t *handle)
         handle->handle->period_cnt);
     handle->handle->rate = handle->sampleRate;
     handle->handle->channels = handle->channels;
+    // The PCM may have stepped down from what it was opened for
+    handle->handle->flags = (handle->handle->flags & ~PCM_CHANNEL_FLAGS) |
+                            channelFlags(handle->channels);
     handle->periodSize = handle->handle->period_size;
     handle->bufferSize = handle->handle->period_size;
+    // A full ring is queued ahead of the DAC once the stream is running,
+    // the per-route DSP delay is added on top by the HAL
+    handle->latency = (unsigned int)(((uint64_t)handle->handle->buffer_size * 1000000) /
+                      (frameBytes(handle) * handle->sampleRate));
+    LOGD("setHardwareParams: profile %d latency %u us", handle->profile,
+         handle->latency);
     return NO_ERROR;
 }
 
@@ -234,7 +354,18 @@ status_t setSoftwareParams(alsa_handle_t *handle)
     // Get the current software parameters
     params->tstamp_mode = SNDRV_PCM_TSTAMP_NONE;
     params->period_step = 1;
-    if(((!strcmp(handle->useCase,SND_USE_CASE_MOD_PLAY_VOIP)) ||
+    if (handle->config && handle->config->availMin) {
+         // Thresholds from the profile, in percent of the negotiated period.
+         // Stopping on underrun recovers with a prepare instead of playing
+         // stale data.
+         const alsa_profile_t *config = handle->config;
+         unsigned long periodFrames = periodSize / frameBytes(handle);
+         params->avail_min = periodFrames * config->availMin / 100;
+         params->start_threshold = periodFrames * (config->startThreshold ?
+                                   config->startThreshold : config->availMin) / 100;
+         params->stop_threshold = config->stopOnXrun ?
+                                  pcm->buffer_size / frameBytes(handle) : INT_MAX;
+     } else if(((!strcmp(handle->useCase,SND_USE_CASE_MOD_PLAY_VOIP)) ||
         (!strcmp(handle->useCase,SND_USE_CASE_VERB_IP_VOICECALL)))){
           LOGV("setparam:  start & stop threshold for Voip ");
           params->avail_min = handle->channels - 1 ? periodSize/4 : periodSize/2;
@@ -312,6 +443,7 @@ void switchDevice(alsa_handle_t *handle, uint32_t devices, uint32_t mode)
             pcm_close(handle->handle);
             handle->handle=NULL;
             handle->rxHandle=NULL;
+            handle->state = ALSA_STATE_CLOSED;
             pflag = true;
         }
     }
@@ -412,10 +544,10 @@ static status_t s_open(alsa_handle_t *handle)
     } else {
         flags = PCM_IN;
     }
-    if (handle->channels == 1) {
-        flags |= PCM_MONO;
-    } else {
-        flags |= PCM_STEREO;
+    flags |= channelFlags(handle->channels);
+    if ((mmapPlayback && !(flags & PCM_IN)) || (handle->config && handle->config->mmap) ||
+        !rwSizable(handle)) {
+        flags |= PCM_MMAP;
     }
     if (deviceName(handle, flags, &devName) < 0) {
         LOGE("Failed to get pcm device node: %s", devName);
@@ -436,9 +568,50 @@ static status_t s_open(alsa_handle_t *handle)
         err = setSoftwareParams(handle);
     }
 
+    if ((err == NO_ERROR) && (flags & PCM_MMAP) && mmap_buffer(handle->handle)) {
+        LOGE("s_open: mmap_buffer failed");
+        err = NO_INIT;
+    }
+
+    if ((err != NO_ERROR) && (flags & PCM_MMAP) && !rwSizable(handle)) {
+        LOGE("s_open: format %d with %d channels needs mmap access",
+             handle->format, handle->channels);
+    } else if ((err != NO_ERROR) && (flags & PCM_MMAP)) {
+        // The front end may not support mmap access, retry with read/write
+        LOGW("s_open: mmap setup failed, falling back to read/write");
+        pcm_close(handle->handle);
+        flags &= ~PCM_MMAP;
+        handle->handle = pcm_open(flags, (char*)devName);
+        if (!handle->handle) {
+            LOGE("s_open: Failed to initialize ALSA device '%s'", devName);
+            free(devName);
+            return NO_INIT;
+        }
+        handle->handle->flags = flags;
+        err = setHardwareParams(handle);
+        if (err == NO_ERROR) {
+            err = setSoftwareParams(handle);
+        }
+    }
+
+    // Prepared right away, so leaving standby later takes nothing but the
+    // first write. pcm_read() prepares capture itself, a mapped capture
+    // ring is only started by s_mmap_read().
+    if ((err == NO_ERROR) && (!(flags & PCM_IN) || (flags & PCM_MMAP)) &&
+        pcm_prepare(handle->handle)) {
+        LOGE("s_open: pcm_prepare failed");
+        err = NO_INIT;
+    }
+
     if(err != NO_ERROR) {
         LOGE("Set HW/SW params failed: Closing the pcm stream");
         s_standby(handle);
+    } else {
+        handle->state = ALSA_STATE_PREPARED;
+        if (!(flags & PCM_IN) &&
+            (handle->devices & AudioSystem::DEVICE_OUT_AUX_DIGITAL)) {
+            setHdmiChannels(handle->channels);
+        }
     }
 
     free(devName);
@@ -531,6 +704,7 @@ static status_t s_start_voip_call(alsa_handle_t *handle)
      /* first read required start dsp */
      memset(&voc_pkt,0,sizeof(voc_pkt));
      pcm_read(handle->handle,&voc_pkt,handle->handle->period_size);
+     handle->state = ALSA_STATE_RUNNING;
      return NO_ERROR;
 }
 
@@ -619,6 +793,7 @@ static status_t s_start_voice_call(alsa_handle_t *handle)
         goto Error;
     }
 
+    handle->state = ALSA_STATE_RUNNING;
     free(devName);
     return NO_ERROR;
 
@@ -715,6 +890,7 @@ static status_t s_start_fm(alsa_handle_t *handle)
     }
 
     s_set_fm_vol(fmVolume);
+    handle->state = ALSA_STATE_RUNNING;
     free(devName);
     return NO_ERROR;
 
@@ -777,6 +953,7 @@ static status_t s_close(alsa_handle_t *handle)
 
     h = handle->handle;
     handle->handle = 0;
+    handle->state = ALSA_STATE_CLOSED;
 
     if (h) {
           LOGV("s_close handle h %p\n", h);
@@ -816,6 +993,7 @@ static status_t s_standby(alsa_handle_t *handle)
 
     h = handle->handle;
     handle->handle = 0;
+    handle->state = ALSA_STATE_CLOSED;
 
     if (h) {
           LOGE("s_standby handle h %p\n", h);
@@ -832,6 +1010,292 @@ static status_t s_standby(alsa_handle_t *handle)
     return err;
 }
 
+/*
+    Warm standby transitions, all of them keep the PCM open with its hw/sw
+    params, the route and the UCM verb:
+      PREPARED  drop whatever is queued and prepare, the next write or
+                read restarts the DMA by itself
+      PAUSED    pause the running DMA, the queued frames are kept
+      RUNNING   resume a paused DMA, a single ioctl
+    CLOSED is a full s_standby(). Pausing needs SNDRV_PCM_INFO_PAUSE, the
+    caller falls back to PREPARED when either pause transition fails.
+*/
+static status_t s_set_state(alsa_handle_t *handle, int state)
+{
+    struct pcm *pcm = handle->handle;
+
+    if (state == ALSA_STATE_CLOSED) {
+        return s_standby(handle);
+    }
+    if (!pcm) {
+        return NO_INIT;
+    }
+    if (state == handle->state) {
+        return NO_ERROR;
+    }
+
+    switch (state) {
+    case ALSA_STATE_PREPARED:
+        if (ioctl(pcm->fd, SNDRV_PCM_IOCTL_DROP)) {
+            LOGE("s_set_state: SNDRV_PCM_IOCTL_DROP failed: %d", errno);
+            return -errno;
+        }
+        if (pcm_prepare(pcm)) {
+            LOGE("s_set_state: pcm_prepare failed");
+            return NO_INIT;
+        }
+        break;
+    case ALSA_STATE_PAUSED:
+        if ((handle->state != ALSA_STATE_RUNNING) || !handle->canPause) {
+            return INVALID_OPERATION;
+        }
+        if (ioctl(pcm->fd, SNDRV_PCM_IOCTL_PAUSE, 1)) {
+            LOGW("s_set_state: SNDRV_PCM_IOCTL_PAUSE failed: %d", errno);
+            return -errno;
+        }
+        break;
+    case ALSA_STATE_RUNNING:
+        if (handle->state != ALSA_STATE_PAUSED) {
+            return INVALID_OPERATION;
+        }
+        if (ioctl(pcm->fd, SNDRV_PCM_IOCTL_PAUSE, 0)) {
+            LOGE("s_set_state: SNDRV_PCM_IOCTL_PAUSE release failed: %d", errno);
+            return -errno;
+        }
+        break;
+    default:
+        return BAD_VALUE;
+    }
+
+    LOGD("s_set_state: handle %p %s -> %s", handle,
+         alsaStateName(handle->state), alsaStateName(state));
+    handle->state = state;
+    return NO_ERROR;
+}
+
+/*
+    Boundary of the ring pointers, computed the same way the kernel
+    does in snd_pcm_hw_params()
+*/
+static snd_pcm_uframes_t pcmBoundary(snd_pcm_uframes_t bufferFrames)
+{
+    snd_pcm_uframes_t boundary = bufferFrames;
+
+    while (boundary * 2 <= LONG_MAX - bufferFrames)
+        boundary *= 2;
+    return boundary;
+}
+
+/*
+    Copy a buffer straight into the mapped DMA ring and publish the new
+    appl_ptr through SNDRV_PCM_IOCTL_SYNC_PTR. Returns 0 or -errno like
+    pcm_write(), -EPIPE on underrun.
+*/
+static status_t s_mmap_write(alsa_handle_t *handle, const void *buffer, size_t bytes)
+{
+    struct pcm *pcm = handle->handle;
+    struct snd_pcm_sync_ptr sync;
+    struct pollfd pfd;
+    const char *src = (const char *)buffer;
+    unsigned int frameSize = frameBytes(handle);
+    snd_pcm_uframes_t bufferFrames, boundary, frames, offset, chunk;
+    snd_pcm_sframes_t avail;
+    int ret;
+
+    if (!pcm || !pcm->addr) {
+        LOGE("s_mmap_write: no mapped PCM");
+        return -EBADFD;
+    }
+
+    bufferFrames = pcm->buffer_size / frameSize;
+    boundary = pcmBoundary(bufferFrames);
+    frames = bytes / frameSize;
+
+    while (frames > 0) {
+        memset(&sync, 0, sizeof(sync));
+        sync.flags = SNDRV_PCM_SYNC_PTR_HWSYNC | SNDRV_PCM_SYNC_PTR_APPL |
+                     SNDRV_PCM_SYNC_PTR_AVAIL_MIN;
+        if (ioctl(pcm->fd, SNDRV_PCM_IOCTL_SYNC_PTR, &sync) < 0) {
+            return -errno;
+        }
+        if (sync.s.status.state == SNDRV_PCM_STATE_XRUN) {
+            return -EPIPE;
+        }
+
+        avail = sync.s.status.hw_ptr + bufferFrames - sync.c.control.appl_ptr;
+        if (avail < 0)
+            avail += boundary;
+        else if ((snd_pcm_uframes_t)avail >= boundary)
+            avail -= boundary;
+
+        if (avail == 0) {
+            if (sync.s.status.state == SNDRV_PCM_STATE_PREPARED) {
+                // Ring is full and nobody started the DMA yet
+                if (ioctl(pcm->fd, SNDRV_PCM_IOCTL_START)) {
+                    return -errno;
+                }
+                continue;
+            }
+            pfd.fd = pcm->fd;
+            pfd.events = POLLOUT | POLLERR;
+            pfd.revents = 0;
+            ret = poll(&pfd, 1, MMAP_POLL_TIMEOUT_MS);
+            if (ret < 0) {
+                if (errno == EINTR)
+                    continue;
+                return -errno;
+            } else if (ret == 0) {
+                LOGE("s_mmap_write: timed out waiting for DMA");
+                return -EIO;
+            } else if (pfd.revents & POLLERR) {
+                return -EPIPE;
+            }
+            continue;
+        }
+
+        offset = sync.c.control.appl_ptr % bufferFrames;
+        chunk = frames;
+        if (chunk > (snd_pcm_uframes_t)avail)
+            chunk = avail;
+        if (chunk > bufferFrames - offset)
+            chunk = bufferFrames - offset;
+
+        memcpy((char *)pcm->addr + offset * frameSize, src, chunk * frameSize);
+
+        sync.c.control.appl_ptr += chunk;
+        if (sync.c.control.appl_ptr >= boundary)
+            sync.c.control.appl_ptr -= boundary;
+        sync.flags = SNDRV_PCM_SYNC_PTR_AVAIL_MIN;
+        if (ioctl(pcm->fd, SNDRV_PCM_IOCTL_SYNC_PTR, &sync) < 0) {
+            return -errno;
+        }
+
+        if (sync.s.status.state == SNDRV_PCM_STATE_PREPARED) {
+            if (ioctl(pcm->fd, SNDRV_PCM_IOCTL_START)) {
+                return -errno;
+            }
+        }
+
+        src += chunk * frameSize;
+        frames -= chunk;
+    }
+
+    return NO_ERROR;
+}
+
+/*
+    Copy captured frames straight out of the mapped DMA ring and hand the
+    space back through SNDRV_PCM_IOCTL_SYNC_PTR, starting the DMA on the
+    first read. Returns 0 or -errno like pcm_read(), -EPIPE on overrun.
+*/
+static status_t s_mmap_read(alsa_handle_t *handle, void *buffer, size_t bytes)
+{
+    struct pcm *pcm = handle->handle;
+    struct snd_pcm_sync_ptr sync;
+    struct pollfd pfd;
+    char *dst = (char *)buffer;
+    unsigned int frameSize = frameBytes(handle);
+    snd_pcm_uframes_t bufferFrames, boundary, frames, offset, chunk;
+    snd_pcm_sframes_t avail;
+    int ret;
+
+    if (!pcm || !pcm->addr) {
+        LOGE("s_mmap_read: no mapped PCM");
+        return -EBADFD;
+    }
+
+    bufferFrames = pcm->buffer_size / frameSize;
+    boundary = pcmBoundary(bufferFrames);
+    frames = bytes / frameSize;
+
+    while (frames > 0) {
+        memset(&sync, 0, sizeof(sync));
+        sync.flags = SNDRV_PCM_SYNC_PTR_HWSYNC | SNDRV_PCM_SYNC_PTR_APPL |
+                     SNDRV_PCM_SYNC_PTR_AVAIL_MIN;
+        if (ioctl(pcm->fd, SNDRV_PCM_IOCTL_SYNC_PTR, &sync) < 0) {
+            return -errno;
+        }
+        if (sync.s.status.state == SNDRV_PCM_STATE_XRUN) {
+            return -EPIPE;
+        }
+        if (sync.s.status.state == SNDRV_PCM_STATE_PREPARED) {
+            if (ioctl(pcm->fd, SNDRV_PCM_IOCTL_START)) {
+                return -errno;
+            }
+            continue;
+        }
+
+        avail = sync.s.status.hw_ptr - sync.c.control.appl_ptr;
+        if (avail < 0)
+            avail += boundary;
+        if ((snd_pcm_uframes_t)avail > bufferFrames) {
+            // The DMA lapped us before the kernel noticed
+            return -EPIPE;
+        }
+
+        if (avail == 0) {
+            pfd.fd = pcm->fd;
+            pfd.events = POLLIN | POLLERR;
+            pfd.revents = 0;
+            ret = poll(&pfd, 1, MMAP_POLL_TIMEOUT_MS);
+            if (ret < 0) {
+                if (errno == EINTR)
+                    continue;
+                return -errno;
+            } else if (ret == 0) {
+                LOGE("s_mmap_read: timed out waiting for DMA");
+                return -EIO;
+            } else if (pfd.revents & POLLERR) {
+                return -EPIPE;
+            }
+            continue;
+        }
+
+        offset = sync.c.control.appl_ptr % bufferFrames;
+        chunk = frames;
+        if (chunk > (snd_pcm_uframes_t)avail)
+            chunk = avail;
+        if (chunk > bufferFrames - offset)
+            chunk = bufferFrames - offset;
+
+        memcpy(dst, (char *)pcm->addr + offset * frameSize, chunk * frameSize);
+
+        sync.c.control.appl_ptr += chunk;
+        if (sync.c.control.appl_ptr >= boundary)
+            sync.c.control.appl_ptr -= boundary;
+        sync.flags = SNDRV_PCM_SYNC_PTR_AVAIL_MIN;
+        if (ioctl(pcm->fd, SNDRV_PCM_IOCTL_SYNC_PTR, &sync) < 0) {
+            return -errno;
+        }
+
+        dst += chunk * frameSize;
+        frames -= chunk;
+    }
+
+    return NO_ERROR;
+}
+
+/*
+    Frames queued between the application pointer and the DAC, sampled
+    together with CLOCK_MONOTONIC for A/V sync.
+*/
+static status_t s_get_delay(struct pcm *pcm, snd_pcm_sframes_t *delay,
+                            struct timespec *tstamp)
+{
+    snd_pcm_sframes_t frames = 0;
+
+    if (!pcm) {
+        return NO_INIT;
+    }
+    if (ioctl(pcm->fd, SNDRV_PCM_IOCTL_DELAY, &frames) < 0) {
+        LOGV("s_get_delay: SNDRV_PCM_IOCTL_DELAY failed: %d", errno);
+        return -errno;
+    }
+    clock_gettime(CLOCK_MONOTONIC, tstamp);
+    *delay = frames;
+    return NO_ERROR;
+}
+
 static status_t s_route(alsa_handle_t *handle, uint32_t devices, int mode)
 {
     status_t status = NO_ERROR;
@@ -0,0 +1,243 @@
+/* ALSAKernels_benchmark.cpp
+ **
+ ** Copyright (c) 2012, Code Aurora Forum. All rights reserved.
+ **
+ ** Licensed under the Apache License, Version 2.0 (the "License");
+ ** you may not use this file except in compliance with the License.
+ ** You may obtain a copy of the License at
+ **
+ **     http://www.apache.org/licenses/LICENSE-2.0
+ **
+ ** Unless required by applicable law or agreed to in writing, software
+ ** distributed under the License is distributed on an "AS IS" BASIS,
+ ** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ ** See the License for the specific language governing permissions and
+ ** limitations under the License.
+ */
+
+//
+// Cost of the per period work of the mixer, the resampler, stream volume,
+// capture pre-processing and multi-mic capture on 20 ms periods. Each line
+// gives the time one period takes and the share of real time that is, run
+// on an idle device with the CPU governor pinned for numbers that compare.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "AudioHardwareALSA.h"
+
+using namespace android_audio_legacy;
+
+#define PERIOD_MS       20
+#define PERIODS         500
+#define MAX_RATE        48000
+#define MAX_FRAMES      (MAX_RATE * PERIOD_MS / 1000)
+#define MAX_STREAMS     8
+
+static int16_t sInput[ALSA_MAX_CHANNELS * 2 * MAX_FRAMES];
+static int16_t sOutput[ALSA_MAX_CHANNELS * 2 * MAX_FRAMES];
+
+static void fill(int16_t *buf, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        buf[i] = (rand() % 16384) - 8192;
+    }
+}
+
+static void report(const char *name, nsecs_t elapsed)
+{
+    double us = (double)elapsed / 1000.0 / PERIODS;
+
+    printf("%-36s %9.1f us/period %7.2f%% cpu\n", name, us,
+           100.0 * us / (PERIOD_MS * 1000.0));
+}
+
+// Follows ALSAStreamMixer::mixPeriod(): up to two tracks saturate straight
+// into the period, more go through the float accumulator
+static void benchMixer()
+{
+    static int16_t tracks[MAX_STREAMS][2 * MAX_FRAMES];
+    static float acc[2 * MAX_FRAMES];
+    size_t samples = 2 * MAX_FRAMES;
+    char name[64];
+
+    for (int t = 0; t < MAX_STREAMS; t++) {
+        fill(tracks[t], samples);
+    }
+    for (int streams = 2; streams <= MAX_STREAMS; streams++) {
+        nsecs_t start = systemTime();
+
+        for (int p = 0; p < PERIODS; p++) {
+            if (streams <= 2) {
+                memset(sOutput, 0, samples * sizeof(int16_t));
+                for (int t = 0; t < streams; t++) {
+                    mix_s16(sOutput, tracks[t], samples, ALSA_GAIN_UNITY_Q15 / 2);
+                }
+            } else {
+                memset(acc, 0, samples * sizeof(float));
+                for (int t = 0; t < streams; t++) {
+                    mix_s16_to_float(acc, tracks[t], samples, 0.5f);
+                }
+                float_to_s16(sOutput, acc, samples);
+            }
+        }
+        snprintf(name, sizeof(name), "mix %d streams", streams);
+        report(name, systemTime() - start);
+    }
+}
+
+static void benchResampler()
+{
+    static const struct {
+        uint32_t in;
+        uint32_t out;
+    } sRates[] = {
+        { 44100, 48000 }, { 48000, 44100 },
+        { 8000, 48000 }, { 16000, 48000 }, { 32000, 48000 },
+    };
+    static const char *sQuality[] = { "off", "low", "medium", "high" };
+    char name[64];
+
+    fill(sInput, 2 * 2 * MAX_FRAMES);
+    for (int q = ALSA_RESAMPLER_LOW; q <= ALSA_RESAMPLER_HIGH; q++) {
+        for (size_t r = 0; r < sizeof(sRates) / sizeof(sRates[0]); r++) {
+            if (!ALSAResampler::isSupported(sRates[r].in, sRates[r].out))
+                continue;
+
+            ALSAResampler resampler(sRates[r].in, sRates[r].out, 2, q);
+            size_t outFrames = sRates[r].out * PERIOD_MS / 1000;
+            nsecs_t start;
+
+            if (resampler.initCheck() != NO_ERROR)
+                continue;
+            start = systemTime();
+            for (int p = 0; p < PERIODS; p++) {
+                size_t produced = 0;
+
+                while (produced < outFrames) {
+                    size_t inFrames = resampler.inputFramesFor(outFrames - produced);
+                    produced += resampler.resample(sInput, &inFrames,
+                                                   sOutput + 2 * produced,
+                                                   outFrames - produced);
+                }
+            }
+            snprintf(name, sizeof(name), "resample %u to %u %s", sRates[r].in,
+                     sRates[r].out, sQuality[q]);
+            report(name, systemTime() - start);
+        }
+    }
+}
+
+static void benchVolume()
+{
+    static float fin[2 * MAX_FRAMES];
+    static float fout[2 * MAX_FRAMES];
+    float step = -0.5f / MAX_FRAMES;
+    nsecs_t start;
+
+    fill(sInput, 2 * MAX_FRAMES);
+    for (size_t i = 0; i < 2 * MAX_FRAMES; i++) {
+        fin[i] = sInput[i] / 32768.0f;
+    }
+
+    start = systemTime();
+    for (int p = 0; p < PERIODS; p++) {
+        volume_s16(sOutput, sInput, MAX_FRAMES, 2, 0.7f, 0.3f);
+    }
+    report("volume_s16 stereo", systemTime() - start);
+
+    start = systemTime();
+    for (int p = 0; p < PERIODS; p++) {
+        volume_ramp_s16(sOutput, sInput, MAX_FRAMES, 2, 1.0f, 1.0f, step, step);
+    }
+    report("volume_ramp_s16 stereo", systemTime() - start);
+
+    start = systemTime();
+    for (int p = 0; p < PERIODS; p++) {
+        volume_float(fout, fin, MAX_FRAMES, 2, 0.7f, 0.3f);
+    }
+    report("volume_float stereo", systemTime() - start);
+
+    start = systemTime();
+    for (int p = 0; p < PERIODS; p++) {
+        volume_ramp_float(fout, fin, MAX_FRAMES, 2, 1.0f, 1.0f, step, step);
+    }
+    report("volume_ramp_float stereo", systemTime() - start);
+}
+
+// The buffer is refilled outside the timed call, the stages adapt to the
+// level they see and would otherwise settle on silence
+static void benchPreProcessor()
+{
+    static const struct {
+        uint32_t stages;
+        const char *name;
+    } sStages[] = {
+        { ALSA_PREPROC_HPF, "hpf" },
+        { ALSA_PREPROC_NS, "ns" },
+        { ALSA_PREPROC_AGC, "agc" },
+        { ALSA_PREPROC_HPF | ALSA_PREPROC_NS | ALSA_PREPROC_AGC, "hpf+ns+agc" },
+    };
+    static const uint32_t sRates[] = { 16000, 48000 };
+    char name[64];
+
+    fill(sInput, 2 * MAX_FRAMES);
+    for (size_t s = 0; s < sizeof(sStages) / sizeof(sStages[0]); s++) {
+        for (size_t r = 0; r < sizeof(sRates) / sizeof(sRates[0]); r++) {
+            ALSAPreProcessor preProcessor;
+            size_t frames = sRates[r] * PERIOD_MS / 1000;
+            nsecs_t elapsed = 0;
+
+            preProcessor.setStages(sStages[s].stages);
+            for (int p = 0; p < PERIODS; p++) {
+                nsecs_t start;
+
+                memcpy(sOutput, sInput, 2 * frames * sizeof(int16_t));
+                start = systemTime();
+                preProcessor.process(sOutput, frames, sRates[r], 2);
+                elapsed += systemTime() - start;
+            }
+            snprintf(name, sizeof(name), "preproc %s stereo %u", sStages[s].name,
+                     sRates[r]);
+            report(name, elapsed);
+        }
+    }
+}
+
+static void benchMultiMic()
+{
+    char name[64];
+
+    fill(sInput, ALSA_MAX_CHANNELS * MAX_FRAMES);
+    for (uint32_t channels = 2; channels <= 4; channels++) {
+        nsecs_t start = systemTime();
+
+        for (int p = 0; p < PERIODS; p++) {
+            deinterleave_s16(sOutput, sInput, channels, MAX_FRAMES);
+        }
+        snprintf(name, sizeof(name), "deinterleave %u mics", channels);
+        report(name, systemTime() - start);
+
+        start = systemTime();
+        for (int p = 0; p < PERIODS; p++) {
+            downmix_s16(sOutput, sInput, channels, MAX_FRAMES);
+        }
+        snprintf(name, sizeof(name), "downmix %u mics", channels);
+        report(name, systemTime() - start);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    srand(1);
+    printf("%d periods of %d ms\n", PERIODS, PERIOD_MS);
+    benchMixer();
+    benchResampler();
+    benchVolume();
+    benchPreProcessor();
+    benchMultiMic();
+    return 0;
+}
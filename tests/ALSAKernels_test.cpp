@@ -0,0 +1,618 @@
+/* ALSAKernels_test.cpp
+ **
+ ** Copyright (c) 2012, Code Aurora Forum. All rights reserved.
+ **
+ ** Licensed under the Apache License, Version 2.0 (the "License");
+ ** you may not use this file except in compliance with the License.
+ ** You may obtain a copy of the License at
+ **
+ **     http://www.apache.org/licenses/LICENSE-2.0
+ **
+ ** Unless required by applicable law or agreed to in writing, software
+ ** distributed under the License is distributed on an "AS IS" BASIS,
+ ** WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ ** See the License for the specific language governing permissions and
+ ** limitations under the License.
+ */
+
+//
+// Parity of the sample processing kernels with plain C. Built for the
+// target the NEON bodies run, on an SSE2 host the SSE2 ones. Counts cover
+// every tail length, samples include full scale values the sums must not
+// overflow on and floats exactly halfway between two integers.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#include "AudioHardwareALSA.h"
+
+using namespace android_audio_legacy;
+
+#define MAX_CHANNELS    4
+#define MAX_FRAMES      67
+#define ITERATIONS      200
+#define MAX_CONVERT     (3 * ITERATIONS)
+
+static int16_t randomSample()
+{
+    switch (rand() % 8) {
+    case 0:
+        return -32768;
+    case 1:
+        return 32767;
+    default:
+        return (int16_t)(rand() - RAND_MAX / 2);
+    }
+}
+
+static float randomFloat()
+{
+    switch (rand() % 8) {
+    case 0:
+        // Halfway between two 16 bit steps
+        return ((rand() % 65536) - 32768 + 0.5f) / 32768.0f;
+    case 1:
+        return (rand() % 2) ? 1.0f : -1.0f;
+    case 2:
+        // Out of range, saturates
+        return (rand() % 2) ? 1.5f : -1.5f;
+    case 3:
+        return 0.0f;
+    default:
+        return (float)rand() / RAND_MAX * 2.0f - 1.0f;
+    }
+}
+
+static int16_t clampS16(int32_t v)
+{
+    return v > 32767 ? 32767 : v < -32768 ? -32768 : v;
+}
+
+static int16_t roundS16(float f)
+{
+    return clampS16((int32_t)(f > 0 ? f + 0.5f : f - 0.5f));
+}
+
+// A fused multiply-add in either the kernel or the reference rounds once
+// instead of twice, so sums of products only match to the last bit
+static bool nearlyEqual(float a, float b)
+{
+    return fabsf(a - b) <= 1e-6f * (fabsf(b) > 1.0f ? fabsf(b) : 1.0f);
+}
+
+static int checkMix(size_t count)
+{
+    int16_t src[MAX_CHANNELS * MAX_FRAMES];
+    int16_t dst[MAX_CHANNELS * MAX_FRAMES];
+    int16_t expected[MAX_CHANNELS * MAX_FRAMES];
+    // Below, at and above unity, which skips the multiply
+    uint32_t gain = (rand() % 4) ? rand() % ALSA_GAIN_UNITY_Q15 :
+                    ALSA_GAIN_UNITY_Q15 + rand() % 2 * 0x1000;
+
+    for (size_t i = 0; i < count; i++) {
+        int32_t s;
+
+        src[i] = randomSample();
+        dst[i] = randomSample();
+        s = src[i];
+        if (gain < ALSA_GAIN_UNITY_Q15)
+            s = (s * (int32_t)gain + (1 << 14)) >> 15;
+        expected[i] = clampS16(dst[i] + s);
+    }
+    mix_s16(dst, src, count, gain);
+    for (size_t i = 0; i < count; i++) {
+        if (dst[i] != expected[i]) {
+            printf("mix_s16: %u samples gain 0x%x, sample %u is %d, expected %d\n",
+                   (unsigned)count, gain, (unsigned)i, dst[i], expected[i]);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int checkMixToFloat(size_t count)
+{
+    int16_t src[MAX_CHANNELS * MAX_FRAMES];
+    float acc[MAX_CHANNELS * MAX_FRAMES];
+    float expected[MAX_CHANNELS * MAX_FRAMES];
+    float gain = (rand() % 257) / 256.0f;
+    float scale = gain * (1.0f / 32768.0f);
+
+    for (size_t i = 0; i < count; i++) {
+        src[i] = randomSample();
+        acc[i] = randomFloat();
+        expected[i] = acc[i] + src[i] * scale;
+    }
+    mix_s16_to_float(acc, src, count, gain);
+    for (size_t i = 0; i < count; i++) {
+        if (!nearlyEqual(acc[i], expected[i])) {
+            printf("mix_s16_to_float: %u samples, sample %u is %g, expected %g\n",
+                   (unsigned)count, (unsigned)i, acc[i], expected[i]);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Coefficients are kept small enough for the 32 bit sum, as the resampler
+// keeps its phases
+static int checkDot(size_t count)
+{
+    int16_t x[MAX_CHANNELS * MAX_FRAMES];
+    int16_t h[MAX_CHANNELS * MAX_FRAMES];
+    int32_t expected = 0;
+    int32_t sum;
+
+    count &= ~7;
+    for (size_t i = 0; i < count; i++) {
+        x[i] = randomSample();
+        h[i] = (rand() % 513) - 256;
+        expected += (int32_t)x[i] * h[i];
+    }
+    sum = dot_s16(x, h, count);
+    if (sum != expected) {
+        printf("dot_s16: %u samples, %d, expected %d\n", (unsigned)count, sum, expected);
+        return 1;
+    }
+    return 0;
+}
+
+static int checkRemap(uint32_t inChannels, uint32_t outChannels, size_t frames)
+{
+    int16_t src[ALSA_MAX_CHANNELS * MAX_FRAMES];
+    int16_t dst[ALSA_MAX_CHANNELS * MAX_FRAMES];
+    int8_t map[ALSA_MAX_CHANNELS];
+
+    for (uint32_t o = 0; o < outChannels; o++) {
+        map[o] = (rand() % (inChannels + 1)) - 1;
+    }
+    for (size_t i = 0; i < inChannels * frames; i++) {
+        src[i] = randomSample();
+    }
+    remap_s16(dst, outChannels, src, inChannels, map, frames);
+    for (size_t i = 0; i < frames; i++) {
+        for (uint32_t o = 0; o < outChannels; o++) {
+            int16_t expected = map[o] >= 0 ? src[i * inChannels + map[o]] : 0;
+            if (dst[i * outChannels + o] != expected) {
+                printf("remap_s16: %u to %u channels %u frames, frame %u channel %u is %d, "
+                       "expected %d\n", inChannels, outChannels, (unsigned)frames,
+                       (unsigned)i, o, dst[i * outChannels + o], expected);
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+// Rows stay below an absolute sum of 4.0 in Q14, zero past inChannels
+static int checkRemix(uint32_t inChannels, uint32_t outChannels, size_t frames)
+{
+    int16_t src[ALSA_MAX_CHANNELS * MAX_FRAMES];
+    int16_t dst[ALSA_MAX_CHANNELS * MAX_FRAMES];
+    int16_t matrix[ALSA_MAX_CHANNELS * 8];
+
+    memset(matrix, 0, sizeof(matrix));
+    for (uint32_t o = 0; o < outChannels; o++) {
+        for (uint32_t c = 0; c < inChannels; c++) {
+            matrix[o * 8 + c] = (rand() % 16383) - 8191;
+        }
+    }
+    for (size_t i = 0; i < inChannels * frames; i++) {
+        src[i] = randomSample();
+    }
+    remix_s16(dst, outChannels, src, inChannels, matrix, frames);
+    for (size_t i = 0; i < frames; i++) {
+        for (uint32_t o = 0; o < outChannels; o++) {
+            int32_t acc = 0;
+            int16_t expected;
+
+            for (uint32_t c = 0; c < inChannels; c++) {
+                acc += (int32_t)src[i * inChannels + c] * matrix[o * 8 + c];
+            }
+            expected = clampS16((acc + (1 << 13)) >> 14);
+            if (dst[i * outChannels + o] != expected) {
+                printf("remix_s16: %u to %u channels %u frames, frame %u channel %u is %d, "
+                       "expected %d\n", inChannels, outChannels, (unsigned)frames,
+                       (unsigned)i, o, dst[i * outChannels + o], expected);
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+static int16_t gainQ15(float gain)
+{
+    int32_t q = (int32_t)(gain * 32768.0f + 0.5f);
+    return q > 0x7FFF ? 0x7FFF : (q < 0 ? 0 : q);
+}
+
+static int checkVolume(const int16_t *src, uint32_t channels, size_t frames)
+{
+    int16_t dst[MAX_CHANNELS * MAX_FRAMES];
+    float fsrc[MAX_CHANNELS * MAX_FRAMES];
+    float fdst[MAX_CHANNELS * MAX_FRAMES];
+    float left = (rand() % 1025) / 1024.0f;
+    float right = (rand() % 1025) / 1024.0f;
+
+    for (size_t i = 0; i < channels * frames; i++) {
+        fsrc[i] = randomFloat();
+    }
+    volume_s16(dst, src, frames, channels, left, right);
+    volume_float(fdst, fsrc, frames, channels, left, right);
+    for (size_t f = 0; f < frames; f++) {
+        for (uint32_t c = 0; c < channels; c++) {
+            bool isRight = (channels == 2) && (c == 1);
+            size_t i = f * channels + c;
+            int32_t gain = gainQ15(isRight ? right : left);
+            int16_t expected = ((int32_t)src[i] * gain + (1 << 14)) >> 15;
+            float fexpected = fsrc[i] * (isRight ? right : left);
+
+            if (dst[i] != expected) {
+                printf("volume_s16: %u channels %u frames, sample %u is %d, expected %d\n",
+                       channels, (unsigned)frames, (unsigned)i, dst[i], expected);
+                return 1;
+            }
+            if (fdst[i] != fexpected) {
+                printf("volume_float: %u channels %u frames, sample %u is %g, expected %g\n",
+                       channels, (unsigned)frames, (unsigned)i, fdst[i], fexpected);
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+static int checkVolumeRampFloat(uint32_t channels, size_t frames)
+{
+    float src[MAX_CHANNELS * MAX_FRAMES];
+    float dst[MAX_CHANNELS * MAX_FRAMES];
+    float left = (rand() % 257) / 256.0f;
+    float right = (rand() % 257) / 256.0f;
+    float stepLeft = ((rand() % 65) - 32) / 65536.0f;
+    float stepRight = ((rand() % 65) - 32) / 65536.0f;
+
+    for (size_t i = 0; i < channels * frames; i++) {
+        src[i] = randomFloat();
+    }
+    volume_ramp_float(dst, src, frames, channels, left, right, stepLeft, stepRight);
+    for (size_t f = 0; f < frames; f++) {
+        for (uint32_t c = 0; c < channels; c++) {
+            bool isRight = (channels == 2) && (c == 1);
+            float gain = isRight ? right + f * stepRight : left + f * stepLeft;
+            float expected = src[f * channels + c] * gain;
+            if (dst[f * channels + c] != expected) {
+                printf("volume_ramp_float: %u channels %u frames, frame %u channel %u is %g, "
+                       "expected %g\n", channels, (unsigned)frames, (unsigned)f, c,
+                       dst[f * channels + c], expected);
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+static int checkEnergy(const int16_t *src, size_t count)
+{
+    uint64_t expected = 0;
+    int32_t expectedPeak = 0;
+    uint64_t sum;
+    int32_t peak;
+
+    for (size_t i = 0; i < count; i++) {
+        int32_t v = src[i];
+        expected += (uint64_t)(v * v);
+        v = v < 0 ? -v : v;
+        if (v > 32767)
+            v = 32767;
+        if (v > expectedPeak)
+            expectedPeak = v;
+    }
+    sum = energy_s16(src, count, &peak);
+    if ((sum != expected) || (peak != expectedPeak)) {
+        printf("energy_s16: %u samples, %llu peak %d, expected %llu peak %d\n",
+               (unsigned)count, (unsigned long long)sum, peak,
+               (unsigned long long)expected, expectedPeak);
+        return 1;
+    }
+    return 0;
+}
+
+static int checkDeinterleave(const int16_t *src, uint32_t channels, size_t frames)
+{
+    int16_t dst[MAX_CHANNELS * MAX_FRAMES];
+
+    deinterleave_s16(dst, src, channels, frames);
+    for (size_t i = 0; i < frames; i++) {
+        for (uint32_t c = 0; c < channels; c++) {
+            if (dst[c * frames + i] != src[i * channels + c]) {
+                printf("deinterleave_s16: %u channels %u frames, mismatch at "
+                       "frame %u channel %u\n", channels, (unsigned)frames, (unsigned)i, c);
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+static int checkDownmix(const int16_t *src, uint32_t channels, size_t frames)
+{
+    int16_t dst[MAX_FRAMES];
+
+    downmix_s16(dst, src, channels, frames);
+    for (size_t i = 0; i < frames; i++) {
+        int32_t sum = 0;
+        int32_t expected;
+
+        for (uint32_t c = 0; c < channels; c++) {
+            sum += src[i * channels + c];
+        }
+        // The powers of two floor, like the shifts of the vector bodies
+        if (channels == 2) {
+            expected = sum >> 1;
+        } else if (channels == 4) {
+            expected = sum >> 2;
+        } else {
+            expected = sum / (int32_t)channels;
+        }
+        if (dst[i] != expected) {
+            printf("downmix_s16: %u channels %u frames, frame %u is %d, "
+                   "expected %d\n", channels, (unsigned)frames, (unsigned)i, dst[i], expected);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// The state is carried over from the previous call, like a capture does
+static int checkHighpass(const int16_t *src, uint32_t channels, size_t frames,
+                         float *state, float *expectedState)
+{
+    const float pole = 0.995f;
+    int16_t dst[MAX_CHANNELS * MAX_FRAMES];
+    int16_t expected[MAX_CHANNELS * MAX_FRAMES];
+
+    for (size_t i = 0; i < channels * frames; i++) {
+        dst[i] = expected[i] = src[i];
+    }
+    highpass_s16(dst, frames, channels, pole, state);
+    for (uint32_t c = 0; c < channels; c++) {
+        float x1 = expectedState[2 * c];
+        float y1 = expectedState[2 * c + 1];
+
+        for (size_t i = 0; i < frames; i++) {
+            float x = expected[i * channels + c];
+            float y = x - x1 + pole * y1;
+            int32_t v = (int32_t)(y > 0 ? y + 0.5f : y - 0.5f);
+            x1 = x;
+            y1 = y;
+            expected[i * channels + c] = v > 32767 ? 32767 : v < -32768 ? -32768 : v;
+        }
+        expectedState[2 * c] = x1;
+        expectedState[2 * c + 1] = y1;
+    }
+    for (size_t i = 0; i < channels * frames; i++) {
+        if (dst[i] != expected[i]) {
+            printf("highpass_s16: %u channels %u frames, sample %u is %d, "
+                   "expected %d\n", channels, (unsigned)frames, (unsigned)i, dst[i], expected[i]);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int checkFloatToS16(size_t count)
+{
+    float src[MAX_CHANNELS * MAX_FRAMES];
+    int16_t dst[MAX_CHANNELS * MAX_FRAMES];
+
+    for (size_t i = 0; i < count; i++) {
+        src[i] = randomFloat();
+    }
+    float_to_s16(dst, src, count);
+    for (size_t i = 0; i < count; i++) {
+        float f = src[i] * 32768.0f;
+        int16_t expected = f >= 32767.0f ? 32767 : f <= -32768.0f ? -32768 : roundS16(f);
+        if (dst[i] != expected) {
+            printf("float_to_s16: %u samples, %f gives %d, expected %d\n",
+                   (unsigned)count, src[i], dst[i], expected);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Gains and steps are multiples of 2^-16 so the vector bodies, which add
+// the step up, and the C loop, which multiplies it, agree exactly
+static int checkVolumeRampS16(const int16_t *src, uint32_t channels, size_t frames)
+{
+    int16_t dst[MAX_CHANNELS * MAX_FRAMES];
+    float left = (rand() % 257) / 256.0f;
+    float right = (rand() % 257) / 256.0f;
+    float stepLeft = ((rand() % 65) - 32) / 65536.0f;
+    float stepRight = ((rand() % 65) - 32) / 65536.0f;
+
+    volume_ramp_s16(dst, src, frames, channels, left, right, stepLeft, stepRight);
+    for (size_t f = 0; f < frames; f++) {
+        for (uint32_t c = 0; c < channels; c++) {
+            bool isRight = (channels == 2) && (c == 1);
+            float gain = isRight ? right + f * stepRight : left + f * stepLeft;
+            int16_t expected = roundS16(src[f * channels + c] * gain);
+            if (dst[f * channels + c] != expected) {
+                printf("volume_ramp_s16: %u channels %u frames, frame %u channel %u is %d, "
+                       "expected %d\n", channels, (unsigned)frames, (unsigned)f, c,
+                       dst[f * channels + c], expected);
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+//
+// convert_pcm() against a per sample reference through Q31
+//
+
+static const snd_pcm_format_t sFormats[] = {
+    SNDRV_PCM_FORMAT_S8,
+    SNDRV_PCM_FORMAT_S16_LE,
+    SNDRV_PCM_FORMAT_S24_LE,
+    SNDRV_PCM_FORMAT_S24_3LE,
+    SNDRV_PCM_FORMAT_S32_LE,
+    SNDRV_PCM_FORMAT_FLOAT_LE,
+};
+
+#define FORMAT_COUNT    (sizeof(sFormats) / sizeof(sFormats[0]))
+
+static int32_t referenceToQ31(const uint8_t *p, snd_pcm_format_t format)
+{
+    int32_t v;
+    float f;
+
+    switch (format) {
+    case SNDRV_PCM_FORMAT_S8:
+        return (int32_t)(int8_t)p[0] << 24;
+    case SNDRV_PCM_FORMAT_S16_LE:
+        return (int32_t)(int16_t)(p[0] | (p[1] << 8)) << 16;
+    case SNDRV_PCM_FORMAT_S24_3LE:
+        return (int32_t)(((uint32_t)p[0] << 8) | ((uint32_t)p[1] << 16) |
+                         ((uint32_t)p[2] << 24));
+    case SNDRV_PCM_FORMAT_S24_LE:
+        memcpy(&v, p, sizeof(v));
+        return (int32_t)((uint32_t)v << 8);
+    case SNDRV_PCM_FORMAT_FLOAT_LE:
+        memcpy(&f, p, sizeof(f));
+        f *= 2147483648.0f;
+        if (f >= 2147483648.0f)
+            return 0x7FFFFFFF;
+        if (f <= -2147483648.0f)
+            return (int32_t)0x80000000;
+        return (int32_t)(f > 0 ? f + 0.5f : f - 0.5f);
+    default:
+        memcpy(&v, p, sizeof(v));
+        return v;
+    }
+}
+
+static void referenceFromQ31(uint8_t *p, int32_t q, snd_pcm_format_t format)
+{
+    int32_t v;
+    int16_t s;
+    float f;
+
+    switch (format) {
+    case SNDRV_PCM_FORMAT_S8:
+        v = ((q >> 23) + 1) >> 1;
+        p[0] = (uint8_t)(v > 127 ? 127 : v);
+        break;
+    case SNDRV_PCM_FORMAT_S16_LE:
+        v = ((q >> 15) + 1) >> 1;
+        s = v > 32767 ? 32767 : v;
+        memcpy(p, &s, sizeof(s));
+        break;
+    case SNDRV_PCM_FORMAT_S24_3LE:
+        p[0] = (uint8_t)(q >> 8);
+        p[1] = (uint8_t)(q >> 16);
+        p[2] = (uint8_t)(q >> 24);
+        break;
+    case SNDRV_PCM_FORMAT_S24_LE:
+        v = q >> 8;
+        memcpy(p, &v, sizeof(v));
+        break;
+    case SNDRV_PCM_FORMAT_FLOAT_LE:
+        f = q * (1.0f / 2147483648.0f);
+        memcpy(p, &f, sizeof(f));
+        break;
+    default:
+        memcpy(p, &q, sizeof(q));
+        break;
+    }
+}
+
+static int checkConvert(snd_pcm_format_t srcFormat, snd_pcm_format_t dstFormat, size_t count)
+{
+    // The SSSE3 S24_3LE bodies load and store past the last sample
+    uint8_t src[MAX_CONVERT * 4 + 16];
+    uint8_t dst[MAX_CONVERT * 4 + 16];
+    uint8_t expected[MAX_CONVERT * 4 + 16];
+    size_t srcBytes = pcm_format_bytes(srcFormat);
+    size_t dstBytes = pcm_format_bytes(dstFormat);
+
+    for (size_t i = 0; i < count; i++) {
+        if (srcFormat == SNDRV_PCM_FORMAT_FLOAT_LE) {
+            float f = randomFloat();
+            memcpy(src + i * 4, &f, sizeof(f));
+        } else {
+            for (size_t b = 0; b < srcBytes; b++) {
+                src[i * srcBytes + b] = (uint8_t)rand();
+            }
+        }
+    }
+    for (size_t i = 0; i < count; i++) {
+        int32_t q = referenceToQ31(src + i * srcBytes, srcFormat);
+        if (srcFormat == dstFormat) {
+            memcpy(expected + i * dstBytes, src + i * srcBytes, srcBytes);
+        } else {
+            referenceFromQ31(expected + i * dstBytes, q, dstFormat);
+        }
+    }
+
+    convert_pcm(dst, dstFormat, src, srcFormat, count);
+    for (size_t i = 0; i < count; i++) {
+        if (memcmp(dst + i * dstBytes, expected + i * dstBytes, dstBytes)) {
+            printf("convert_pcm: format %d to %d, %u samples, mismatch at %u\n",
+                   srcFormat, dstFormat, (unsigned)count, (unsigned)i);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int16_t src[MAX_CHANNELS * MAX_FRAMES];
+    float state[MAX_CHANNELS + 1][2 * MAX_CHANNELS] = { { 0 } };
+    float expectedState[MAX_CHANNELS + 1][2 * MAX_CHANNELS] = { { 0 } };
+    int failures = 0;
+
+    srand(1);
+    for (int n = 0; n < ITERATIONS; n++) {
+        for (uint32_t channels = 1; channels <= MAX_CHANNELS; channels++) {
+            size_t frames = n % (MAX_FRAMES + 1);
+
+            for (size_t i = 0; i < channels * frames; i++) {
+                src[i] = randomSample();
+            }
+            failures += checkDeinterleave(src, channels, frames);
+            failures += checkDownmix(src, channels, frames);
+            failures += checkHighpass(src, channels, frames, state[channels],
+                                      expectedState[channels]);
+            failures += checkVolumeRampS16(src, channels, frames);
+            failures += checkVolumeRampFloat(channels, frames);
+            failures += checkVolume(src, channels, frames);
+            failures += checkEnergy(src, channels * frames);
+        }
+        for (uint32_t in = 1; in <= ALSA_MAX_CHANNELS; in++) {
+            for (uint32_t out = 1; out <= ALSA_MAX_CHANNELS; out++) {
+                failures += checkRemap(in, out, n % (MAX_FRAMES + 1));
+                failures += checkRemix(in, out, n % (MAX_FRAMES + 1));
+            }
+        }
+        failures += checkFloatToS16(n % (MAX_CHANNELS * MAX_FRAMES + 1));
+        failures += checkMix(n % (MAX_CHANNELS * MAX_FRAMES + 1));
+        failures += checkMixToFloat(n % (MAX_CHANNELS * MAX_FRAMES + 1));
+        failures += checkDot(n % (MAX_CHANNELS * MAX_FRAMES + 1));
+        for (size_t i = 0; i < FORMAT_COUNT; i++) {
+            for (size_t o = 0; o < FORMAT_COUNT; o++) {
+                failures += checkConvert(sFormats[i], sFormats[o], 3 * n);
+            }
+        }
+    }
+
+    printf("%s: %d failures\n", argv[0], failures);
+    return failures ? 1 : 0;
+}